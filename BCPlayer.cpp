@@ -15,9 +15,36 @@ using namespace std;
 // to make it ready to rock immediately!
 BCPlayer::BCPlayer()
 {
+	loaderBusy = false;
+	loaderTarget = NULL;
 	initialize();
 }
 
+// extra tracks were created on demand - let them go
+BCPlayer::~BCPlayer()
+{
+	// nothing may render the tracks from here on - render thread, then the callback
+	mplayer.declareAppTermination();
+	mplayer.stopRenderAhead();
+	mplayer.stopStream();
+	
+	// songs still on their way in are dropped
+	if(loaderThread.joinable())
+		loaderThread.join();
+	for(int t=0; t<MPlayer::N_TRACKS; t++)
+	{
+		MPlayer* p = mplayer.getTrack(t);
+		if(p != NULL)
+		{
+			delete p->incomingSong.exchange(NULL);
+			delete p->outgoingSong.exchange(NULL);
+		}
+	}
+	
+	for(int t=1; t<MPlayer::N_TRACKS; t++)
+		delete mplayer.track[t].exchange(NULL);
+}
+
 // initializes the BCPlayer
 bool BCPlayer::initialize()
 {
@@ -28,6 +55,7 @@ bool BCPlayer::initialize()
 	
 	// initialize our MML - this will be our MML music source parser
 	mml.initialize(44100, 120.0); // use default sample rate and tempo
+	loaderMML.initialize(44100, 120.0);
 
 	// set to default source with empty data
 	string defaultSource = " ";
@@ -63,19 +91,23 @@ void BCPlayer::resetAudioDevice()
 // gets BCPlayer ready to play the song immediately
 bool BCPlayer::loadMusic(const std::string &fileName)
 {
+	std::lock_guard<std::mutex> guard(mplayer.aheadLock); // (render-ahead mode - keep the render thread out)
 	bool result = true;
 	mplayer.pause();
+	sfx.clearSongTriggers();
 	mplayer.resetForNewSong();
-	string response = mml.loadFile(fileName, &mplayer); // must pass a c++ string
+	string response = mml.loadFile(fileName, &mplayer); // must pass a c++ string (parses, too)
 	
 	// see if loading resulted in error
-	if(response=="Error")
+	if(response == MML::LOAD_ERROR)
 		result = false;
 	else
 	{
-		mml.parse(&mplayer);
+		mplayer.prepareLoopState();
 		mplayer.goToBeginning();
+		mplayer.musicEvents.clear(); // drop notifications left from previous song
 	}
+	mplayer.flushAhead(false);
 	
 	return result;
 }
@@ -85,9 +117,12 @@ bool BCPlayer::loadMusic(const std::string &fileName)
 // - by using loadString(std::string) function
 std::string BCPlayer::loadFileToString(const std::string &fileName)
 {
+	std::lock_guard<std::mutex> guard(mplayer.aheadLock);
 	mplayer.pause();
+	sfx.clearSongTriggers();
 	mplayer.resetForNewSong();
 	std::string result = mml.loadFile(fileName, &mplayer); // must pass a c++ string
+	mplayer.flushAhead(false);
 	return result;
 }
 
@@ -95,31 +130,68 @@ std::string BCPlayer::loadFileToString(const std::string &fileName)
 // after loading you can start() to play
 void BCPlayer::loadString(const std::string &source)
 {
+	std::lock_guard<std::mutex> guard(mplayer.aheadLock);
 	mplayer.pause();
+	sfx.clearSongTriggers();
 	mplayer.cleanUpForNewFile();
 	mplayer.resetForNewSong();
 	mml.setSource(source);
-	mml.parse(&mplayer);
+	mml.parseChanged(&mplayer); // channels left unedited keep their parsed data
+	mplayer.prepareLoopState();
 	mplayer.goToBeginning();
+	mplayer.musicEvents.clear(); // drop notifications left from previous song
+	mplayer.flushAhead(false);
 }
 
 // starts playing the loaded song from the top
 void BCPlayer::startMusic()
 {
+	std::lock_guard<std::mutex> guard(mplayer.aheadLock);
 	mplayer.goToBeginning();
 	mplayer.start();
+	mplayer.flushAhead(false);
+}
+
+// starts playing from the first note at or after a character position in the source
+// (as in the string passed to loadString / getSource) - false if nothing plays from there
+bool BCPlayer::startMusicAtSourcePos(int sourcePos)
+{
+	long frame = mplayer.getFrameAtSourcePos(sourcePos);
+	if(frame < 0)
+		return false;
+	std::lock_guard<std::mutex> guard(mplayer.aheadLock);
+	mplayer.seekAndStart(frame);
+	mplayer.flushAhead(false);
+	return true;
+}
+
+// character position in the source of the note channel (1 - 9, 10 for drums) is playing
+// -1 if it's not playing anything from the source
+int BCPlayer::getPlayingSourcePos(int channel)
+{
+	return mplayer.getSourcePosAtFrame(channel - 1, mplayer.getHeardFramePos());
+}
+
+// source line (from 1) a character position is on - to go with getPlayingSourcePos
+int BCPlayer::getSourceLine(int sourcePos)
+{
+	return mplayer.getSourceLine(sourcePos);
 }
 
 // pauses the song
 void BCPlayer::pauseMusic()
 {
+	std::lock_guard<std::mutex> guard(mplayer.aheadLock);
 	mplayer.pause();
+	mplayer.flushAhead(true);
 }
 
 // restarts the song from paused location
 void BCPlayer::restartMusic()
 {
+	std::lock_guard<std::mutex> guard(mplayer.aheadLock);
 	mplayer.restart();
+	mplayer.flushAhead(false);
 }
 
 // set the music to track looping
@@ -134,10 +206,39 @@ void BCPlayer::disableLooping()
 	mplayer.disableLooping();
 }
 
+// loop back to LOOPSTART in the source (default) rather than the top of the song
+void BCPlayer::enableLoopPoint()
+{
+	mplayer.enableLoopPoint();
+}
+
+// always loop back to the top of the song, even if it has a LOOPSTART
+void BCPlayer::disableLoopPoint()
+{
+	mplayer.disableLoopPoint();
+}
+
+// render-ahead mode - for machines where the audio callback sometimes can't keep up:
+// the music is rendered lookaheadMs (100 - 500) ahead on a thread of its own
+// and the callback only plays it back and adds SFX
+// (changes made here take effect right away - track commands and tempo changes lookaheadMs later)
+bool BCPlayer::startRenderAhead(int lookaheadMs)
+{
+	return mplayer.startRenderAhead(lookaheadMs);
+}
+
+// back to rendering the music in the audio callback
+void BCPlayer::stopRenderAhead()
+{
+	mplayer.stopRenderAhead();
+}
+
 // check if the song has officially finished or not
 bool BCPlayer::musicFinished()
 {
-	if( mplayer.reachedSongLastFramePure() || mplayer.isSongFinished() )
+	// (in render-ahead mode - once the end has been heard, not just rendered)
+	long heard = mplayer.getHeardFramePos();
+	if( heard >= mplayer.getSongLastFramePure() || (mplayer.isSongFinished() && heard >= mplayer.getFramePos()) )
 		return true;
 	else
 		return false;
@@ -150,7 +251,8 @@ void BCPlayer::setMusicVolume(float percent)
 	float newGain = static_cast<float>(percent) / 100.0f;
 	if(newGain > 1.0f) newGain = 1.0;
 	else if(newGain < 0.0f) newGain = 0.0;
-	mplayer.setMasterGain(newGain);
+	std::lock_guard<std::mutex> guard(mplayer.aheadLock);
+	mplayer.setMusicVolume(newGain);
 }
 
 // returns the current player volume
@@ -170,10 +272,98 @@ void BCPlayer::seek(float percent)
 	float ratio = percent / 100.0;
 	long songLength = mplayer.getSongLastFramePure();
 	long seekTo = static_cast<long>(songLength * ratio);
+	std::lock_guard<std::mutex> guard(mplayer.aheadLock);
 	mplayer.seek(seekTo);
+	mplayer.flushAhead(false);
+}
+
+// render part of the loaded song (frames startFrame up to endFrame, -1 = to the end)
+// straight into memory - for baking songs to PCM ahead of time
+// buffer takes (endFrame - startFrame) * 2 samples, stereo interleaved
+// rendered from a copy of the song - no SFX, at the song's own tempo, key and level,
+// and the music playing carries on - returns the number of frames rendered
+// (0 while a background load into the main song waits for its swap)
+long BCPlayer::renderToBuffer(float* buffer, long startFrame, long endFrame)
+{
+	MPlayer* render = newRenderPlayer();
+	if(render == NULL)
+		return 0;
+	long framesRendered = render->renderToBuffer(buffer, startFrame, endFrame);
+	mplayer.renderStats = render->renderStats;
+	delete render;
+	return framesRendered;
+}
+
+// same, as 16 bit samples
+long BCPlayer::renderToBuffer(short* buffer, long startFrame, long endFrame)
+{
+	MPlayer* render = newRenderPlayer();
+	if(render == NULL)
+		return 0;
+	long framesRendered = render->renderToBuffer(buffer, startFrame, endFrame);
+	mplayer.renderStats = render->renderStats;
+	delete render;
+	return framesRendered;
+}
+
+// render the whole song into pcm - sized to fit exactly here (left empty if nothing was rendered)
+long BCPlayer::renderToBuffer(std::vector<float> &pcm)
+{
+	pcm.clear();
+	MPlayer* render = newRenderPlayer();
+	if(render == NULL)
+		return 0;
+	
+	// sized from the copy - the main song may be swapped for another meanwhile
+	pcm.resize(render->getSongLastFrame() * 2);
+	long framesRendered = 0;
+	if(!pcm.empty())
+		framesRendered = render->renderToBuffer(&pcm[0], 0, -1);
+	mplayer.renderStats = render->renderStats;
+	delete render;
+	return framesRendered;
+}
+
+// same, as 16 bit samples
+long BCPlayer::renderToBuffer(std::vector<short> &pcm)
+{
+	pcm.clear();
+	MPlayer* render = newRenderPlayer();
+	if(render == NULL)
+		return 0;
+	
+	// sized from the copy - the main song may be swapped for another meanwhile
+	pcm.resize(render->getSongLastFrame() * 2);
+	long framesRendered = 0;
+	if(!pcm.empty())
+		framesRendered = render->renderToBuffer(&pcm[0], 0, -1);
+	mplayer.renderStats = render->renderStats;
+	delete render;
+	return framesRendered;
+}
+
+
+// a player of its own with a copy of the loaded song, for renderToBuffer - nothing bound to it,
+// so the game's SFX and the song's runtime tempo / key / track level stay out of the render
+// (channels muted on the main player stay muted) - NULL if the song may be swapped meanwhile
+MPlayer* BCPlayer::newRenderPlayer()
+{
+	if(loaderTarget == &mplayer && !finishLoad())
+		return NULL;
+	
+	MPlayer* render = new MPlayer();
+	render->resetForNewSong();
+	render->copySongSettings(&mplayer);
+	for(int i=0; i<9; i++)
+	{
+		render->enabled[i] = mplayer.enabled[i];
+		render->silenced[i] = mplayer.silenced[i];
+	}
+	render->dEnabled = mplayer.dEnabled;
+	render->dSilenced = mplayer.dSilenced;
+	return render;
 }
 
-
 //
 //
 //   SFX related functions...
@@ -235,6 +425,284 @@ void BCPlayer::pauseSFX(int slot)
 void BCPlayer::resumeSFX(int slot)
 { sfx.resume(slot); }
 
+// play the specified SFX slot at an exact output stream frame (see getStreamFrame)
+// safe to call from the game thread - returns false if the request queue is full
+bool BCPlayer::scheduleSFX(int slot, long streamFrame)
+{ return sfx.schedule(slot, streamFrame, SFX::STREAM_TIME); }
+
+// play the specified SFX slot when the song reaches this frame (see getNextBeatFrame)
+// waits while the music is paused, dropped if the song ends or another is loaded first
+// returns false if the request queue is full
+bool BCPlayer::scheduleSFXAtSongFrame(int slot, long songFrame)
+{ return sfx.schedule(slot, songFrame, SFX::SONG_TIME); }
+
+// returns the current output stream position in frames (44100 per second)
+long BCPlayer::getStreamFrame()
+{ return mplayer.getStreamFrame(); }
+
+// takes the oldest beat / measure / marker notification from the music
+// call repeatedly (e.g. once every game frame) until it returns false
+bool BCPlayer::pollMusicEvent(MusicEvent &e)
+{ return mplayer.musicEvents.poll(e); }
+
+// throw away all music notifications not read yet
+void BCPlayer::clearMusicEvents()
+{ mplayer.musicEvents.clear(); }
+
+// returns the song frame where the next beat (quarter note) of the music begins
+long BCPlayer::getNextBeatFrame()
+{
+	long beatLength = mplayer.beatFrames; // (mml may have parsed another track since)
+	long pos = mplayer.getHeardFramePos();
+	if(beatLength <= 0)
+		return pos;
+	return (pos / beatLength + 1) * beatLength;
+}
+
+// returns the player for track n (1 to 3) - created the first time it's asked for
+// and mixed into the main player's stream from then on
+MPlayer* BCPlayer::getTrackPlayer(int n)
+{
+	if(n == 0)
+		return &mplayer;
+	if(n < 1 || n >= MPlayer::N_TRACKS)
+		return NULL;
+	MPlayer* p = mplayer.getTrack(n);
+	if(p == NULL)
+	{
+		p = new MPlayer();
+		p->setMasterGain(mplayer.getMasterGain());
+		mplayer.attachTrack(n, p);
+	}
+	return p;
+}
+
+// load a BeepComp source file into track n (0 is the main song - same as loadMusic)
+// the track stays silent until startTrack() or crossfadeTracks()
+// returns false if the file can't be read or a background load hasn't been swapped in yet
+bool BCPlayer::loadTrack(int n, const std::string &fileName)
+{
+	if(n == 0)
+		return loadMusic(fileName);
+	return loadTrackNow(n, fileName, true);
+}
+
+// same as loadTrack - but takes the source as a std::string
+bool BCPlayer::loadTrackString(int n, const std::string &source)
+{
+	if(n == 0)
+	{
+		loadString(source);
+		return true;
+	}
+	return loadTrackNow(n, source, false);
+}
+
+// loadTrack / loadTrackString - parsed here and now into a player of its own, then swapped in
+// by the audio callback like a background load (the track may be rendering) and stopped there
+bool BCPlayer::loadTrackNow(int n, const std::string &source, bool isFile)
+{
+	MPlayer* p = getTrackPlayer(n);
+	if(p == NULL)
+		return false;
+	
+	// the loader's MML is free once a background parse is through
+	if(loaderThread.joinable())
+		loaderThread.join();
+	if(!finishSwap(p))
+		return false;
+	
+	MPlayer* song = newIncomingSong(p, TrackCommand::NOW, false);
+	if(!prepareSong(song, p, source, isFile)
+		|| !mplayer.sendTrackCommand(n, TrackCommand::STOP, TrackCommand::NOW, 0.0f, 0, false))
+	{
+		delete song;
+		return false;
+	}
+	p->incomingSong.store(song, std::memory_order_release);
+	return true;
+}
+
+// start track n from the top at full volume
+// boundary - TrackCommand::NOW, BEAT or MEASURE (of the leading track)
+bool BCPlayer::startTrack(int n, int boundary)
+{ return mplayer.sendTrackCommand(n, TrackCommand::START, boundary, 1.0f, 0, false); }
+
+// stop track n right away or on the next beat / measure
+bool BCPlayer::stopTrack(int n, int boundary)
+{ return mplayer.sendTrackCommand(n, TrackCommand::STOP, boundary, 0.0f, 0, false); }
+
+// fade track n to volumePercent (0 - 100) over the given seconds
+// a track faded down to 0 stops by itself
+bool BCPlayer::fadeTrack(int n, float volumePercent, float seconds, int boundary)
+{
+	float target = min(1.0f, max(0.0f, volumePercent / 100.0f));
+	long fadeFrames = static_cast<long>(seconds * 44100.0f);
+	return mplayer.sendTrackCommand(n, TrackCommand::FADE, boundary, target, fadeFrames, target <= 0.0f);
+}
+
+// fade track 'from' out while track 'to' starts from the top and fades in
+// - both begin on the same frame
+bool BCPlayer::crossfadeTracks(int from, int to, float seconds, int boundary)
+{
+	long fadeFrames = static_cast<long>(seconds * 44100.0f);
+	if(!trackIsLoaded(from) || !trackIsLoaded(to))
+		return false;
+	
+	bool result = mplayer.sendTrackCommand(from, TrackCommand::FADE, boundary, 0.0f, fadeFrames, true);
+	result = result && mplayer.sendTrackCommand(to, TrackCommand::START, boundary, 0.0f, 0, false);
+	result = result && mplayer.sendTrackCommand(to, TrackCommand::FADE, boundary, 1.0f, fadeFrames, false);
+	return result;
+}
+
+// speed the music up or slow it down without re-parsing - 100 is the song's own tempo
+// (25 to 400) - the change glides over the given seconds (0 = right away)
+bool BCPlayer::setTempo(float percent, float seconds)
+{ return setTrackTempo(0, percent, seconds, TrackCommand::NOW); }
+
+// same for any track, optionally starting on the next beat / measure
+bool BCPlayer::setTrackTempo(int n, float percent, float seconds, int boundary)
+{
+	long rampFrames = static_cast<long>(seconds * 44100.0f);
+	return mplayer.sendTrackCommand(n, TrackCommand::TEMPO, boundary, percent / 100.0f, rampFrames, false);
+}
+
+// transpose the music by semitones + cents (e.g. 2, 0 = up a whole step)
+// switches right away - no re-parse
+void BCPlayer::setTranspose(int semitones, int cents)
+{
+	std::lock_guard<std::mutex> guard(mplayer.aheadLock);
+	mplayer.sendTransposeCommand(0, -1, semitones * 100 + cents);
+	mplayer.flushAhead(true);
+}
+
+// transpose one channel (1 - 9, as in @1 - @9) on top of setTranspose()
+void BCPlayer::setChannelTranspose(int channel, int semitones, int cents)
+{
+	if(channel < 1 || channel > 9)
+		return;
+	std::lock_guard<std::mutex> guard(mplayer.aheadLock);
+	mplayer.sendTransposeCommand(0, channel - 1, semitones * 100 + cents);
+	mplayer.flushAhead(true);
+}
+
+// current tempo of the main song in percent of its own tempo
+float BCPlayer::getTempo()
+{ return static_cast<float>(mplayer.getTempoScale() * 100.0); }
+
+// has track n been set up (track 0 - the main song - always is)
+bool BCPlayer::trackIsLoaded(int n)
+{
+	return n >= 0 && n < MPlayer::N_TRACKS && mplayer.getTrack(n) != NULL;
+}
+
+// is track n playing right now?
+bool BCPlayer::trackIsPlaying(int n)
+{
+	if(!trackIsLoaded(n))
+		return false;
+	return mplayer.getTrack(n)->isPlaying();
+}
+
+// load a BeepComp source file into track n without stopping anything
+// it's parsed on a thread of its own, then swapped in by the audio callback
+// boundary - TrackCommand::NOW (next buffer), BEAT or MEASURE (of track n, if it's playing)
+// a playing track carries on with the new song from the top - a paused one stays paused
+// returns false if the previous background load hasn't been swapped in yet
+bool BCPlayer::loadTrackAsync(int n, const std::string &fileName, int boundary)
+{
+	MPlayer* p = getTrackPlayer(n);
+	if(p == NULL || !finishLoad())
+		return false;
+	
+	MPlayer* song = newIncomingSong(p, boundary, false);
+	loaderTarget = p;
+	loaderBusy = true;
+	loaderThread = std::thread(&BCPlayer::parseInBackground, this, song, fileName, true);
+	return true;
+}
+
+// same as loadTrackAsync - but takes the source as a std::string
+// keepPosition - carry on from the same song frame (for live edits of the song that's playing)
+// - a playing track takes it about 100 msec later (NOW), or on the first beat / measure after that
+bool BCPlayer::loadTrackStringAsync(int n, const std::string &source, int boundary, bool keepPosition)
+{
+	MPlayer* p = getTrackPlayer(n);
+	if(p == NULL || !finishLoad())
+		return false;
+	
+	MPlayer* song = newIncomingSong(p, boundary, keepPosition);
+	loaderTarget = p;
+	loaderBusy = true;
+	loaderThread = std::thread(&BCPlayer::parseInBackground, this, song, source, false);
+	return true;
+}
+
+// true while a background load is being parsed or waits for its swap
+bool BCPlayer::musicLoading()
+	{ return !finishLoad(); }
+
+// tidy up after the last background load - false if it isn't through yet
+bool BCPlayer::finishLoad()
+{
+	if(loaderBusy.load(std::memory_order_acquire))
+		return false;
+	if(loaderThread.joinable())
+		loaderThread.join();
+	
+	return loaderTarget == NULL || finishSwap(loaderTarget);
+}
+
+// tidy up after the last song handed to track player p - false if it hasn't been swapped in yet
+bool BCPlayer::finishSwap(MPlayer* p)
+{
+	if(p->incomingSong.load(std::memory_order_acquire) != NULL)
+		return false;
+	
+	// the song that was swapped out is freed here, not on the audio thread
+	delete p->outgoingSong.exchange(NULL, std::memory_order_acquire);
+	return true;
+}
+
+// a player for a song on its way to track player p
+MPlayer* BCPlayer::newIncomingSong(MPlayer* p, int boundary, bool keepPosition)
+{
+	MPlayer* song = new MPlayer();
+	song->setMasterGain(p->getMasterGain());
+	song->songSwapBoundary = boundary;
+	song->songSwapKeepPosition = keepPosition;
+	return song;
+}
+
+// parse into a player of its own and get it ready to swap in for track player target
+// (loader thread - or the game thread, while no background parse is under way)
+// returns false if the file can't be read - the song is left empty
+bool BCPlayer::prepareSong(MPlayer* song, MPlayer* target, const std::string &source, bool isFile)
+{
+	bool result = true;
+	song->resetForNewSong();
+	if(!isFile)
+		loaderMML.setSource(source);
+	else if(loaderMML.loadFile(source, song) == MML::LOAD_ERROR) // (parses, too)
+	{
+		loaderMML.setSource(" ");
+		result = false;
+	}
+	if(!isFile || !result)
+		loaderMML.parse(song);
+	song->prepareLoopState();
+	song->prepareSwap(target);
+	return result;
+}
+
+// loader thread - parse into a player of its own, then hand it to the target track
+void BCPlayer::parseInBackground(MPlayer* song, std::string source, bool isFile)
+{
+	prepareSong(song, loaderTarget, source, isFile);
+	loaderTarget->incomingSong.store(song, std::memory_order_release);
+	loaderBusy.store(false, std::memory_order_release);
+}
+
 
 //////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////
@@ -290,6 +758,7 @@ void BCPlayer::resumeSFX(int slot)
 #include <algorithm>
 #include "BC/sndfile.h"
 #include "BC/Sound.h"
+#include "BC/Trace.h"
 
 using namespace std;
 
@@ -319,6 +788,7 @@ std::string Sound::getErrorText()
 // it can be mono or stereo... but must be within 5 seconds
 bool Sound::loadFile(const std::string &filename)
 {	
+	BC_TRACE_SPAN("Sound::loadFile");
 	// cout << "beginning of Sound class - loadFile " << filename << endl;
 
 	// open sound file
@@ -506,6 +976,11 @@ SFX::SFX()
 {
 	compThreshold = 0.6f;
 	compRatio = 5.0f;
+	triggerWriteIndex = 0;
+	triggerReadIndex = 0;
+	nPendingTriggers = 0;
+	songEpoch = 0;
+	pendingSongEpoch = 0;
 }
 
 float SFX::getGain(int slot)
@@ -570,6 +1045,103 @@ void SFX::resume(int slot)
 		sound[slot].resume();
 }
 
+// queue a start request for a slot - call from the game thread
+// frame is either an absolute stream frame or a song frame (see timeBase)
+// returns false if the slot is invalid or the queue is full
+bool SFX::schedule(int slot, long frame, int timeBase)
+{
+	if(slot < 0 || slot >= N_SLOTS)
+		return false;
+	
+	int writeIndex = triggerWriteIndex.load(std::memory_order_relaxed);
+	int nextIndex = (writeIndex + 1) % N_TRIGGERS;
+	if(nextIndex == triggerReadIndex.load(std::memory_order_acquire)) // ring is full
+		return false;
+	
+	triggerRing[writeIndex].slot = slot;
+	triggerRing[writeIndex].frame = frame;
+	triggerRing[writeIndex].timeBase = timeBase;
+	triggerRing[writeIndex].songEpoch = songEpoch.load(std::memory_order_relaxed);
+	triggerWriteIndex.store(nextIndex, std::memory_order_release);
+	return true;
+}
+
+// move newly queued triggers into the pending list
+// called once per buffer from the audio callback
+void SFX::collectTriggers()
+{
+	int readIndex = triggerReadIndex.load(std::memory_order_relaxed);
+	int writeIndex = triggerWriteIndex.load(std::memory_order_acquire);
+	
+	// a new song since - the song frames the pending ones were aimed at are gone
+	int epoch = songEpoch.load(std::memory_order_relaxed);
+	if(epoch != pendingSongEpoch)
+	{
+		dropSongTriggers();
+		pendingSongEpoch = epoch;
+	}
+	
+	while(readIndex != writeIndex && nPendingTriggers < N_TRIGGERS)
+	{
+		const Trigger &t = triggerRing[readIndex];
+		if(t.timeBase != SONG_TIME || t.songEpoch == epoch)
+		{
+			pendingTrigger[nPendingTriggers] = t;
+			nPendingTriggers++;
+		}
+		readIndex = (readIndex + 1) % N_TRIGGERS;
+	}
+	triggerReadIndex.store(readIndex, std::memory_order_release);
+}
+
+// a new song is about to load - triggers scheduled at song frames up to now are dropped
+// call from the game thread (the audio callback lets them go at its next buffer)
+void SFX::clearSongTriggers()
+	{ songEpoch.fetch_add(1, std::memory_order_relaxed); }
+
+// the song is over - drop the pending triggers it didn't get to
+// called from the audio callback
+void SFX::dropSongTriggers()
+{
+	int i = 0;
+	while(i < nPendingTriggers)
+	{
+		if(pendingTrigger[i].timeBase == SONG_TIME)
+		{
+			nPendingTriggers--;
+			pendingTrigger[i] = pendingTrigger[nPendingTriggers];
+		}
+		else
+			i++;
+	}
+}
+
+// start every pending slot whose target frame has come
+// called every frame from the audio callback, before getOutput()
+void SFX::fireTriggers(long streamFrame, long songFrame, bool songPlaying)
+{
+	int i = 0;
+	while(i < nPendingTriggers)
+	{
+		bool due;
+		if(pendingTrigger[i].timeBase == SONG_TIME)
+			due = songPlaying && songFrame >= pendingTrigger[i].frame;
+		else
+			due = streamFrame >= pendingTrigger[i].frame;
+		
+		if(due)
+		{
+			sound[pendingTrigger[i].slot].start();
+			
+			// fill the hole with the last one - order doesn't matter
+			nPendingTriggers--;
+			pendingTrigger[i] = pendingTrigger[nPendingTriggers];
+		}
+		else
+			i++;
+	}
+}
+
 // 0 - left, 1 - right
 float SFX::getOutput(int channel)
 {
@@ -664,10 +1236,105 @@ void MData::clear()
 	eventFrame.clear();
 	eventFrame.resize(0);
 	nEvents = 0;
+	stream.clear();
+	sourceMap.clear();
 	
 	totalFrames = 0;
 }
 
+// trade contents with another MData - no copying, no allocation
+void MData::swap(MData &other)
+{
+	freqNote.swap(other.freqNote);
+	len.swap(other.len);
+	param.swap(other.param);
+	
+	eventType.swap(other.eventType);
+	eventParam.swap(other.eventParam);
+	eventFrame.swap(other.eventFrame);
+	std::swap(nEvents, other.nEvents);
+	stream.swap(other.stream);
+	sourceMap.swap(other.sourceMap);
+	
+	std::swap(totalFrames, other.totalFrames);
+	std::swap(sampleRate, other.sampleRate);
+}
+
+// merge notes and events into one stream, in the order the sequencer gets to them
+// - a note is due the frame the one before it runs out, an event at its frame (but not
+//   before the events ahead of it - and those at frame 0 go before the very first note)
+// the parallel vectors are let go of afterwards - only the stream is played
+void MData::buildStream()
+{
+	stream.clear();
+	stream.reserve(freqNote.size() + nEvents + 1);
+	
+	int n = getSize();
+	int e = 0;
+	long noteDue = -1; // the first note is set up before frame 0
+	long eventDue = 0;
+	for(int k=0; k<=n; k++)
+	{
+		SeqRecord r;
+		r.event = 0;
+		if(k == n || freqNote[k] < 0)
+		{
+			r.op = SeqRecord::END;
+			r.value = (k < n) ? len[k] : -1;
+			r.freq = -1.0;
+		}
+		else
+		{
+			r.op = (freqNote[k] == 65535.0) ? SeqRecord::REST : SeqRecord::NOTE;
+			r.value = len[k];
+			r.freq = freqNote[k];
+		}
+		
+		// events the sequencer gets to before this note (or on the same frame)
+		while(e < nEvents)
+		{
+			long due = max(eventDue, eventFrame[e]);
+			if(due == 0)
+				due = -1;
+			if(due > noteDue)
+				break;
+			
+			SeqRecord ev;
+			ev.op = SeqRecord::EVENT;
+			EventCode::lower(eventType[e], eventParam[e], ev);
+			ev.frame = due;
+			if(ev.event != EventCode::NOP) // nothing to do for this one
+				stream.push_back(ev);
+			eventDue = max(eventDue, eventFrame[e]);
+			e++;
+		}
+		
+		stream.push_back(r);
+		if(r.op == SeqRecord::END)
+			break;
+		noteDue += max(r.value, 1);
+	}
+	
+	// events after the end - played out when the whole song ends
+	for(; e<nEvents; e++)
+	{
+		SeqRecord ev;
+		ev.op = SeqRecord::EVENT;
+		EventCode::lower(eventType[e], eventParam[e], ev);
+		ev.frame = max(eventDue, eventFrame[e]);
+		if(ev.event != EventCode::NOP)
+			stream.push_back(ev);
+		eventDue = ev.frame;
+	}
+	
+	vector<double>().swap(freqNote);
+	vector<int>().swap(len);
+	vector<int>().swap(param);
+	vector<int>().swap(eventType);
+	vector<int>().swap(eventParam);
+	vector<long>().swap(eventFrame);
+}
+
 // returns the size of MData array
 int MData::getSize()
 {
@@ -723,10 +1390,102 @@ void DData::clear()
 	eventFrame.clear();
 	eventFrame.resize(0);
 	nEvents = 0;
+	stream.clear();
+	sourceMap.clear();
 
 	totalFrames = 0;
 }
 
+// trade contents with another DData - no copying, no allocation
+void DData::swap(DData &other)
+{
+	drumNote.swap(other.drumNote);
+	len.swap(other.len);
+	param.swap(other.param);
+	
+	eventType.swap(other.eventType);
+	eventParam.swap(other.eventParam);
+	eventFrame.swap(other.eventFrame);
+	std::swap(nEvents, other.nEvents);
+	stream.swap(other.stream);
+	sourceMap.swap(other.sourceMap);
+
+	std::swap(totalFrames, other.totalFrames);
+	std::swap(sampleRate, other.sampleRate);
+}
+
+// same as MData::buildStream() - for the drum channel
+void DData::buildStream()
+{
+	stream.clear();
+	stream.reserve(drumNote.size() + nEvents + 1);
+	
+	int n = getSize();
+	int e = 0;
+	long noteDue = -1; // the first note is set up before frame 0
+	long eventDue = 0;
+	for(int k=0; k<=n; k++)
+	{
+		SeqRecord r;
+		r.event = 0;
+		if(k == n || drumNote[k] < 0)
+		{
+			r.op = SeqRecord::END;
+			r.value = (k < n) ? len[k] : -1;
+			r.drum = -1;
+		}
+		else
+		{
+			r.op = (drumNote[k] == 65535) ? SeqRecord::REST : SeqRecord::NOTE;
+			r.value = len[k];
+			r.drum = drumNote[k];
+		}
+		
+		// events the sequencer gets to before this note (or on the same frame)
+		while(e < nEvents)
+		{
+			long due = max(eventDue, eventFrame[e]);
+			if(due == 0)
+				due = -1;
+			if(due > noteDue)
+				break;
+			
+			SeqRecord ev;
+			ev.op = SeqRecord::EVENT;
+			EventCode::lowerDrum(eventType[e], eventParam[e], ev);
+			ev.frame = due;
+			if(ev.event != EventCode::DRUM_NOP) // nothing to do for this one
+				stream.push_back(ev);
+			eventDue = max(eventDue, eventFrame[e]);
+			e++;
+		}
+		
+		stream.push_back(r);
+		if(r.op == SeqRecord::END)
+			break;
+		noteDue += max(r.value, 1);
+	}
+	
+	// events after the end - played out when the whole song ends
+	for(; e<nEvents; e++)
+	{
+		SeqRecord ev;
+		ev.op = SeqRecord::EVENT;
+		EventCode::lowerDrum(eventType[e], eventParam[e], ev);
+		ev.frame = max(eventDue, eventFrame[e]);
+		if(ev.event != EventCode::DRUM_NOP)
+			stream.push_back(ev);
+		eventDue = ev.frame;
+	}
+	
+	vector<int>().swap(drumNote);
+	vector<int>().swap(len);
+	vector<int>().swap(param);
+	vector<int>().swap(eventType);
+	vector<int>().swap(eventParam);
+	vector<long>().swap(eventFrame);
+}
+
 // returns the size of DData array
 int DData::getSize()
 {
@@ -736,62 +1495,320 @@ int DData::getSize()
 
 
 
-// Astro.cpp /////////////////////////////////////////////
-// Astro class - implementation //////////////////////////
+// SourceMap.cpp ////////////////////////////////////////
+// SourceMap Class - Implementation /////////////////////
 
+#include <vector>
 #include <algorithm>
-#include "BC/Astro.h"
+#include "BC/SourceMap.h"
 
 using namespace std;
 
-const int Astro::ASTRO_SAMPLE_RATE = 44100;
-
-Astro::Astro()
+// orders entry numbers by their source position
+struct PosOrder
 {
-	frameCount = 0;
-	processedFrequency = 440.0;
-	oneCycleFrames = 4410;
-	setSpeed(12); // default - 10 cycles per second
-	statusChanged = false;
-}
+	const vector<int> &pos;
+	PosOrder(const vector<int> &p) : pos(p) {}
+	bool operator()(int a, int b) const { return pos[a] < pos[b]; }
+};
 
-Astro::~Astro()
+SourceMap::SourceMap()
 {}
 
-void Astro::setSpeed(int nCyclesPerSecond)
+SourceMap::~SourceMap()
+{}
+
+void SourceMap::clear()
 {
-	nCyclesPerSecond = min(100, nCyclesPerSecond);
-	nCyclesPerSecond = max(1, nCyclesPerSecond);
-	oneCycleFrames = ASTRO_SAMPLE_RATE / nCyclesPerSecond;
-	middlePoint = oneCycleFrames / 2;
+	frame.clear();
+	pos.clear();
+	byPos.clear();
 }
 
-double Astro::process(double freq)
+// trade contents with another SourceMap - no copying, no allocation
+void SourceMap::swap(SourceMap &other)
 {
-	if( frameCount == middlePoint ) // at middle of range - go to octave higher
-	{
-		processedFrequency = freq * 2.0;
-		statusChanged = true;
-	}
-	else if(frameCount == 0 ) // back to beginning - go to base octave
-	{
-		processedFrequency = freq;
-		statusChanged = true;
-	}
-	else
-		statusChanged = false;
+	frame.swap(other.frame);
+	pos.swap(other.pos);
+	byPos.swap(other.byPos);
+}
+
+// the parser calls this for every token that wrote a note or an event - in song order
+// tokens the parser made up itself (p < 0) aren't recorded
+void SourceMap::add(long f, int p)
+{
+	if(p < 0)
+		return;
+	frame.push_back(f);
+	pos.push_back(p);
+}
+
+// build the position index once the whole channel is in
+void SourceMap::finish()
+{
+	int n = frame.size();
+	byPos.resize(n);
+	for(int i=0; i<n; i++)
+		byPos[i] = i;
 	
-	// update frame count
-	frameCount++;
-	if(frameCount >= oneCycleFrames)
-		frameCount = 0;
+	// entries are already in frame order, so a stable sort keeps repeats earliest first
+	stable_sort(byPos.begin(), byPos.end(), PosOrder(pos));
+}
+
+// source position of the token sounding at song frame f - -1 before the first one
+int SourceMap::getPosAtFrame(long f)
+{
+	vector<long>::iterator it = upper_bound(frame.begin(), frame.end(), f);
+	if(it == frame.begin())
+		return -1;
+	return pos[(it - frame.begin()) - 1];
+}
+
+// song frame of the first token at or after source position p - -1 if there's none
+// (a token inside a repeat gives its first time through)
+long SourceMap::getFrameAtPos(int p)
+{
+	int lo = 0;
+	int hi = byPos.size();
+	while(lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+		if(pos[byPos[mid]] < p)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if(lo >= static_cast<int>(byPos.size()))
+		return -1;
+	return frame[byPos[lo]];
+}
+
+int SourceMap::getSize()
+	{ return frame.size(); }
+
+SourceOrigin::SourceOrigin()
+{
+	clear();
+}
+
+SourceOrigin::~SourceOrigin()
+{}
+
+void SourceOrigin::clear()
+{
+	cleanPos.clear();
+	lineStart.clear();
+	for(int i=0; i<N_SECTIONS; i++)
+	{
+		sectionStart[i] = -1;
+		sectionLength[i] = 0;
+	}
+}
+
+// trade contents with another SourceOrigin - no copying, no allocation
+void SourceOrigin::swap(SourceOrigin &other)
+{
+	cleanPos.swap(other.cleanPos);
+	lineStart.swap(other.lineStart);
+	for(int i=0; i<N_SECTIONS; i++)
+	{
+		std::swap(sectionStart[i], other.sectionStart[i]);
+		std::swap(sectionLength[i], other.sectionLength[i]);
+	}
+}
+
+// source position of character p of a section (as in SourceMap) - -1 if there's no such section
+int SourceOrigin::getSourcePos(int section, int p)
+{
+	if(section < 0 || section >= N_SECTIONS || sectionStart[section] < 0)
+		return -1;
+	int k = sectionStart[section] + p;
+	if(k < 0 || k >= static_cast<int>(cleanPos.size()))
+		return -1;
+	return cleanPos[k];
+}
+
+// the section a source position is in - or the first one after it (-1 if none)
+// p gets the position within the section (as in SourceMap)
+int SourceOrigin::getSection(int sourcePos, int &p)
+{
+	// position in the cleaned-up string
+	int k = lower_bound(cleanPos.begin(), cleanPos.end(), sourcePos) - cleanPos.begin();
+	
+	int section = -1;
+	for(int i=0; i<N_SECTIONS; i++)
+	{
+		if(sectionStart[i] < 0 || sectionStart[i] + sectionLength[i] <= k)
+			continue;
+		if(section < 0 || sectionStart[i] < sectionStart[section])
+			section = i;
+	}
+	if(section >= 0)
+		p = max(0, k - sectionStart[section]);
+	return section;
+}
+
+// source line (from 1) of a character position in the source
+int SourceOrigin::getSourceLine(int sourcePos)
+{
+	return upper_bound(lineStart.begin(), lineStart.end(), sourcePos) - lineStart.begin();
+}
+
+
+
+// EventCode.cpp /////////////////////////////////////////
+
+// lower one music channel event (type / parameter as written by the MML parser)
+void EventCode::lower(int eType, int eParam, SeqRecord &r)
+{
+	r.event = NOP;
+	r.value = eParam;
+	
+	switch(eType)
+	{
+		case 0:		r.event = VOLUME; r.level = static_cast<float>(eParam) / 20.0f; break;
+		case 1:		r.event = VOLUME_UP; break;
+		case 2:		r.event = VOLUME_DOWN; break;
+		case 10:	r.event = WAVEFORM; break;
+		case 11:	r.event = WAVEFLIP; break;
+		case 1000:	r.event = PRESET_BEEP; break;
+		case 1001:	r.event = PRESET_BEEP; break;
+		case 1002:	r.event = PRESET_POPPY; break;
+		case 1003:	r.event = PRESET_POPPYVIB; break;
+		case 1004:	r.event = PRESET_BELL; break;
+		case 20:	r.event = ATTACKTIME; r.value = OSC::msToFrames(eParam); break;
+		case 21:	r.event = PEAKTIME; r.value = OSC::msToFrames(eParam); break;
+		case 22:	r.event = DECAYTIME; r.value = OSC::msToFrames(eParam); break;
+		case 23:	r.event = RELEASETIME; r.value = OSC::msToFrames(eParam); break;
+		case 24:	r.event = PEAKLEVEL; r.level = static_cast<float>(eParam) / 100.0f; break;
+		case 25:	r.event = SUSTAINLEVEL; r.level = static_cast<float>(eParam) / 100.0f; break;
+		case 30:
+			if(eParam==1)
+				r.event = LFO_ON;
+			else if(eParam==0)
+				r.event = LFO_OFF;
+			break;
+		case 31:	r.event = LFORANGE; break;
+		case 32:	r.event = LFOSPEED; break;
+		case 33:	r.event = LFOWAIT; break;
+		case 40:	r.event = (eParam==0) ? ASTRO_OFF : ASTRO; break;
+		case 41:	r.event = ASTRO_OFF; break;
+		case 50:	r.event = FALL; break;
+		case 51:	r.event = FALLSPEED; break;
+		case 52:	r.event = FALLWAIT; break;
+		case 60:	r.event = RISE; break;
+		case 61:	r.event = RISESPEED; break;
+		case 62:	r.event = RISERANGE; break;
+		case 70:
+			if(eParam<0.1f) // if zero, turn off beef-up
+				r.event = BEEFUP_OFF;
+			else
+			{
+				double valuef = static_cast<float>(eParam);
+				r.event = BEEFUP;
+				r.level = (valuef*3.0f/100.0f) + 1.0f;
+			}
+			break;
+		case 80:
+			if(eParam==0) // if 0 is passed, turn OFF
+				r.event = RINGMOD_OFF;
+			else if(eParam >= 1) // otherwise it's the modulator/feeder channel number (1 - 9)
+			{
+				r.event = RINGMOD;
+				r.value = eParam-1;
+			}
+			break;
+		case 81:	r.event = RINGMOD_OFF; break;
+	}
+}
+
+// lower one drum channel event
+void EventCode::lowerDrum(int eType, int eParam, SeqRecord &r)
+{
+	r.event = DRUM_NOP;
+	r.value = eParam;
 	
-	return processedFrequency;
+	switch(eType)
+	{
+		case 0:		r.event = DRUM_VOLUME; r.level = static_cast<float>(eParam) / 20.0f; break;
+		case 1:		r.event = DRUM_VOLUME_UP; break;
+		case 2:		r.event = DRUM_VOLUME_DOWN; break;
+		case 500:	r.event = DRUM_RESET; break;
+		case 510:	r.event = DRUM_KICKPITCH; break;
+		case 511:	r.event = DRUM_SNAREPITCH; break;
+		case 512:	r.event = DRUM_HIHATPITCH; break;
+		case 520:
+			if(eParam<0.1f) // if zero, turn off beef-up
+				r.event = DRUM_BEEFUP_OFF;
+			else
+			{
+				double valuef = static_cast<float>(eParam);
+				r.event = DRUM_BEEFUP;
+				r.level = (valuef*1.6f/100.0f) + 1.0f;
+			}
+			break;
+		case 530:	r.event = DRUM_WHITENOISE; break;
+		case 531:	r.event = DRUM_PINKNOISE; break;
+		case 532:	r.event = DRUM_KICKNOISE; break;
+		case 533:	r.event = DRUM_SNARENOISE; break;
+		case 534:	r.event = DRUM_HIHATNOISE; break;
+		case 540:	r.event = DRUM_KICKLENGTH; break;
+		case 541:	r.event = DRUM_SNARELENGTH; break;
+		case 542:	r.event = DRUM_HIHATLENGTH; break;
+		case 550:	r.event = DRUM_SQUARELEVEL; r.level = static_cast<float>(eParam) / 100.0f; break;
+		case 551:	r.event = DRUM_NOISELEVEL; r.level = static_cast<float>(eParam) / 100.0f; break;
+	}
+}
+
+
+
+
+// Astro.cpp /////////////////////////////////////////////
+// Astro class - implementation //////////////////////////
+
+#include <algorithm>
+#include "BC/Astro.h"
+
+using namespace std;
+
+const int Astro::ASTRO_SAMPLE_RATE = 44100;
+
+Astro::Astro()
+{
+	frameCount = 0;
+	oneCycleFrames = 4410;
+	setSpeed(12); // default - 10 cycles per second
+}
+
+Astro::~Astro()
+{}
+
+void Astro::setSpeed(int nCyclesPerSecond)
+{
+	nCyclesPerSecond = min(100, nCyclesPerSecond);
+	nCyclesPerSecond = max(1, nCyclesPerSecond);
+	oneCycleFrames = ASTRO_SAMPLE_RATE / nCyclesPerSecond;
+	middlePoint = oneCycleFrames / 2;
 }
 
-// whenever Astro changes the frequency, statusChanged flag turns on
-bool Astro::stateChanged()
-	{ return statusChanged; }
+// octave offset right now - base octave for the first half of the cycle, octave higher for the second
+double Astro::getOctaves()
+	{ return (frameCount >= middlePoint) ? 1.0 : 0.0; }
+
+// frames until the octave next steps up or down
+int Astro::framesToNextStep()
+{
+	int n = (frameCount < middlePoint) ? (middlePoint - frameCount) : (oneCycleFrames - frameCount);
+	return max(1, n);
+}
+
+// move the cycle on by n frames (never past the next step)
+void Astro::skip(int frames)
+{
+	frameCount += frames;
+	if(frameCount >= oneCycleFrames)
+		frameCount = 0;
+}
 
 // forces the Astro effect cycle to begin from beginning (frameCount = 0)
 void Astro::refresh()
@@ -841,13 +1858,13 @@ double Fall::getDeltaPerFrame(double fSpeed)
 	return (fSpeed / 1200.0) / FALL_SAMPLE_RATE;
 }
 
-double Fall::setSpeed(double fSpeed)
+void Fall::setSpeed(double fSpeed)
 {
 	fallSpeed = fSpeed;
 	octDeltaPerFrame = getDeltaPerFrame(fSpeed);
 }
 
-double Fall::setWaitTime(double waitTimeMS)
+void Fall::setWaitTime(double waitTimeMS)
 {
 	waitFrames = static_cast<int>(waitTimeMS / 1000.0 * FALL_SAMPLE_RATE);
 }
@@ -871,21 +1888,23 @@ void Fall::stop()
 	refresh();
 }
 
-double Fall::process(double freq)
+// octave offset for the next frame (0 while still waiting)
+double Fall::getOctaves()
 {
 	if(waitPos < waitFrames)
-	{
-		waitPos++;
-		return freq;
-	}
-	else
-	{
-		octTraveled += octDeltaPerFrame;
-		if(octTraveled > 8.0) octTraveled = 8.0; // safeguard!
-		freq *= pow(0.5, octTraveled);
-		if(freq < FREQ_FLOOR) freq = FREQ_FLOOR; // safeguard!
-		return freq;
-	}
+		return 0.0;
+	return -min(8.0, octTraveled + octDeltaPerFrame); // safeguard at 8 octaves!
+}
+
+// move the fall on by n frames
+void Fall::skip(int frames)
+{
+	int wait = min(frames, max(0, waitFrames - waitPos));
+	waitPos += wait;
+	frames -= wait;
+	
+	octTraveled += octDeltaPerFrame * frames;
+	if(octTraveled > 8.0) octTraveled = 8.0; // safeguard!
 }
 
 //////////////////////////////////////////////////////////////
@@ -951,21 +1970,22 @@ void Rise::stop()
 	refresh();
 }
 
-double Rise::process(double freq)
+// octave offset for the next frame - rises from below up to the note
+double Rise::getOctaves()
 {
-	pos++;
-	
 	if(octDeviation == 0.0)
+		return 0.0;
+	return -max(0.0, octDeviation - octDeltaPerFrame);
+}
+
+// move the rise on by n frames
+void Rise::skip(int frames)
+{
+	pos += frames;
+	if(octDeviation != 0.0)
 	{
-		return freq;
-	}
-	else
-	{
-		octDeviation -= octDeltaPerFrame;
+		octDeviation -= octDeltaPerFrame * frames;
 		if(octDeviation < 0.0) octDeviation = 0.0; // reached target freq!
-		freq *= pow(0.5, octDeviation);
-		if(freq < FREQ_FLOOR) freq = FREQ_FLOOR; // safeguard!
-		return freq;
 	}
 }
 
@@ -988,8 +2008,7 @@ const double LFO::LFO_TWO_PI = 6.28318530718;
 
 LFO::LFO()
 {
-	// set table size, then set table to sine wave table
-	table.resize(LFO_TABLE_SIZE);
+	// set table to sine wave table
 	setTable(0); // default table - sine wave
 	
 	// initialize variables with default settings
@@ -1030,12 +2049,7 @@ void LFO::setTable(int type)
 		// 0 - sine wave
 		case 0:
 		
-			for(int i=0; i<LFO_TABLE_SIZE; i++)
-			{
-				double radian = ( static_cast<double>(i) / static_cast<double>(LFO_TABLE_SIZE) ) * LFO_TWO_PI;
-				table[i] = sin(radian);
-			}
-
+			table = getSineTable();
 			break;
 			
 		case 1:
@@ -1048,6 +2062,24 @@ void LFO::setTable(int type)
 	
 }
 
+// one sine table shared by every LFO
+const float* LFO::getSineTable()
+{
+	static const std::vector<float> sine = buildSineTable();
+	return &sine[0];
+}
+
+std::vector<float> LFO::buildSineTable()
+{
+	std::vector<float> sine(LFO_TABLE_SIZE);
+	for(int i=0; i<LFO_TABLE_SIZE; i++)
+	{
+		double radian = ( static_cast<double>(i) / static_cast<double>(LFO_TABLE_SIZE) ) * LFO_TWO_PI;
+		sine[i] = sin(radian);
+	}
+	return sine;
+}
+
 void LFO::setWaitTime(int milliseconds)
 {
 	waitTimeMSec = milliseconds;
@@ -1072,33 +2104,182 @@ void LFO::refresh()
 	waitPos = 0;
 }
 
-// takes the original frequency value from oscillator
-// then returns the value processed with LFO
-double LFO::process(double originalFreq)
+// octave offset for the next frame (0 while still in the 'wait' stage)
+double LFO::getOctaves()
 {
-	double freqToReturn;
-	
-	// if still in 'wait' stage - no LFO processing
 	if(waitPos < waitFrames)
+		return 0.0;
+	return static_cast<double>(table[(int)phase]) * rangeCents / 1200.0;
+}
+
+// move the LFO on by n frames
+void LFO::skip(int frames)
+{
+	int wait = min(frames, max(0, waitFrames - waitPos));
+	waitPos += wait;
+	frames -= wait;
+	
+	// let LFO move through table
+	phase += increment * frames;
+	while(phase >= LFO_TABLE_SIZE)
+		phase -= LFO_TABLE_SIZE;
+}
+
+
+
+
+// Envelope.cpp ////////////////////////////////////////
+// Envelope Class - Implementation ///////////////////////
+
+#include <math.h>
+#include "BC/Envelope.h"
+
+Envelope::Envelope()
+{
+	nAttackFrames = 1000;
+	nPeakFrames = 1000;
+	nDecayFrames = 9600;
+	nReleaseFrames = 2000;
+	peakLevel = 0.9f;
+	sustainLevel = 0.5f;
+	exponential = false;
+	
+	// silent until the first note
+	stage = DONE;
+	pos = 0;
+	enterSegment();
+}
+
+// set the whole shape at once - a sounding envelope carries on from where it is
+void Envelope::setShape(int attack, int peak, int decay, int release, float peakLV, float sustainLV)
+{
+	nAttackFrames = attack;
+	nPeakFrames = peak;
+	nDecayFrames = decay;
+	nReleaseFrames = release;
+	peakLevel = peakLV;
+	sustainLevel = sustainLV;
+	reshape();
+}
+
+void Envelope::setExponential(bool exp)
+{
+	exponential = exp;
+	reshape();
+}
+
+// call after changing any of the shape values directly
+void Envelope::reshape()
+{
+	if(stage != DONE)
+		enterSegment();
+}
+
+void Envelope::noteOn()
+{
+	stage = ATTACK;
+	pos = 0;
+	enterSegment();
+}
+
+// release always ramps down from the sustain level
+void Envelope::noteOff()
+{
+	stage = RELEASE;
+	pos = 0;
+	enterSegment();
+}
+
+void Envelope::advance()
+{
+	if(remaining > 0)
 	{
-		waitPos++;
-		freqToReturn = originalFreq;
+		level = level * mul + add;
+		pos++;
+		remaining--;
+		if(remaining == 0) // on to the next segment
+			enterSegment();
 	}
-	// wait stage is over - will return LFO-processed output
-	else
-	{
-		double LFOfactor = pow(2.0, (static_cast<double>(table[(int)phase]) * rangeCents / 100.0 / 12.0 ) );
-		freqToReturn = originalFreq * LFOfactor;
+}
 
-		// advance phase - let LFO move through table
-		phase += increment;
-		if(phase >= LFO_TABLE_SIZE)
-		phase -= LFO_TABLE_SIZE;		
+float Envelope::getOutput()
+	{ return static_cast<float>(level); }
+
+// find the segment for the current position and set up its ramp
+void Envelope::enterSegment()
+{
+	mul = 1.0;
+	add = 0.0;
+	remaining = -1;
+	
+	if(stage == RELEASE || stage == DONE)
+	{
+		if(stage == RELEASE && pos < nReleaseFrames)
+		{
+			remaining = nReleaseFrames - pos;
+			if(exponential)
+			{
+				mul = curve(nReleaseFrames);
+				level = sustainLevel * pow(mul, pos);
+			}
+			else
+			{
+				level = sustainLevel * ( static_cast<float>(nReleaseFrames - pos) / static_cast<float>(nReleaseFrames) );
+				add = -sustainLevel / static_cast<double>(nReleaseFrames);
+			}
+		}
+		else
+		{
+			stage = DONE;
+			level = 0.0f;
+		}
+		return;
 	}
 	
-	return freqToReturn;
+	int decayStartPos = nAttackFrames + nPeakFrames;
+	int decayEndPos = decayStartPos + nDecayFrames;
+	
+	if(pos < nAttackFrames) // attack is always linear
+	{
+		stage = ATTACK;
+		remaining = nAttackFrames - pos;
+		level = peakLevel * ( static_cast<float>(pos) / static_cast<float>(nAttackFrames) );
+		add = peakLevel / static_cast<double>(nAttackFrames);
+	}
+	else if(pos < decayStartPos)
+	{
+		stage = PEAK;
+		remaining = decayStartPos - pos;
+		level = peakLevel;
+	}
+	else if(pos < decayEndPos)
+	{
+		stage = DECAY;
+		remaining = decayEndPos - pos;
+		float decayAmount = peakLevel - sustainLevel;
+		if(exponential)
+		{
+			mul = curve(nDecayFrames);
+			add = sustainLevel * (1.0 - mul);
+			level = sustainLevel + decayAmount * pow(mul, pos - decayStartPos);
+		}
+		else
+		{
+			level = peakLevel - decayAmount * ( static_cast<float>(pos - decayStartPos) / static_cast<float>(nDecayFrames) );
+			add = -decayAmount / static_cast<double>(nDecayFrames);
+		}
+	}
+	else
+	{
+		stage = SUSTAIN;
+		level = sustainLevel;
+	}
 }
 
+// per frame factor for an exponential segment - down 60dB by its end
+double Envelope::curve(int frames)
+	{ return pow(0.001, 1.0 / frames); }
+
 
 
 
@@ -1117,9 +2298,7 @@ const float OSC::TWO_PI = 6.283185307;
 
 OSC::OSC()
 {
-	table.resize(OSC_TABLE_SIZE); // wave table (vector)
-	
-	tableType = 0; // FORCE setTable() to rewrite wavetable
+	tableType = 0; // FORCE setTable() to pick up the wavetable
 	setTable(1); // default - set up a square table
 	tableType = 1;
 	yFlip = 1.0f;
@@ -1133,27 +2312,13 @@ OSC::OSC()
 	resting = false;
 	forceSilenceAtBeginning = false;
 	
-	nAttackFrames = 1000;
-	nPeakFrames = 1000;
-	nDecayFrames = 9600;
-	nEnvFrames = nAttackFrames + nPeakFrames + nDecayFrames;
-	decayStartPos = nAttackFrames + nPeakFrames;
-	
-	peakLevel = 0.9f;
-	sustainLevel = 0.5f;
-	decayAmount = peakLevel - sustainLevel;
-	envPos = 0;
-	envADfinished = false;
-	
-	nReleaseFrames = 2000;
-	releasePos = 0;
-	envRfinished = true;
-	
 	astroEnabled = false;
 	lfoEnabled = false;
 	
 	fallActive = false;
 	riseActive = false;
+	modCount = 0;
+	modRatio = 1.0;
 	
 	beefUp = false;
 	beefUpFactor = 1.0f;
@@ -1182,7 +2347,30 @@ void OSC::setTable(int type)
 		return;
 	
 	tableType = type;
+	table = getWaveTable(type);
+}
+
+// wave tables are built once and shared by every oscillator
+// (any type without its own table gets the default square)
+const float* OSC::getWaveTable(int type)
+{
+	static const std::vector<float> bank = buildWaveTables();
 	
+	if(type < 0 || type >= N_WAVE_TABLES)
+		type = N_WAVE_TABLES;
+	return &bank[type * OSC_TABLE_SIZE];
+}
+
+std::vector<float> OSC::buildWaveTables()
+{
+	std::vector<float> bank((N_WAVE_TABLES + 1) * OSC_TABLE_SIZE);
+	for(int type=0; type<=N_WAVE_TABLES; type++)
+		fillTable(&bank[type * OSC_TABLE_SIZE], type);
+	return bank;
+}
+
+void OSC::fillTable(float* table, int type)
+{
 	switch(type)
 	{
 		float maxAmp;
@@ -1368,80 +2556,34 @@ float OSC::getGain()
 	{ return gain; }
 
 void OSC::advanceEnvelope()
-{
-	if(!resting) // currently playing a note
-	{
-		if(!envADfinished)
-		{
-			envPos++;
-			if(envPos >= nEnvFrames)
-				envADfinished = true;
-		}
-	}
-	else // you are on a rest now
-	{
-		if(!envRfinished)
-		{
-			releasePos++;
-			if(releasePos >= nReleaseFrames)
-			{
-				envRfinished = true;
-			}
-		}
-	}
-}
+	{ env.advance(); }
 
 // go back to the beginning of envelope
+// (the release, if this channel is on a rest now)
 void OSC::refreshEnvelope()
 {
-	envPos = 0;
-	envADfinished = false;
-	releasePos = 0;
-	envRfinished = false;
+	if(resting)
+		env.noteOff();
+	else
+		env.noteOn();
 }
 
 float OSC::getEnvelopeOutput()
 {
-	float output;
-	
-	if(!resting) // when you're not on a rest - playing a note now
+	// on a rest, and released all the way (or silent from the very beginning)
+	if(resting && (env.stage == Envelope::DONE || forceSilenceAtBeginning))
 	{
-		if(envPos < nAttackFrames) // in attack stage
-		{
-			output = peakLevel * 
-			(static_cast<float>(envPos) / static_cast<float>(nAttackFrames));
-		}
-		else if(envPos < (nAttackFrames + nPeakFrames)) // in peak stage
-		{
-			output = peakLevel;
-		}
-		else if(envPos < nEnvFrames) // in decay stage
-		{
-			output = peakLevel - decayAmount * ( static_cast<float>(envPos - decayStartPos) / static_cast<float> (nDecayFrames) );
-		}
-		else if(envADfinished) // in sustain stage
-		{
-			output = sustainLevel;
-		}
-	}
-	
-	// if resting flag is on, means you're in release stage
-	if(resting)
-	{
-		if(!envRfinished && !forceSilenceAtBeginning)
-			output = sustainLevel * ( static_cast<float>(nReleaseFrames - releasePos) / static_cast<float>(nReleaseFrames) );
-		else
-		{
-			output = 0.0f;
-			phase = 0; // reset phase for next note!
-		}
+		phase = 0; // reset phase for next note!
+		return 0.0f;
 	}
 	
-	return output;
+	return env.getOutput();
 }
 
 void OSC::setToRest()
 {
+	if(!resting)
+		env.noteOff();
 	resting = true;
 }
 
@@ -1455,56 +2597,19 @@ void OSC::advance()
 	// advance on the sample table
 	phase += increment;
 	
-	adjustedFreq = freq;
-	
 	while(phase >= OSC_TABLE_SIZE)
 	{
 		phase -= OSC_TABLE_SIZE;
 	}
 	
-	// if astro is enabled, process and adjust frequency
-	if(astroEnabled)
-	{
-		adjustedFreq = astro.process(freq);
-		if(astro.stateChanged())
-			setIncrement(adjustedFreq);
-		
-		// if Fall is enabled, process and adjust frequency
-		if(fallActive)
-		{
-			adjustedFreq = fall.process(adjustedFreq);
-			setIncrement(adjustedFreq);
-		}
-
-		// if Rise is enabled, process and adjust frequency
-		if(riseActive)
-		{
-			adjustedFreq = rise.process(adjustedFreq);
-			setIncrement(adjustedFreq);
-		}		
-	}
-	
-	// if LFO is enabled, process and adjust frequency
-	else if(lfoEnabled)
-	{
-		adjustedFreq = lfo.process(freq);
-		if(adjustedFreq < 10.0)
-			adjustedFreq = 10.0;
-		setIncrement(adjustedFreq);
-	}
-	
-	// if Fall is enabled, process and adjust frequency
-	if(fallActive && !astroEnabled)
+	// pitch modulation - ramp on through the block, or work out the next one
+	if(astroEnabled || lfoEnabled || fallActive || riseActive)
 	{
-		adjustedFreq = fall.process(freq);
-		setIncrement(adjustedFreq);
-	}
-	
-	// if Rise is enabled, process and adjust frequency
-	if(riseActive && !astroEnabled)
-	{
-		adjustedFreq = rise.process(adjustedFreq);
-		setIncrement(adjustedFreq);
+		modCount--;
+		if(modCount > 0)
+			increment *= modRatio;
+		else
+			startModBlock();
 	}
 	
 	// advance envelope also
@@ -1516,8 +2621,8 @@ void OSC::setNewNote(double newFreq)
 	forceSilenceAtBeginning = false;
 	setFrequency(newFreq);
 	// initializePhase();
-	refreshEnvelope();
 	resting = false;
+	refreshEnvelope();
 	if(fallActive && fall.octTraveled > 0.0)
 		stopFall();
 	if(riseActive && rise.pos > 30)
@@ -1554,55 +2659,139 @@ void OSC::setIncrement(double noteFreq)
 	
 	if(increment < 0)
 		increment = 0;
+	
+	// any pitch modulation starts over from the new frequency
+	modCount = 0;
+}
+
+// Astro / LFO / Fall / Rise all add up as octave offsets from the note's frequency
+// they're worked out once every MOD_BLOCK frames (ending early where Astro steps),
+// and the increment glides between them with one multiply per frame
+void OSC::startModBlock()
+{
+	int n = MOD_BLOCK;
+	double stepOct = 0.0;	// Astro - steps, never glides
+	double oct = 0.0;		// the rest, now...
+	double octEnd = 0.0;	// ... and at the end of the block
+	double freqFloor = 10.0;
+	
+	if(astroEnabled)
+	{
+		n = min(n, astro.framesToNextStep());
+		stepOct = astro.getOctaves();
+		astro.skip(n);
+	}
+	if(lfoEnabled)
+	{
+		oct += lfo.getOctaves();
+		lfo.skip(n);
+		octEnd += lfo.getOctaves();
+	}
+	if(fallActive)
+	{
+		oct += fall.getOctaves();
+		fall.skip(n);
+		octEnd += fall.getOctaves();
+		freqFloor = Fall::FREQ_FLOOR;
+	}
+	if(riseActive)
+	{
+		oct += rise.getOctaves();
+		rise.skip(n);
+		octEnd += rise.getOctaves();
+		freqFloor = Rise::FREQ_FLOOR;
+	}
+	
+	double f = max(freqFloor, freq * pow(2.0, stepOct + oct)); // safeguard!
+	double fEnd = max(freqFloor, freq * pow(2.0, stepOct + octEnd));
+	
+	adjustedFreq = f + detune;
+	increment = ( static_cast<double>(OSC_TABLE_SIZE) / ( OSC_SAMPLE_RATE / adjustedFreq ) );
+	if(increment < 0)
+		increment = 0;
+	
+	modRatio = (fEnd == f) ? 1.0 : pow(fEnd / f, 1.0 / n);
+	modCount = n;
 }
 
 void OSC::enableAstro()
-	{ astroEnabled = true; }
+{
+	astroEnabled = true;
+	modCount = 0;
+}
 
 void OSC::disableAstro()
-	{ astroEnabled = false; }
+{
+	astroEnabled = false;
+	modCount = 0;
+}
 	
 void OSC::setAstroSpeed(int nCyclesPerSecond)
-	{ astro.setSpeed(nCyclesPerSecond); }
+{
+	astro.setSpeed(nCyclesPerSecond);
+	modCount = 0;
+}
 
 void OSC::enableLFO()
-	{ lfoEnabled = true; }
+{
+	lfoEnabled = true;
+	modCount = 0;
+}
 
 void OSC::disableLFO()
-	{ lfoEnabled = false; }
+{
+	lfoEnabled = false;
+	modCount = 0;
+}
 	
 void OSC::initializeLFO()
-	{ lfo.initialize();	}
+{
+	lfo.initialize();
+	modCount = 0;
+}
 	
 void OSC::setLFOwaitTime(int milliseconds)
-	{ lfo.setWaitTime(milliseconds); }
+{
+	lfo.setWaitTime(milliseconds);
+	modCount = 0;
+}
 
 void OSC::setLFOrange(int cents)
-	{ lfo.setRange(cents); }
+{
+	lfo.setRange(cents);
+	modCount = 0;
+}
 
 void OSC::setLFOspeed(double cyclePerSeconds)
-	{ lfo.setSpeed(cyclePerSeconds); }
+{
+	lfo.setSpeed(cyclePerSeconds);
+	modCount = 0;
+}
 
 void OSC::startFall()
 {
 	fallActive = true;
 	fall.start();
+	modCount = 0;
 }
 
 void OSC::stopFall()
 {
 	fallActive = false;
 	fall.stop();
+	modCount = 0;
 }
 
 void OSC::setFallSpeed(double fallSpeed)
 {
 	fall.setSpeed(fallSpeed);
+	modCount = 0;
 }
 
 void OSC::setFallWait(double waitTimeMS)
 {
 	fall.setWaitTime(waitTimeMS);
+	modCount = 0;
 }
 
 void OSC::setFallToDefault()
@@ -1615,22 +2804,26 @@ void OSC::startRise()
 {
 	riseActive = true;
 	rise.start();
+	modCount = 0;
 }
 
 void OSC::stopRise()
 {
 	riseActive = false;
 	rise.stop();
+	modCount = 0;
 }
 
 void OSC::setRiseSpeed(double riseSpeed)
 {
 	rise.setSpeed(riseSpeed);
+	modCount = 0;
 }
 
 void OSC::setRiseRange(double riseRange)
 {
 	rise.setRange(riseRange);
+	modCount = 0;
 }
 
 void OSC::setRiseToDefault()
@@ -1640,38 +2833,54 @@ void OSC::setRiseToDefault()
 }
 
 void OSC::setAttackTime(int attackTimeMS)
+	{ setAttackFrames(msToFrames(attackTimeMS)); }
+
+void OSC::setPeakTime(int peakTimeMS)
+	{ setPeakFrames(msToFrames(peakTimeMS)); }
+
+void OSC::setDecayTime(int decayTimeMS)
+	{ setDecayFrames(msToFrames(decayTimeMS)); }
+
+void OSC::setReleaseTime(int releaseTimeMS)
+	{ setReleaseFrames(msToFrames(releaseTimeMS)); }
+
+// envelope times already converted (by the event lowering)
+void OSC::setAttackFrames(int frames)
 {
-	nAttackFrames = static_cast<int> (OSC_SAMPLE_RATE * attackTimeMS / 1000.0);
+	env.nAttackFrames = frames;
 	readjustEnvParams();
 }
 
-void OSC::setPeakTime(int peakTimeMS)
+void OSC::setPeakFrames(int frames)
 {
-	nPeakFrames = static_cast<int> (OSC_SAMPLE_RATE * peakTimeMS / 1000.0);
+	env.nPeakFrames = frames;
 	readjustEnvParams();
 }
 
-void OSC::setDecayTime(int decayTimeMS)
+void OSC::setDecayFrames(int frames)
 {
-	nDecayFrames = static_cast<int> (OSC_SAMPLE_RATE * decayTimeMS / 1000.0);
+	env.nDecayFrames = frames;
 	readjustEnvParams();
 }
 
-void OSC::setReleaseTime(int releaseTimeMS)
+void OSC::setReleaseFrames(int frames)
 { 
-	nReleaseFrames = static_cast<int> (OSC_SAMPLE_RATE * releaseTimeMS / 1000.0);
+	env.nReleaseFrames = frames;
 	readjustEnvParams();
 }
+
+int OSC::msToFrames(int milliseconds)
+	{ return static_cast<int> (OSC_SAMPLE_RATE * milliseconds / 1000.0); }
 	
 void OSC::setPeakLevel(float peakLV)
 {
-	peakLevel = peakLV;
+	env.peakLevel = peakLV;
 	readjustEnvParams();
 }
 
 void OSC::setSustainLevel(float sustainLV)
 {
-	sustainLevel = sustainLV;
+	env.sustainLevel = sustainLV;
 	readjustEnvParams();
 }	
 
@@ -1688,11 +2897,7 @@ void OSC::setEnvelope(int attackTimeMS, int peakTimeMS, int decayTimeMS, int rel
 }
 
 void OSC::readjustEnvParams()
-{
-	nEnvFrames = nAttackFrames + nPeakFrames + nDecayFrames;
-	decayStartPos = nAttackFrames + nPeakFrames;
-	decayAmount = peakLevel - sustainLevel;	
-}
+	{ env.reshape(); }
 	
 void OSC::initializePhase()
 {
@@ -1752,6 +2957,150 @@ float OSC::getOutput()
 	return out;
 }
 
+// nFrames frames into out - both getOutput() calls of each frame (left, right) as getMix() makes them,
+// and the advance() from one frame to the next (the caller advances after the last one, once the
+// sequencer has had its turn) - the frames go through renderRun() kernels, each picked once for
+// as long as its settings hold; pop guard frames and the frames where the envelope or the pitch
+// modulation moves on to its next segment go through getOutput() / advance() one by one
+void OSC::renderBlock(float* out, int nFrames)
+{
+	typedef void (OSC::*RunKernel)(float*, int);
+	static const RunKernel kernels[N_RUN_KERNELS] =
+	{
+		&OSC::renderRun<0>, &OSC::renderRun<1>, &OSC::renderRun<2>, &OSC::renderRun<3>,
+		&OSC::renderRun<4>, &OSC::renderRun<5>, &OSC::renderRun<6>, &OSC::renderRun<7>,
+		&OSC::renderRun<8>, &OSC::renderRun<9>, &OSC::renderRun<10>, &OSC::renderRun<11>,
+		&OSC::renderRun<12>, &OSC::renderRun<13>, &OSC::renderRun<14>, &OSC::renderRun<15>,
+		&OSC::renderRun<16>, &OSC::renderRun<17>, &OSC::renderRun<18>, &OSC::renderRun<19>,
+		&OSC::renderRun<20>, &OSC::renderRun<21>, &OSC::renderRun<22>, &OSC::renderRun<23>,
+		&OSC::renderRun<24>, &OSC::renderRun<25>, &OSC::renderRun<26>, &OSC::renderRun<27>,
+		&OSC::renderRun<28>, &OSC::renderRun<29>, &OSC::renderRun<30>, &OSC::renderRun<31>
+	};
+	
+	int f = 0;
+	while(f < nFrames)
+	{
+		int run = runLength(nFrames - 1 - f);
+		if(run > 0)
+		{
+			(this->*kernels[runConfig()])(out + f * 2, run);
+			f += run;
+		}
+		else
+		{
+			out[f * 2] = getOutput();
+			out[f * 2 + 1] = getOutput();
+			if(f < nFrames - 1)
+				advance();
+			f++;
+		}
+	}
+}
+
+// how many frames (up to maxRun, each with its advance) one kernel can take from here
+int OSC::runLength(int maxRun)
+{
+	// pop guard counts down call by call - and a kernel wraps the phase once at most
+	if(popGuardCount > 0 || increment >= OSC_TABLE_SIZE / 4)
+		return 0;
+	
+	int run = maxRun;
+	if(env.remaining > 0) // stop short of the envelope's next segment...
+		run = min(run, env.remaining - 1);
+	if(astroEnabled || lfoEnabled || fallActive || riseActive)
+	{
+		if(modRatio > 1.02) // (a glide that steep could take the increment past a table length)
+			return 0;
+		run = min(run, modCount - 1); // ... and of the next pitch modulation block
+	}
+	return run;
+}
+
+// which renderRun() kernel the settings right now call for
+int OSC::runConfig()
+{
+	int config = 0;
+	if(yFlip <= 0)
+		config |= RUN_FLIP;
+	if(beefUp)
+		config |= RUN_BEEF;
+	if(resting && (env.stage == Envelope::DONE || forceSilenceAtBeginning))
+		config |= RUN_SILENT;
+	if(env.remaining > 0)
+		config |= RUN_RAMP;
+	if(astroEnabled || lfoEnabled || fallActive || riseActive)
+		config |= RUN_MOD;
+	return config;
+}
+
+// nFrames frames of one configuration, each with its advance - the same floats getOutput() and
+// advance() come up with, with the settings' tests taken out of the loop
+// (runLength() has made sure none of them change in here)
+template<int CONFIG>
+void OSC::renderRun(float* out, int nFrames)
+{
+	const bool flip = (CONFIG & RUN_FLIP) != 0;
+	const bool beef = (CONFIG & RUN_BEEF) != 0;
+	const bool silent = (CONFIG & RUN_SILENT) != 0;
+	const bool ramp = (CONFIG & RUN_RAMP) != 0;
+	const bool mod = (CONFIG & RUN_MOD) != 0;
+	const double tableSize = OSC_TABLE_SIZE;
+	
+	double ph = phase;
+	double inc = increment;
+	double level = env.level;
+	
+	for(int f=0; f<nFrames; f++)
+	{
+		float e = silent ? 0.0f : static_cast<float>(level);
+		int i = static_cast<int>(ph);
+		float left = flip ? -table[i] * e : table[i] * e;
+		if(beef)
+			left = compress(left * beefUpFactor);
+		left *= gain;
+		
+		// silent - the left call has set the phase back to 0 for the right one
+		float right = left;
+		if(silent)
+		{
+			right = flip ? -table[0] * e : table[0] * e;
+			if(beef)
+				right = compress(right * beefUpFactor);
+			right *= gain;
+			ph = 0.0;
+		}
+		
+		out[f * 2] = left;
+		out[f * 2 + 1] = right;
+		
+		ph += inc;
+		if(ph >= tableSize)
+			ph -= tableSize;
+		if(mod)
+			inc *= modRatio;
+		if(ramp)
+			level = level * env.mul + env.add;
+	}
+	
+	phase = ph;
+	increment = inc;
+	if(mod)
+		modCount -= nFrames;
+	if(ramp)
+	{
+		env.level = level;
+		env.pos += nFrames;
+		env.remaining -= nFrames;
+	}
+	lastAmp = out[nFrames * 2 - 1];
+	
+	// the meter history takes every 8th call
+	int nCalls = nFrames * 2;
+	for(int c = 7 - historyWriteWait; c < nCalls; c += 8)
+		pushHistory(out[c]);
+	historyWriteWait = (historyWriteWait + nCalls) % 8;
+}
+
 float OSC::compress(float in)
 {
 	float out = in;
@@ -1860,9 +3209,6 @@ const double NOSC::NOSC_SAMPLE_RATE = 44100.0;
 NOSC::NOSC()
 {	
 	// set up a noise wave nTable
-	nTable.resize(NOSC_NTABLE_SIZE);
-	nPinkTable.resize(NOSC_NTABLE_SIZE);
-	pTable.resize(NOSC_PTABLE_SIZE);
 	setTable();
 
 	for(int i=0; i<6; i++)
@@ -1880,6 +3226,13 @@ NOSC::NOSC()
 	drumType = 0;
 	pLevel = 1.0f;
 	pPitchFall = 0;
+	hitBank = NULL;
+	hitSearch = 0;
+	for(int i=0; i<6; i++)
+		hit[i] = NULL;
+	playing = NULL;
+	sounding = NULL;
+	hitPos = 0;
 	
 	// set default envelope for each drum
 	setDrumTone(0, 1, 25,  15,  0.8, 200.0,  50  , 0.9, 2.0); // kick
@@ -1898,10 +3251,6 @@ NOSC::NOSC()
 	snarePeakTime = 20; snareDecayTime = 120;
 	hihatPeakTime = 17; hihatDecayTime = 3;
 
-	envPos = 0;	
-	
-	envFinished = false;
-
 	beefUp = false;
 	beefUpFactor = 1.0f;
 	beefUpFactorNoise = 1.0f;
@@ -1915,8 +3264,26 @@ NOSC::NOSC()
 NOSC::~NOSC()
 {}
 
+// noise and pitched tables are built once and shared by every drum oscillator
 void NOSC::setTable()
 {
+	static const Tables tables;
+	
+	nTable = &tables.white[0];
+	nPinkTable = &tables.pink[0];
+	pTable = &tables.pitched[0];
+}
+
+NOSC::Tables::Tables()
+{
+	std::vector<float> &nTable = white;
+	std::vector<float> &nPinkTable = pink;
+	std::vector<float> &pTable = pitched;
+	
+	nTable.resize(NOSC_NTABLE_SIZE);
+	nPinkTable.resize(NOSC_NTABLE_SIZE);
+	pTable.resize(NOSC_PTABLE_SIZE);
+	
 	// fill nTable with random numbers ranging from -1 to 1
 	for(int i=0; i<NOSC_NTABLE_SIZE; i++)
 		nTable[i] = ( (float) rand() / RAND_MAX ) * 2.0f - 1.0f;
@@ -1966,7 +3333,6 @@ void NOSC::setDrumTone(int dType, double nMilSecAttack, double nMilSecPeak, doub
 	nAttackFrames[dType] = static_cast<int> (NOSC_SAMPLE_RATE * nMilSecAttack / 1000.0);
 	nPeakFrames[dType] = static_cast<int> (NOSC_SAMPLE_RATE * nMilSecPeak / 1000.0);
 	nDecayFrames[dType] = static_cast<int> (NOSC_SAMPLE_RATE * nMilSecDecay / 1000.0);
-	nEnvFrames[dType] = nAttackFrames[dType] + nPeakFrames[dType] + nDecayFrames[dType];
 	peakLevel[dType] = peakVol;
 	frequency[dType] = freq;
 	pitchFallDelta[dType] = (freq / pFallRatio) / (NOSC_SAMPLE_RATE * nMilSecPTime / 1000.0);
@@ -1974,8 +3340,21 @@ void NOSC::setDrumTone(int dType, double nMilSecAttack, double nMilSecPeak, doub
 	pStartLevel[dType] = pBeginningLevel;
 	levelFallDelta[dType] = peakLevel[dType] / static_cast<float>(NOSC_SAMPLE_RATE * nMilSecPTime/1000.0);
 	
+	// a hit of this drum still sounding takes the new shape straight away
+	// (carrying on live from where its cache got to - with the envelope it had so far)
+	if(dType == drumType)
+	{
+		leaveNoise();
+		env.setShape(nAttackFrames[dType], nPeakFrames[dType], nDecayFrames[dType], 0, peakLevel[dType], 0.0f);
+		if(playing != getStillHit()) // (that one stands still whatever the tone)
+			leaveHit();
+	}
+	
+	// the cached hit is out of date - pick up the one for the new tone
+	findHit(dType);
+	
 	// DEBUG
-	// cout << "attack=" << nAttackFrames[dType] << " peakTime=" << nPeakFrames[dType] << " decayTime" << nDecayFrames[dType] << " envFrames=" << nEnvFrames[dType] << endl;
+	// cout << "attack=" << nAttackFrames[dType] << " peakTime=" << nPeakFrames[dType] << " decayTime" << nDecayFrames[dType] << endl;
 }
 
 // reset all drum settings to default
@@ -2110,6 +3489,15 @@ void NOSC::setNewDrum(int dType)
 {
 	if(dType >= 65535) // means rest
 		resting = true;
+	else if(dType < 0) // end flag of an empty drum channel - nothing to play, pitched element stands still
+	{
+		resting = true;
+		increment = 0;
+		pLevel = 0;
+		leaveNoise();
+		playing = getStillHit();
+		hitPos = 0;
+	}
 	else
 	{
 		resting = false;
@@ -2119,15 +3507,217 @@ void NOSC::setNewDrum(int dType)
 		setIncrement(dType);
 		initializePhase();
 		refreshEnvelope();
+		
+		// play the hit from the cache (if the song has this tone - otherwise live)
+		playing = hit[dType];
+		sounding = (playing != NULL && !playing->envelope.empty()) ? playing : NULL;
+		hitPos = 0;
+	}
+}
+
+// work out the pitched element of a hit of this drum's current tone, frame by frame, the way
+// advance() does - up to where it holds still (the pitch has finished falling and the level is down to zero)
+// allocates - not for the audio thread (the caller owns the hit)
+NOSC::DrumHit* NOSC::buildHit(int dType)
+{
+	// a hit that doesn't hold still within a second is cached this far, then carries on live
+	// (drums are 1 sec long at most - the pitch fall is over in 100 msec)
+	static const int MAX_HIT_FRAMES = 44100;
+	
+	DrumHit* h = new DrumHit;
+	h->dType = dType;
+	h->frequency = frequency[dType];
+	h->pitchFallDelta = pitchFallDelta[dType];
+	h->pitchFallLimit = pitchFallLimit[dType];
+	h->pStartLevel = pStartLevel[dType];
+	h->levelFallDelta = levelFallDelta[dType];
+	h->noiseType = noiseType[dType];
+	h->noiseLevel = noiseLevel;
+	h->nAttackFrames = nAttackFrames[dType];
+	h->nPeakFrames = nPeakFrames[dType];
+	h->nDecayFrames = nDecayFrames[dType];
+	h->peakLevel = peakLevel[dType];
+	h->settled = false;
+	
+	double fall = 0;
+	double level = pStartLevel[dType];
+	double inc = getIncrement(dType, fall);
+	
+	while(static_cast<int>(h->increment.size()) < MAX_HIT_FRAMES)
+	{
+		h->increment.push_back(inc);
+		h->level.push_back(level);
+		h->pitchFall.push_back(fall);
+		
+		double nextInc = getIncrement(dType, fall);
+		double nextFall = fall;
+		double nextLevel = level;
+		if(nextFall > -pitchFallLimit[dType])
+			nextFall -= pitchFallDelta[dType];
+		nextLevel -= levelFallDelta[dType];
+		if(nextLevel <= 0.0f)
+			nextLevel = 0.0f;
+		
+		if(nextInc == inc && nextFall == fall && nextLevel == level)
+		{
+			h->settled = true;
+			break;
+		}
+		
+		inc = nextInc;
+		fall = nextFall;
+		level = nextLevel;
+	}
+	
+	// noise element and envelope - getOutput() / advance() from the hit's first frame
+	// (the noise phase is at 0) up to where the envelope holds
+	const float* table = (noiseType[dType] == 1) ? nPinkTable : nTable;
+	Envelope e;
+	e.setShape(nAttackFrames[dType], nPeakFrames[dType], nDecayFrames[dType], 0, peakLevel[dType], 0.0f);
+	e.noteOn();
+	for(int i=0; e.remaining > 0 && i < MAX_HIT_FRAMES; i++)
+	{
+		h->noise.push_back(table[i % NOSC_NTABLE_SIZE] * noiseLevel);
+		h->envelope.push_back(e.level);
+		e.advance();
 	}
+	h->envelopeEnd = e;
+	
+	return h;
+}
+
+// play hits from this bank from now on - it has to outlive every copy of this NOSC using it
+void NOSC::useHitBank(const HitBank* bank)
+{
+	if(playing != getStillHit()) // (that one isn't in any bank)
+		leaveHit();
+	hitBank = bank;
+	hitSearch = 0;
+	for(int i=0; i<6; i++)
+		findHit(i);
+}
+
+// add the current tones missing from bank - and play hits from it (allocates - not for the audio thread)
+void NOSC::fillHitBank(HitBank &bank)
+{
+	if(hitBank != &bank)
+		useHitBank(&bank);
+	
+	for(int i=0; i<6; i++)
+	{
+		if(hit[i] != NULL)
+			continue;
+		bank.push_back(std::unique_ptr<const DrumHit>(buildHit(i)));
+		hit[i] = bank.back().get();
+	}
+}
+
+// look the drum's current tone up in the bank - no allocation, so tone changes can run in the callback
+void NOSC::findHit(int dType)
+{
+	hit[dType] = NULL;
+	if(hitBank == NULL)
+		return;
+	
+	// from where the last one was - the bank is built in the order the song changes tones
+	size_t n = hitBank->size();
+	for(size_t j=0; j<n; j++)
+	{
+		size_t i = (hitSearch + j) % n;
+		const DrumHit* h = (*hitBank)[i].get();
+		if(h->dType == dType && h->frequency == frequency[dType]
+			&& h->pitchFallDelta == pitchFallDelta[dType] && h->pitchFallLimit == pitchFallLimit[dType]
+			&& h->pStartLevel == pStartLevel[dType] && h->levelFallDelta == levelFallDelta[dType]
+			&& h->noiseType == noiseType[dType] && h->noiseLevel == noiseLevel
+			&& h->nAttackFrames == nAttackFrames[dType] && h->nPeakFrames == nPeakFrames[dType]
+			&& h->nDecayFrames == nDecayFrames[dType] && h->peakLevel == peakLevel[dType])
+		{
+			hit[dType] = h;
+			hitSearch = i;
+			return;
+		}
+	}
+}
+
+// carry on working the sounding hit out live from where the cache got to
+void NOSC::leaveHit()
+{
+	leaveNoise();
+	if(playing == NULL)
+		return;
+	
+	pPitchFall = playing->pitchFall[min(hitPos, static_cast<int>(playing->pitchFall.size()) - 1)];
+	playing = NULL;
+}
+
+// ... just the noise element and the envelope - the noise phase and the envelope as advance() would have them
+// (the envelope has stood still at the hit's first frame - its segment is found for the frame it's at, the level comes from the cache)
+void NOSC::leaveNoise()
+{
+	if(sounding == NULL)
+		return;
+	
+	phase = hitPos % NOSC_NTABLE_SIZE;
+	env.pos = hitPos;
+	env.reshape();
+	env.level = sounding->envelope[hitPos];
+	sounding = NULL;
+}
+
+// a drum's noise type / level has changed - a hit of it still sounding carries on its noise live, the next picks up its new tone
+void NOSC::changeNoise(int dType)
+{
+	if(dType == drumType)
+		leaveNoise();
+	findHit(dType);
+}
+
+// no pitch, no level - what's left when the drum channel has nothing to play
+const NOSC::DrumHit* NOSC::getStillHit()
+{
+	struct StillHit : DrumHit
+	{
+		StillHit()
+		{
+			increment.push_back(0);
+			level.push_back(0);
+			pitchFall.push_back(0);
+			settled = true;
+		}
+	};
+	static const StillHit still;
+	
+	return &still;
 }
 	
 void NOSC::advance()
 {
-	// advance on the sample nTable
-	phase += 1.0;
-	if(phase >= NOSC_NTABLE_SIZE)
-		phase -= NOSC_NTABLE_SIZE;
+	if(playing != NULL || sounding != NULL)
+		hitPos++;
+	
+	// noise element and envelope - from the cached hit
+	if(sounding != NULL)
+	{
+		// the envelope holds from here - carry on live (nothing moves but the noise)
+		if(hitPos >= static_cast<int>(sounding->envelope.size()))
+		{
+			env = sounding->envelopeEnd;
+			phase = hitPos % NOSC_NTABLE_SIZE;
+			sounding = NULL;
+		}
+	}
+	
+	// ... or worked out live
+	else
+	{
+		// advance on the sample nTable
+		phase += 1.0;
+		if(phase >= NOSC_NTABLE_SIZE)
+			phase -= NOSC_NTABLE_SIZE;
+		
+		// advance envelope also
+		advanceEnvelope();
+	}
 	
 	// advance on the sample pTable
 	pPhase += increment;
@@ -2136,27 +3726,50 @@ void NOSC::advance()
 		pPhase -= NOSC_PTABLE_SIZE;
 	}
 	
-	// keep adjusting increment for falling pitch part
-	setIncrement(drumType);
-	
-	// decrease the pitch + pitch pt level
-	if(pPitchFall > -pitchFallLimit[drumType])
-		pPitchFall -= pitchFallDelta[drumType];
+	// falling pitch part - from the cached hit
+	if(playing != NULL)
+	{
+		const DrumHit &h = *playing;
+		int nFrames = h.increment.size();
+		if(hitPos < nFrames)
+		{
+			increment = h.increment[hitPos];
+			pLevel = h.level[hitPos];
+		}
+		else if(!h.settled) // on from the last frame, live
+		{
+			pPitchFall = h.pitchFall[nFrames - 1];
+			playing = NULL;
+		}
+	}
 	
-	pLevel -= levelFallDelta[drumType];
-	if(pLevel <= 0.0f)
-		pLevel = 0.0f;
+	// ... or worked out live
+	if(playing == NULL)
+	{
+		// keep adjusting increment for falling pitch part
+		setIncrement(drumType);
 		
-	// advance envelope also
-	advanceEnvelope();
+		// decrease the pitch + pitch pt level
+		if(pPitchFall > -pitchFallLimit[drumType])
+			pPitchFall -= pitchFallDelta[drumType];
+		
+		pLevel -= levelFallDelta[drumType];
+		if(pLevel <= 0.0f)
+			pLevel = 0.0f;
+	}
 }
 
 void NOSC::setIncrement(int dType)
+	{ increment = getIncrement(dType, pPitchFall); }
+
+// pitched element's increment, for a drum's pitch fallen by pitchFall
+double NOSC::getIncrement(int dType, double pitchFall)
 {
-	double adjustedFrequency = frequency[dType] + pPitchFall;
-	increment = static_cast<double>(NOSC_PTABLE_SIZE) /  (static_cast<double>(NOSC_SAMPLE_RATE) / adjustedFrequency);
-	if(increment < 0)
-		increment = 0;
+	double adjustedFrequency = frequency[dType] + pitchFall;
+	double inc = static_cast<double>(NOSC_PTABLE_SIZE) /  (static_cast<double>(NOSC_SAMPLE_RATE) / adjustedFrequency);
+	if(inc < 0)
+		inc = 0;
+	return inc;
 }
 
 void NOSC::initializePhase()
@@ -2164,46 +3777,22 @@ void NOSC::initializePhase()
 
 // advance envelope frame by one frame
 void NOSC::advanceEnvelope()
-{
-	if(!envFinished)
-		envPos++;
-	if(envPos >= nEnvFrames[drumType])
-		envFinished = true;
-}
+	{ env.advance(); }
 
+// start the envelope of the current drum - drums decay to silence, no sustain or release
 void NOSC::refreshEnvelope()
 {
-	envPos = 0;
-	envFinished = false;
+	env.setShape(nAttackFrames[drumType], nPeakFrames[drumType], nDecayFrames[drumType], 0,
+					peakLevel[drumType], 0.0f);
+	env.noteOn();
 }
 
 float NOSC::getEnvelopeOutput()
 {
-	float output = 0.0f;
-	
 	if(resting) // currently playing a "REST", output just zero
-	{
-		output = 0.0f;
-	}
-	else if(envPos < nAttackFrames[drumType]) // in attack stage
-	{
-		output = ( (float) envPos / (float) nAttackFrames[drumType] ) * peakLevel[drumType];
-	}
-	else if( envPos < (nAttackFrames[drumType] + nPeakFrames[drumType]) ) // in peak stage
-	{
-		output = peakLevel[drumType];
-	}
-	else if( envPos < (nAttackFrames[drumType] + nPeakFrames[drumType] + nDecayFrames[drumType]) ) // in decay stage
-	{
-		int decayPos = envPos - (nAttackFrames[drumType] + nPeakFrames[drumType]);
-		output = peakLevel[drumType] - ((float) decayPos / (float) nDecayFrames[drumType]) * peakLevel[drumType];
-	}
-	else if(envFinished)
-	{
-		output = 0.0f;
-	}
+		return 0.0f;
 	
-	return output;
+	return env.getOutput();
 }
 
 float NOSC::getPitchOutput()
@@ -2217,16 +3806,26 @@ float NOSC::getPitchOutput()
 // get the summed output from wave nTable and envelope
 float NOSC::getOutput()
 {
-	int ph = (int) phase;
-
 	float noiseOut;
+	float envOut;
 	
-	if(noiseType[drumType]==1) // if one, use pink noise
-		noiseOut = nPinkTable[ph] * noiseLevel;
-	else // if zero, use white noise
-		noiseOut = nTable[ph] * noiseLevel;	
+	// noise element and envelope - played back from the hit's cache
+	if(sounding != NULL)
+	{
+		noiseOut = sounding->noise[hitPos];
+		envOut = resting ? 0.0f : static_cast<float>(sounding->envelope[hitPos]);
+	}
+	else
+	{
+		int ph = (int) phase;
 		
+		if(noiseType[drumType]==1) // if one, use pink noise
+			noiseOut = nPinkTable[ph] * noiseLevel;
+		else // if zero, use white noise
+			noiseOut = nTable[ph] * noiseLevel;	
 		
+		envOut = getEnvelopeOutput();
+	}
 
 	float pitchOut = getPitchOutput() * squareLevel;
 
@@ -2234,12 +3833,12 @@ float NOSC::getOutput()
 	
 	// output the regular way
 	if(!beefUp)
-		out = ( noiseOut * gain + pitchOut * gain) * getEnvelopeOutput();
+		out = ( noiseOut * gain + pitchOut * gain) * envOut;
 	
 	// if beefUp is enabled
 	else
-		out = limit( 	pitchOut * gain * getEnvelopeOutput() * beefUpFactor +
-						noiseOut * gain * getEnvelopeOutput() * beefUpFactorNoise );
+		out = limit( 	pitchOut * gain * envOut * beefUpFactor +
+						noiseOut * gain * envOut * beefUpFactorNoise );
 	
 	historyWriteWait++;
 	if(historyWriteWait >= 8)
@@ -2297,26 +3896,36 @@ void NOSC::setBeefUpFactor(float factor)
 void NOSC::useWhiteNoise()
 { 
 	for(int i=0; i<6; i++)
+	{
 		noiseType[i] = 0;
+		changeNoise(i);
+	}
 }
 
 void NOSC::usePinkNoise()
 { 
 	for(int i=0; i<6; i++)
+	{
 		noiseType[i] = 1;
+		changeNoise(i);
+	}
 }
 	
 void NOSC::setKickNoiseType(int type)
-	{ noiseType[0] = type; noiseType[3] = type; }
+	{ noiseType[0] = type; noiseType[3] = type; changeNoise(0); changeNoise(3); }
 	
 void NOSC::setSnareNoiseType(int type)
-	{ noiseType[1] = type; noiseType[4] = type; }
+	{ noiseType[1] = type; noiseType[4] = type; changeNoise(1); changeNoise(4); }
 
 void NOSC::setHiHatNoiseType(int type)
-	{ noiseType[2] = type; noiseType[5] = type; }
+	{ noiseType[2] = type; noiseType[5] = type; changeNoise(2); changeNoise(5); }
 	
 void NOSC::setNoiseLevel(float nLevel)
-	{ noiseLevel = nLevel; }
+{
+	noiseLevel = nLevel;
+	for(int i=0; i<6; i++)
+		changeNoise(i);
+}
 
 void NOSC::setSquareLevel(float sqLevel)
 	{ squareLevel = sqLevel; }
@@ -2412,9 +4021,42 @@ void DelayLine::setParameters(int firstDelayTime, int delayTime, float delayGain
 	}
 }
 
-// call to update delayline every frame
-// returns the delay output for current frame
-float DelayLine::update(float input)
+// take over another delay line's times + gains (its buffer contents stay behind)
+void DelayLine::copyParameters(const DelayLine &other)
+{
+	// only a change in delay time needs the indexes reset - keeps the echo running otherwise
+	if(buffer1len != other.buffer1len || buffer2len != other.buffer2len)
+	{
+		buffer1len = other.buffer1len;
+		buffer2len = other.buffer2len;
+		totalDelayFrames = other.totalDelayFrames;
+		
+		readIndex1 = 1;
+		writeIndex1 = 0;
+		readIndex2 = 1;
+		writeIndex2 = 0;
+	}
+	
+	outGain1 = other.outGain1;
+	outGain2 = other.outGain2;
+}
+
+// trade what's echoing (buffers, positions in them) with other - parameters stay put
+void DelayLine::swapBuffers(DelayLine &other)
+{
+	buffer1.swap(other.buffer1);
+	buffer2.swap(other.buffer2);
+	std::swap(readIndex1, other.readIndex1);
+	std::swap(writeIndex1, other.writeIndex1);
+	std::swap(readIndex2, other.readIndex2);
+	std::swap(writeIndex2, other.writeIndex2);
+	std::swap(out1, other.out1);
+	std::swap(out2, other.out2);
+}
+
+// call to update delayline every frame
+// returns the delay output for current frame
+float DelayLine::update(float input)
 {
 	// handle buffer1 write & read
 	buffer1[writeIndex1] = input;
@@ -2476,6 +4118,9 @@ void DelayLine::clearBuffer()
 #include "BC/MData.h"
 #include "BC/DData.h"
 #include "BC/MPlayer.h"
+#include "BC/Trace.h"
+
+const std::string MML::LOAD_ERROR = "Load error...\xFF";
 
 MML::MML()
 {}
@@ -2494,13 +4139,14 @@ void MML::initialize(double sampleRate, double tempo)
 		eventTag[i] = "";
 	eventTag[0]="DEFAULTTONE"; eventTag[1]="LFO=ON"; eventTag[2]="LFO=OFF"; eventTag[3]="PRESET=BEEP";
 	eventTag[4]="PRESET=POPPYVIB"; eventTag[5]="PRESET=POPPY"; eventTag[6]="PRESET=BELL";
-	eventTag[20]="WAVEFLIP";
+	eventTag[20]="WAVEFLIP"; eventTag[21]="LOOPSTART";
 	eventTag[100]="WAVEFORM="; eventTag[101]="ATTACKTIME="; eventTag[102]="PEAKTIME="; eventTag[103]="DECAYTIME=";
 	eventTag[104]="RELEASETIME="; eventTag[105]="PEAKLEVEL="; eventTag[106]="SUSTAINLEVEL=";
 	eventTag[107]="ASTRO=OFF"; eventTag[108]="ASTRO=";
 	eventTag[109]="LFORANGE="; eventTag[110]="LFOSPEED="; eventTag[111]="LFOWAIT=";
 	eventTag[112]="FALLSPEED="; eventTag[113]="FALLWAIT="; eventTag[114]="RISESPEED="; eventTag[115]="RISERANGE=";
 	eventTag[116]="BEEFUP="; eventTag[117]="RINGMOD=OFF"; eventTag[118]="RINGMOD=";
+	eventTag[119]="MARKER=";
 	
 	// NOTE: if you want to register a tag that contains another tag name, register the longer tag first!
 	// for example, PRESET=POPPYVIB must come earlier than PRESET=POPPY
@@ -2519,10 +4165,12 @@ void MML::initialize(double sampleRate, double tempo)
 	eventTagDrum[3]="KICKNOISE=WHITE"; eventTagDrum[4]="KICKNOISE=PINK";
 	eventTagDrum[5]="SNARENOISE=WHITE"; eventTagDrum[6]="SNARENOISE=PINK";
 	eventTagDrum[7]="HIHATNOISE=WHITE"; eventTagDrum[8]="HIHATNOISE=PINK";
+	eventTagDrum[9]="LOOPSTART";
 	eventTagDrum[100]="KICKPITCH="; eventTagDrum[101]="SNAREPITCH="; eventTagDrum[102]="HIHATPITCH=";
 	eventTagDrum[103]="BEEFUP="; 
 	eventTagDrum[104]="KICKLENGTH="; eventTagDrum[105]="SNARELENGTH="; eventTagDrum[106]="HIHATLENGTH=";
 	eventTagDrum[107]="SQUARELEVEL="; eventTagDrum[108]="NOISELEVEL=";
+	eventTagDrum[109]="MARKER=";
 	
 	for(int i=0; i<N_EVENT_TAGS; i++)
 	{
@@ -2549,6 +4197,22 @@ void MML::initialize(double sampleRate, double tempo)
 	}
 	dsource = "    ";
 	gsource = "    ";
+	
+	origin.clear();
+	
+	// nothing parsed yet - parseChanged() will parse everything
+	hashPlayer = NULL;
+	hashGeneration = 0;
+	globalHash = 0;
+	for(int i=0; i<N_SECTIONS; i++)
+	{
+		sectionHash[i] = 0;
+		sectionBookmark[i] = 0;
+		sectionLoopStart[i] = 0;
+	}
+	channelEndNoteLength = noteLength;
+	drumStartNoteLength = noteLength;
+	nSectionsParsed = 0;
 }
 
 void MML::calculateTiming()
@@ -2561,6 +4225,7 @@ void MML::calculateTiming()
 
 string MML::setSource(string masterStr)
 {
+	BC_TRACE_SPAN("MML::setSource");
 	// save untouched original source
 	originalSource = masterStr;
 
@@ -2570,6 +4235,7 @@ string MML::setSource(string masterStr)
 	// take out all comments from the string
 	masterStr = takeOutComments(masterStr);
 	masterStr = takeOutSpaces(masterStr);
+	mapCleanSource(originalSource + "   ");
 
 	// initialize all source strings
 
@@ -2577,6 +4243,11 @@ string MML::setSource(string masterStr)
 	{
 		source[i] = "    ";
 	}
+	for(int i=0; i<N_SECTIONS; i++)
+	{
+		origin.sectionStart[i] = -1;
+		origin.sectionLength[i] = 0;
+	}
 
 	dsource = "    ";
 	gsource = "    ";
@@ -2593,10 +4264,12 @@ string MML::setSource(string masterStr)
 				int channel = nextCh - '1'; // @ number (1 to 9) to channel number (0 to 8)
 
 				source[channel] = masterStr.substr(i+2);
+				origin.sectionStart[channel] = i+2;
 				found = source[channel].find('@');  // try to search for next '@'
 												 // - and extract part just before it
 				if(found!=string::npos)
 					source[channel] = source[channel].substr(0, found);
+				origin.sectionLength[channel] = source[channel].length();
 
 				/*
 				// DEBUG
@@ -2610,9 +4283,11 @@ string MML::setSource(string masterStr)
 			else if(nextCh=='d' || nextCh=='D') // drum channel source
 			{
 				dsource = masterStr.substr(i+2);
+				origin.sectionStart[9] = i+2;
 				found = dsource.find('@');
 				if(found!=string::npos)
 					dsource = dsource.substr(0, found);
+				origin.sectionLength[9] = dsource.length();
 			}
 			else if(nextCh=='g' || nextCh=='G') // global definition source found
 			{
@@ -2632,9 +4307,46 @@ string MML::getSource()
 	return originalSource;
 }
 
+// work out where each character left by takeOutComments() + takeOutSpaces() was in the source
+// - the cleaned string is the source with characters taken out, so positions only ever go up
+void MML::mapCleanSource(const string &str)
+{
+	vector<int> &cleanPos = origin.cleanPos;
+	vector<int> &lineStart = origin.lineStart;
+	cleanPos.clear();
+	lineStart.clear();
+	lineStart.push_back(0);
+	
+	int len = str.length();
+	bool inComment = false;
+	bool commentsDone = false; // takeOutComments() stops looking at the first '$'
+	for(int i=0; i<len; i++)
+	{
+		char ch = str.at(i);
+		if(ch == '\n')
+		{
+			lineStart.push_back(i+1);
+			inComment = false;
+		}
+		
+		if(!commentsDone && !inComment && ch == '$')
+			commentsDone = true;
+		if(!commentsDone && !inComment && ch == '/' && i+1 < len && str.at(i+1) == '/')
+			inComment = true;
+		
+		if(!inComment && ch != ' ' && ch != '\n' && ch != '(')
+			cleanPos.push_back(i);
+	}
+	
+	// the "$$$$$$$$" takeOutComments() puts at the end
+	for(int i=0; i<8; i++)
+		cleanPos.push_back(originalSource.length());
+}
+
 // function to take out all comments from source string
 string MML::takeOutComments(string masterStr)
 {
+	BC_TRACE_SPAN("MML::takeOutComments");
 	string str = masterStr + "  $$$$$$$$";
 	string comment;
 	string comments = "";
@@ -2734,41 +4446,148 @@ double MML::getFrequency(int toneNum)
 
 // hub function to parse ALL MML source strings
 string MML::parse(MPlayer* player)
+{
+	BC_TRACE_SPAN("MML::parse");
+	beginParse(player);
+	
+	// initialize all existing MData
+	player->clearMarkers();
+
+	// now parse music channel data, then drum channel data
+	for(int i=0; i<N_SECTIONS; i++)
+		parseSection(player, i);
+	
+	finishParse(player);
+	
+	// from now on parseChanged() can skip whatever stays the same
+	hashPlayer = player;
+	hashGeneration = player->getSongGeneration();
+	globalHash = hashSection(gsource);
+	nSectionsParsed = N_SECTIONS;
+	
+	return "success";
+}
+
+// like parse(), but only the channels whose source changed since the last parse
+// into the same player are parsed again - the others keep their data
+// (a change in the global section changes timing, so everything is parsed then -
+// as it is when another song has been swapped into the player since)
+string MML::parseChanged(MPlayer* player)
+{
+	if(player != hashPlayer || player->getSongGeneration() != hashGeneration
+		|| hashSection(gsource) != globalHash)
+		return parse(player);
+	
+	beginParse(player);
+	
+	nSectionsParsed = 0;
+	for(int i=0; i<N_SECTIONS; i++)
+	{
+		const string &str = (i < 9) ? source[i] : dsource;
+		
+		// drums pick up the note length channel 9 leaves behind - follow it if that moved
+		bool drumsFollow = (i == 9 && channelEndNoteLength != drumStartNoteLength);
+		
+		if(hashSection(str) != sectionHash[i] || drumsFollow)
+		{
+			player->clearChannelMarkers(i);
+			parseSection(player, i);
+			nSectionsParsed++;
+		}
+	}
+	
+	finishParse(player);
+	
+	return "success";
+}
+
+// how many channel sections the last parse() / parseChanged() went through
+int MML::getSectionsParsed()
+	{ return nSectionsParsed; }
+
+// common start of every parse - defaults, then the global section
+void MML::beginParse(MPlayer* player)
 {
 	// initialize parameters back to default
 	tempo = 120.0;
 	octave = 4;						// default octave is 4
 	noteLength = baseLength * 2;	// set default to 8th notes
-	
-	// player's bookmarked start is of course off in default
-	player->setBookmark(0);
 
 	// parse global source
 	parseGlobalSource(player);
+}
 
-	// initialize all existing MData
-	for(int i=0; i<9; i++)
+// parse one section - 0 to 8 for channels @1 to @9, 9 for drums
+// bookmark and loop start are kept per section and merged in finishParse()
+void MML::parseSection(MPlayer* player, int section)
+{
+	// player's bookmarked start is of course off in default
+	player->setBookmark(0);
+	
+	// no loop start unless LOOPSTART is found - loop from the top
+	player->setLoopStart(0);
+	
+	if(section < 9)
 	{
-		player->data[i].clear(); // clear regular channel data
+		player->data[section].clear(); // clear regular channel data
+		parseChannelSource(player, section);
+		sectionHash[section] = hashSection(source[section]);
+		if(section == 8)
+			channelEndNoteLength = noteLength;
 	}
-	player->ddata.clear(); // clear drum channel data
-
-	// now parse music channel data
-	for(int i=0; i<9; i++)
+	else
 	{
-		parseChannelSource(player, i);
+		noteLength = channelEndNoteLength;
+		drumStartNoteLength = noteLength;
+		player->ddata.clear(); // clear drum channel data
+		parseDrumSource(player);
+		sectionHash[section] = hashSection(dsource);
 	}
+	
+	sectionBookmark[section] = player->getBookmark();
+	sectionLoopStart[section] = player->getLoopStart();
+}
 
-	// parse drum channel data
-	parseDrumSource(player);	
+// latest bookmark / loop start among all sections wins
+void MML::finishParse(MPlayer* player)
+{
+	long bookmark = 0;
+	long loopStart = 0;
+	for(int i=0; i<N_SECTIONS; i++)
+	{
+		bookmark = max(bookmark, sectionBookmark[i]);
+		loopStart = max(loopStart, sectionLoopStart[i]);
+	}
+	player->setBookmark(bookmark);
+	player->setLoopStart(loopStart);
 	
-	return "success";
+	// markers were collected channel by channel - put them in song order
+	player->sortMarkers();
+	
+	// the song's own copy of where its sections are in the source
+	player->sourceOrigin = origin;
+	
+	// the drum hits it plays, built here rather than in the audio callback
+	player->prepareDrumHits();
+}
+
+// FNV-1a - tells whether a section's source changed since it was parsed
+unsigned long long MML::hashSection(const string &str)
+{
+	unsigned long long hash = 14695981039346656037ULL;
+	for(size_t i=0; i<str.length(); i++)
+	{
+		hash ^= static_cast<unsigned char>(str[i]);
+		hash *= 1099511628211ULL;
+	}
+	return hash;
 }
 
 // function to parse an MML string for a particular channel
 // will fill the MData object with the data that is read
 string MML::parseChannelSource(MPlayer* player, int channel)
 {
+	BC_TRACE_SPAN("MML::parseChannelSource");
 	// choose the MData object to write to.
 	if(channel >= 0 && channel <= 8)
 		output = &(player->data[channel]); // gets pointer to MData object
@@ -2789,6 +4608,11 @@ string MML::parseChannelSource(MPlayer* player, int channel)
 	int strLen = str.length();
 	str = str + "              $$$$$$"; // safeguard, and signal end of string!
 	size_t found;
+	
+	// position in the section each char of str came from (-1 for safeguard chars)
+	vector<int> srcPos(str.length(), -1);
+	for(int k=0; k<strLen; k++)
+		srcPos[k] = k;
 
 	while(!eventTagsDone)
 	{		
@@ -2812,6 +4636,8 @@ string MML::parseChannelSource(MPlayer* player, int channel)
 					
 					str.insert(searchPos + targetLen + digits, ")");
 					str.insert(searchPos,"(");
+					srcPos.insert(srcPos.begin() + searchPos + targetLen + digits, -1);
+					srcPos.insert(srcPos.begin() + searchPos, srcPos[searchPos]);
 					strLen += 2; // we just increased the string's length by w chars...
 					searchPos += targetLen; // advance.. we should skip the newly inserted '('
 					i = N_EVENT_TAGS; // force this loop to end
@@ -2837,6 +4663,7 @@ string MML::parseChannelSource(MPlayer* player, int channel)
 	// (any repeated parts will be duplicated)
 
 	str = str + "     $$$$$$"; // to signal end of string
+	srcPos.resize(str.length(), -1);
 	bool done = false;
 
 	int i = 0;
@@ -2855,6 +4682,7 @@ string MML::parseChannelSource(MPlayer* player, int channel)
 		{
 			leftBraces.push_back(i); // push this position into stack
 			str.erase(i,1); // go ahead and erase this '{'
+			srcPos.erase(srcPos.begin() + i);
 			
 			char chNext = str.at(i); // this should be the char right after '{'
 			int numberRead = 0;
@@ -2864,11 +4692,15 @@ string MML::parseChannelSource(MPlayer* player, int channel)
 			{
 				numberRead = chNext - '0'; // set the num of times to duplicate at right brace
 				str.erase(i,1); // go ahead and erase this digit
+				srcPos.erase(srcPos.begin() + i);
 				if(numberRead==0) numberRead = 1;
 				
 				// make sure there aren't any more digits after this
 				while( (str.at(i)>='0'&&str.at(i)<='9') )
+				{
 					str.erase(i,1); // erase this digit
+					srcPos.erase(srcPos.begin() + i);
+				}
 			}
 			else
 				numberRead = 2; // repeat times not specified -> set to twice
@@ -2880,6 +4712,7 @@ string MML::parseChannelSource(MPlayer* player, int channel)
 		else if (ch=='}') // right brace to close repeat
 		{
 			str.erase(i,1); // go ahead and erase this '}'
+			srcPos.erase(srcPos.begin() + i);
 			if(leftBraces.size() > 0) // if stack is empty, ignore
 			{
 				// pop last element from stack - gets the nearest pos of '{'
@@ -2893,11 +4726,16 @@ string MML::parseChannelSource(MPlayer* player, int channel)
 				
 				nCharsToCopy = i - leftBracePos; // n of chars to duplicate
 				strToCopy = str.substr(leftBracePos, nCharsToCopy); // str to be duplicated
+				vector<int> srcPosToCopy(srcPos.begin() + leftBracePos, srcPos.begin() + i);
 				
 				if(timesToDuplicate >=1 && timesToDuplicate <=8)
 				{
 					for(int i=0; i<timesToDuplicate; i++)
+					{
 						str.insert(leftBracePos+nCharsToCopy, strToCopy);
+						srcPos.insert(srcPos.begin() + leftBracePos + nCharsToCopy,
+							srcPosToCopy.begin(), srcPosToCopy.end());
+					}
 				}
 			}
 		}
@@ -2922,6 +4760,11 @@ string MML::parseChannelSource(MPlayer* player, int channel)
 	i = 0;
 	// int len = str.length();
 	long framesWritten = 0;
+	
+	// every token that writes a note or an event goes into the source map
+	size_t nWritten = 0;
+	long tokenFrame = 0;
+	int tokenPos = -1;
 
 	if(str.empty() || str.length() <= 1)
 	{
@@ -2933,6 +4776,14 @@ string MML::parseChannelSource(MPlayer* player, int channel)
 
 	while(!done)
 	{
+		if(output->freqNote.size() + output->eventType.size() != nWritten)
+		{
+			output->sourceMap.add(tokenFrame, tokenPos);
+			nWritten = output->freqNote.size() + output->eventType.size();
+		}
+		tokenFrame = framesWritten;
+		tokenPos = srcPos[i];
+		
 		ch = str.at(i);
 		// cout << "Read = " << ch << " at " << i << endl;
 
@@ -2971,7 +4822,7 @@ string MML::parseChannelSource(MPlayer* player, int channel)
 			if(str.at(i)==',') // fall effect for this note!
 			{
 				// DEBUG
-				cout << "parsing - found a ',' - FALL!\n";
+				// cout << "parsing - found a ',' - FALL!\n";
 				
 				// push this 'fall' event to events vector in MData
 				output->eventType.push_back(50); // FALL
@@ -3678,6 +5529,22 @@ string MML::parseChannelSource(MPlayer* player, int channel)
 					output->nEvents++;
 				}				
 			}
+			else if(str.substr(i, 7) == "MARKER=") // user marker 0 to 999 - reported to game as music event
+			{
+				string strValue = str.substr(i+7,3); // get 3 digits following '='
+				int valueDigits = countDigits(strValue);
+				strValue = strValue.substr(0, valueDigits);
+				int value = atoi(strValue.c_str());
+				value = min(999, max(0, value)); // floor + ceil the value
+				
+				player->addMarker(framesWritten, value, channel);
+			}
+			else if(str.substr(i, 9) == "LOOPSTART") // loop back to here instead of the very top
+			{
+				// like bookmarks, the latest LOOPSTART among all channels wins
+				if(framesWritten > player->getLoopStart())
+					player->setLoopStart(framesWritten);
+			}
 			// cout << "event parsing done! " << str.substr(i,13) << "\n";
 			
 			// fast forward to where we find the next ')'
@@ -3724,6 +5591,8 @@ string MML::parseChannelSource(MPlayer* player, int channel)
 		// cout << endl;
 
 	}
+	output->sourceMap.finish();
+	output->buildStream();
 
 	return result;
 }
@@ -3732,6 +5601,7 @@ string MML::parseChannelSource(MPlayer* player, int channel)
 // will fill the DData object with the data that is read
 string MML::parseDrumSource(MPlayer* player)
 {
+	BC_TRACE_SPAN("MML::parseDrumSource");
 	dOutput = &player->ddata; // gets pointer to MData object
 
 	// channel source string to work on
@@ -3749,6 +5619,11 @@ string MML::parseDrumSource(MPlayer* player)
 	int strLen = str.length();
 	str = str + "                $$$$$$"; // safeguard, and signal end of string!
 	size_t found;
+	
+	// position in the section each char of str came from (-1 for safeguard chars)
+	vector<int> srcPos(str.length(), -1);
+	for(int k=0; k<strLen; k++)
+		srcPos[k] = k;
 
 	while(!eventTagsDone)
 	{		
@@ -3772,6 +5647,8 @@ string MML::parseDrumSource(MPlayer* player)
 					
 					str.insert(searchPos + targetLen + digits, ")");
 					str.insert(searchPos,"(");
+					srcPos.insert(srcPos.begin() + searchPos + targetLen + digits, -1);
+					srcPos.insert(srcPos.begin() + searchPos, srcPos[searchPos]);
 					strLen += 2; // we just increased the string's length by w chars...
 					searchPos += targetLen; // advance.. we should skip the newly inserted '('
 					i = N_EVENT_TAGS; // force this loop to end
@@ -3791,6 +5668,7 @@ string MML::parseDrumSource(MPlayer* player)
 	// (any repeated parts will be duplicated)
 
 	str = str + "$$$$$$"; // to signal end of string
+	srcPos.resize(str.length(), -1);
 	
 	bool done = false;
 
@@ -3810,6 +5688,7 @@ string MML::parseDrumSource(MPlayer* player)
 		{
 			leftBraces.push_back(i); // push this position into stack
 			str.erase(i,1); // go ahead and erase this '{'
+			srcPos.erase(srcPos.begin() + i);
 			
 			char chNext = str.at(i); // this should be the char right after '{'
 			int numberRead = 0;
@@ -3819,11 +5698,15 @@ string MML::parseDrumSource(MPlayer* player)
 			{
 				numberRead = chNext - '0'; // set the num of times to duplicate at right brace
 				str.erase(i,1); // go ahead and erase this digit
+				srcPos.erase(srcPos.begin() + i);
 				if(numberRead==0) numberRead = 1;
 				
 				// make sure there aren't any more digits after this
 				while( (str.at(i)>='0'&&str.at(i)<='9') )
+				{
 					str.erase(i,1); // erase this digit
+					srcPos.erase(srcPos.begin() + i);
+				}
 			}
 			else
 				numberRead = 2; // repeat times not specified -> set to twice
@@ -3834,6 +5717,7 @@ string MML::parseDrumSource(MPlayer* player)
 		else if (ch=='}') // right brace to close repeat
 		{
 			str.erase(i,1); // go ahead and erase this '}'
+			srcPos.erase(srcPos.begin() + i);
 			if(leftBraces.size() > 0) // if stack is empty, ignore
 			{
 				// pop last element from stack - gets the nearest pos of '{'
@@ -3847,11 +5731,16 @@ string MML::parseDrumSource(MPlayer* player)
 
 				nCharsToCopy = i - leftBracePos; // n of chars to duplicate
 				strToCopy = str.substr(leftBracePos, nCharsToCopy); // str to be duplicated
+				vector<int> srcPosToCopy(srcPos.begin() + leftBracePos, srcPos.begin() + i);
 				
 				if(timesToDuplicate >=1 && timesToDuplicate <=8)
 				{
 					for(int i=0; i<timesToDuplicate; i++)
+					{
 						str.insert(leftBracePos+nCharsToCopy, strToCopy);
+						srcPos.insert(srcPos.begin() + leftBracePos + nCharsToCopy,
+							srcPosToCopy.begin(), srcPosToCopy.end());
+					}
 				}
 			}
 		}
@@ -3876,9 +5765,22 @@ string MML::parseDrumSource(MPlayer* player)
 	i = 0;
 	// int len = str.length();
 	long framesWritten = 0;
+	
+	// every token that writes a note or an event goes into the source map
+	size_t nWritten = 0;
+	long tokenFrame = 0;
+	int tokenPos = -1;
 
 	while(!done)
 	{
+		if(dOutput->drumNote.size() + dOutput->eventType.size() != nWritten)
+		{
+			dOutput->sourceMap.add(tokenFrame, tokenPos);
+			nWritten = dOutput->drumNote.size() + dOutput->eventType.size();
+		}
+		tokenFrame = framesWritten;
+		tokenPos = srcPos[i];
+		
 		ch = str.at(i);
 		// cout << "Read = " << ch << " at " << i << endl;
 
@@ -4340,6 +6242,22 @@ string MML::parseDrumSource(MPlayer* player)
 				dOutput->eventFrame.push_back(framesWritten);
 				dOutput->nEvents++;
 			}
+			else if(str.substr(i, 7) == "MARKER=") // user marker 0 to 999 - reported to game as music event
+			{
+				string strValue = str.substr(i+7,3); // get 3 digits following '='
+				int valueDigits = countDigits(strValue);
+				strValue = strValue.substr(0, valueDigits);
+				int value = atoi(strValue.c_str());
+				value = min(999, max(0, value)); // floor + ceil the value
+				
+				player->addMarker(framesWritten, value, 9);
+			}
+			else if(str.substr(i, 9) == "LOOPSTART") // loop back to here instead of the very top
+			{
+				// like bookmarks, the latest LOOPSTART among all channels wins
+				if(framesWritten > player->getLoopStart())
+					player->setLoopStart(framesWritten);
+			}
 			
 			// cout << "event parsing done! " << str.substr(i,13) << "\n";
 			
@@ -4408,12 +6326,15 @@ string MML::parseDrumSource(MPlayer* player)
 		// cout << endl;
 
 	}
+	dOutput->sourceMap.finish();
+	dOutput->buildStream();
 
 	return result;
 }
 
 void MML::parseGlobalSource(MPlayer* player)
 {
+	BC_TRACE_SPAN("MML::parseGlobalSource");
 	bool done = false;
 	int i=0;
 	char ch, ch2;
@@ -4648,12 +6569,14 @@ void MML::parseGlobalSource(MPlayer* player)
 		gain[6], gain[7], gain[8], gainD);
 	tempo = tpo;
 	calculateTiming(); // recalculate base note lengths
+	player->setMusicalTiming(quarterNoteLength, measureLength);
 }
 
 // this function will load a MML file and then parse
 // returns the loaded string
 string MML::loadFile(string filename, MPlayer* player)
 {
+	BC_TRACE_SPAN("MML::loadFile");
 	// try to open file
 	ifstream inFile;
 	inFile.open(filename.c_str(), ifstream::in);
@@ -4662,10 +6585,9 @@ string MML::loadFile(string filename, MPlayer* player)
 	if(!inFile)
 	{
 		errLog("Error loading file: ", filename);
-		string strToReturn = "Load error...\xFF";
-		setSource(strToReturn);
+		setSource(LOAD_ERROR);
 		inFile.close();
-		return strToReturn;
+		return LOAD_ERROR;
 	}
 
 	string fileContent = "";
@@ -4701,6 +6623,22 @@ string MML::loadFile(string filename, MPlayer* player)
 	return fileContent;
 }
 
+// load a song into a player of its own, ready to render - no audio device involved
+// (set up with empty data first, like BCPlayer::initialize() - so it renders the same as in a game)
+// returns false if the file can't be read
+bool MML::loadSong(string filename, MPlayer* player)
+{
+	setSource(" ");
+	parse(player);
+	player->goToBeginning();
+	player->resetForNewSong();
+	
+	if(loadFile(filename, player) == LOAD_ERROR) // (parses, too)
+		return false;
+	player->prepareLoopState();
+	return true;
+}
+
 // this function will save the original MML source stored to a file
 string MML::saveFile(string filename, MPlayer* player)
 {
@@ -4783,268 +6721,637 @@ std::string MML::toString(int n)
 
 
 
-// MPlayer.cpp ////////////////////////////////////////
-// MPlayer Class - Implementation /////////////////////
+// MusicEvent.cpp ////////////////////////////////////////
+// MusicEventQueue class - Implementation ////////////////
 
-// include dependencies
+#include "BC/MusicEvent.h"
 
-#include <algorithm>
-#include <iostream>
-#include <vector>
-#include <string>
-#include <math.h>
-#include <cstdio>
-//#?include <windows.h> // DEBUG
+MusicEventQueue::MusicEventQueue()
+{
+	writeIndex = 0;
+	readIndex = 0;
+}
 
-/*----------
+// push one event - audio callback side
+// returns false (event dropped) if the game hasn't drained the ring in time
+bool MusicEventQueue::post(int type, int param, long songFrame, long streamFrame)
+{
+	int w = writeIndex.load(std::memory_order_relaxed);
+	int next = (w + 1) % QUEUE_SIZE;
+	if(next == readIndex.load(std::memory_order_acquire)) // full
+		return false;
+	
+	ring[w].type = type;
+	ring[w].param = param;
+	ring[w].songFrame = songFrame;
+	ring[w].streamFrame = streamFrame;
+	writeIndex.store(next, std::memory_order_release);
+	return true;
+}
 
-#include <sndfile.h>
-#include <lame/lame.h>
+// take the oldest event - game thread side
+// returns false when there is nothing left
+bool MusicEventQueue::poll(MusicEvent &e)
+{
+	int r = readIndex.load(std::memory_order_relaxed);
+	if(r == writeIndex.load(std::memory_order_acquire)) // empty
+		return false;
+	
+	e = ring[r];
+	readIndex.store((r + 1) % QUEUE_SIZE, std::memory_order_release);
+	return true;
+}
 
-----------*/
+// throw away everything not read yet - game thread side
+void MusicEventQueue::clear()
+{
+	readIndex.store(writeIndex.load(std::memory_order_acquire), std::memory_order_release);
+}
 
-#include "BC/MPlayer.h"
 
-const int MPlayer::SAMPLE_RATE = 44100;
-const int MPlayer::FRAMES_PER_BUFFER = 256;
 
-using namespace std;
 
-// real port audio callback function
-// (redirected from 'paCallback')
+// LoudnessMeter.cpp /////////////////////////////////////
+// LoudnessMeter class - Implementation //////////////////
 
-int MPlayer::playerCallback (
-		const void *inputBuffer, void *outputBuffer,
-		unsigned long framesPerBuffer,
-		const PaStreamCallbackTimeInfo* timeInfo,
-		PaStreamCallbackFlags statusFlags )
-{
-	float* out = static_cast<float*>(outputBuffer);
-	// static_cast<int>(framesPerBuffer); // since this has no effect..
-	static_cast<void>(timeInfo);
-	static_cast<void>(statusFlags);
-	static_cast<void>(inputBuffer);
+#include <math.h>
+#include "BC/LoudnessMeter.h"
+
+const double LoudnessMeter::PI = 3.14159265358979;
+
+LoudnessMeter::LoudnessMeter()
+{
+	const double rate = 44100.0;
+	
+	// K-weighting (BS.1770) worked out for 44100hz - the stage 1 high shelf ...
+	double f0 = 1681.974450955533;
+	double gain = 3.999843853973347;
+	double q = 0.7071752369554196;
+	double k = tan(PI * f0 / rate);
+	double vh = pow(10.0, gain / 20.0);
+	double vb = pow(vh, 0.4996667741545416);
+	double a0 = 1.0 + k / q + k * k;
+	shelfB[0] = (vh + vb * k / q + k * k) / a0;
+	shelfB[1] = 2.0 * (k * k - vh) / a0;
+	shelfB[2] = (vh - vb * k / q + k * k) / a0;
+	shelfA[0] = 1.0;
+	shelfA[1] = 2.0 * (k * k - 1.0) / a0;
+	shelfA[2] = (1.0 - k / q + k * k) / a0;
+	
+	// ... and the stage 2 high pass
+	f0 = 38.13547087602444;
+	q = 0.5003270373238773;
+	k = tan(PI * f0 / rate);
+	a0 = 1.0 + k / q + k * k;
+	passB[0] = 1.0;
+	passB[1] = -2.0;
+	passB[2] = 1.0;
+	passA[0] = 1.0;
+	passA[1] = 2.0 * (k * k - 1.0) / a0;
+	passA[2] = (1.0 - k / q + k * k) / a0;
+	
+	// true peak - windowed sinc for the points 1/4, 2/4 and 3/4 of the way to the next sample
+	phaseGain = 1.0;
+	for(int p=0; p<3; p++)
+	{
+		double sum = 0.0;
+		for(int i=0; i<TAPS; i++)
+		{
+			double d = (TAPS / 2 - 1) + (p + 1) / 4.0 - i;
+			double window = 0.5 * (1.0 + cos(PI * d / (TAPS / 2)));
+			phase[p][i] = sin(PI * d) / (PI * d) * window;
+			sum += phase[p][i];
+		}
+		double gain = 0.0;
+		for(int i=0; i<TAPS; i++)
+		{
+			phase[p][i] /= sum;
+			gain += fabs(phase[p][i]);
+		}
+		phaseGain = max(phaseGain, gain);
+	}
+	
+	reset();
+}
 
-	float soundAmplitudeLeft;
-	float soundAmplitudeRight;
+// start over - for the next song
+void LoudnessMeter::reset()
+{
+	for(int c=0; c<2; c++)
+	{
+		for(int i=0; i<4; i++)
+			state[c][i] = 0.0;
+		for(int i=0; i<TAPS * 2; i++)
+			history[c][i] = 0.0f;
+		blockSum[c] = 0.0;
+		sumSquares[c] = 0.0;
+		sinceLoud[c] = 0;
+	}
+	historyPos = 0;
+	blockFrames = 0;
+	subBlocks.clear();
+	frames = 0;
+	peak = 0.0;
+	truePeak = 0.0;
+}
 
-	for(unsigned long ii=0; ii<framesPerBuffer; ii++)
+// take in nFrames more (stereo, interleaved)
+void LoudnessMeter::process(const float* buffer, int nFrames)
+{
+	int done = 0;
+	while(done < nFrames)
 	{
-		if(!playing) // if player is not playing or finished playing, just pass 0
+		// up to the end of this 100 msec sub-block - a channel at a time
+		int n = min(nFrames - done, SUB_BLOCK - blockFrames);
+		for(int c=0; c<2; c++)
+			processChannel(buffer + done * 2 + c, n, c);
+		historyPos = (historyPos + n) % TAPS;
+		done += n;
+		
+		// keep the sub-block's mean square (both channels)
+		blockFrames += n;
+		if(blockFrames == SUB_BLOCK)
 		{
-			soundAmplitudeLeft = 0.0f;
-			soundAmplitudeRight = 0.0f;
-			
-			// place holder for BCPlayer...
-			// in BCPlayer, if music is stopped, you get sound effects only :)
-			soundAmplitudeLeft = sfx->getOutput(0);
-			soundAmplitudeRight = sfx->getOutput(1);
-			
-			// soundAmplitudeLeft = sfx->getOutput(0);
-			// soundAmplitudeRight = sfx->getOutput(1);
-			
+			subBlocks.push_back((blockSum[0] + blockSum[1]) / SUB_BLOCK);
+			blockSum[0] = 0.0;
+			blockSum[1] = 0.0;
+			blockFrames = 0;
 		}
-		// player IS playing... get mix - output - advance frame - check for end of channel
+	}
+	frames += nFrames;
+}
+
+// n samples of channel c (every other float from in)
+// works on copies in locals - so they can stay in registers
+void LoudnessMeter::processChannel(const float* in, int n, int c)
+{
+	double s0 = state[c][0];
+	double s1 = state[c][1];
+	double s2 = state[c][2];
+	double s3 = state[c][3];
+	double squares = 0.0;
+	double weighted = 0.0;
+	double top = peak;
+	double topBetween = truePeak;
+	float* h = history[c];
+	int pos = historyPos;
+	int quiet = sinceLoud[c];
+	
+	for(int i=0; i<n; i++)
+	{
+		float x = in[i * 2];
+		
+		double level = fabs(x);
+		if(level > top)
+			top = level;
+		squares += x * x;
+		
+		// K-weighting - two biquads
+		// (with a tiny signal at half the sample rate on top, so silence never decays into denormals)
+		double xk = x + ((i & 1) ? -1e-20 : 1e-20);
+		double y1 = shelfB[0] * xk + s0;
+		s0 = shelfB[1] * xk - shelfA[1] * y1 + s1;
+		s1 = shelfB[2] * xk - shelfA[2] * y1;
+		double y2 = passB[0] * y1 + s2;
+		s2 = passB[1] * y1 - passA[1] * y2 + s3;
+		s3 = passB[2] * y1 - passA[2] * y2;
+		weighted += y2 * y2;
+		
+		// true peak - the points in between this sample and the ones before
+		// (only worked out while there's a sample close by loud enough to take it higher)
+		h[pos] = x;
+		h[pos + TAPS] = x;
+		if(level * phaseGain > topBetween)
+			quiet = 0;
 		else
+			quiet++;
+		if(quiet < TAPS)
 		{
-			// get mix of all 9 channels (plus drums) at current position
-			soundAmplitudeLeft = getMix(0); // get mix for LEFT channel
-			soundAmplitudeRight = getMix(1); // get mix for RIGHT channel
-
-			// if reached end of note, go to next index (for regular channels ch0 - 2)
-			for(int i=0; i<9; i++)
+			// all three points at once - three sums going side by side
+			const float* window = &h[pos + 1];
+			double v0 = 0.0, v1 = 0.0, v2 = 0.0;
+			for(int t=0; t<TAPS; t++)
 			{
-				if(!channelDone[i])
-				{
-					
-					// if there are event requests, digest those first
-					bool eventsDone = false;
-					
-					while(!eventsDone)
-					{
-						// if next event in vector is set to happen at this frame pos, process
-						if( (data[i].eventFrame[eventIndex[i]] <= framePos) && (eventIndex[i] < data[i].nEvents) )
-						{
-							processEvent(i, data[i].eventType[eventIndex[i]], 
-											data[i].eventParam[eventIndex[i]]);
-							eventIndex[i]++;
-						}
-						else
-							eventsDone = true;
-					}					
-					
-					remainingFrames[i]--;
-					if(remainingFrames[i] <= 0)
-					{
-						noteIndex[i]++;
+				v0 += phase[0][t] * window[t];
+				v1 += phase[1][t] * window[t];
+				v2 += phase[2][t] * window[t];
+			}
+			double between = max(fabs(v0), max(fabs(v1), fabs(v2)));
+			if(between > topBetween)
+				topBetween = between;
+		}
+		pos++;
+		if(pos == TAPS)
+			pos = 0;
+	}
+	
+	state[c][0] = s0;
+	state[c][1] = s1;
+	state[c][2] = s2;
+	state[c][3] = s3;
+	sumSquares[c] += squares;
+	blockSum[c] += weighted;
+	peak = top;
+	truePeak = topBetween;
+	sinceLoud[c] = quiet;
+}
+
+// the numbers so far (clipCount is left to the player)
+RenderStats LoudnessMeter::getStats()
+{
+	RenderStats stats;
+	stats.frames = frames;
+	stats.samplePeak = peak > 0.0 ? 20.0 * log10(peak) : -HUGE_VAL;
+	stats.truePeak = max(peak, truePeak) > 0.0 ? 20.0 * log10(max(peak, truePeak)) : -HUGE_VAL;
+	for(int c=0; c<2; c++)
+		stats.rms[c] = sumSquares[c] > 0.0 ? 10.0 * log10(sumSquares[c] / frames) : -HUGE_VAL;
+	for(int i=0; i<RenderStats::N_CHANNELS; i++)
+		stats.channelRMS[i] = -HUGE_VAL; // (the meter only sees the mix - MPlayer fills these in)
+	stats.clipCount = 0;
+	
+	// 400 msec blocks - 4 sub-blocks each, one starting every sub-block
+	std::vector<double> blocks;
+	for(size_t i=3; i<subBlocks.size(); i++)
+		blocks.push_back((subBlocks[i - 3] + subBlocks[i - 2] + subBlocks[i - 1] + subBlocks[i]) / 4.0);
+	
+	// absolute gate (-70 LUFS), then relative gate (10 LU under what's left)
+	double absoluteGate = pow(10.0, (-70.0 + 0.691) / 10.0);
+	double sum = 0.0;
+	int n = 0;
+	for(size_t i=0; i<blocks.size(); i++)
+	{
+		if(blocks[i] > absoluteGate)
+		{
+			sum += blocks[i];
+			n++;
+		}
+	}
+	stats.integratedLoudness = -HUGE_VAL;
+	if(n == 0)
+		return stats;
+	
+	double relativeGate = sum / n * 0.1;
+	sum = 0.0;
+	n = 0;
+	for(size_t i=0; i<blocks.size(); i++)
+	{
+		if(blocks[i] > absoluteGate && blocks[i] > relativeGate)
+		{
+			sum += blocks[i];
+			n++;
+		}
+	}
+	if(n > 0)
+		stats.integratedLoudness = -0.691 + 10.0 * log10(sum / n);
+	
+	return stats;
+}
 
-						// and if you get to the end of MML signal (freq = -1.0), set flag
-						if(data[i].freqNote[noteIndex[i]] < 0)
-						{
-							channelDone[i] = true;
-							setToRest(i); // set to rest.. and let delay finish
-							// disableChannel(i); // disable this channel
-						}
-						else
-						{
-							remainingFrames[i] = data[i].len[noteIndex[i]];
-							freqNote[i] = data[i].freqNote[noteIndex[i]];
 
-							// if this is a rest (freq = 65535), set this channel to rest
-							if(freqNote[i]==65535.0)
-								setToRest(i);
-							// otherwise, this is a valid note - so set this note
-							else
-								setNewNote(i, freqNote[i]);
-						}
-					}
-				}
-			}
 
-			// now handle drum channel!
-			if(!dChannelDone)
-			{
-				// if there are event requests, digest those first
-				bool eventsDone = false;
 
-				while(!eventsDone)
-				{
-					// if next event in vector is set to happen at this frame pos, process
-					if( (ddata.eventFrame[dEventIndex] <= framePos) && (dEventIndex < ddata.nEvents) )
-					{
-						// cout << "event found! for drums" << endl;
-						processDrumEvent(ddata.eventType[dEventIndex], ddata.eventParam[dEventIndex]);
-						dEventIndex++;
-					}
-					else
-						eventsDone = true;
-				}
-				
-				dRemainingFrames--;
-				if(dRemainingFrames <= 0)
-				{
-					dNoteIndex++; // move onto the next drum note index
+// ExportPipe.cpp ////////////////////////////////////////
+// ExportPipe class - Implementation /////////////////////
 
-					// and if you get to the end of MML signal (drumNote = -1.0), set flag
-					if(ddata.drumNote[dNoteIndex] < 0 || dNoteIndex >= ddata.getSize())
-					{
-						dChannelDone = true;
-						restDrum(); // rest.. and let delay effect finish off
-						// disableDrumChannel(); // disable this channel
-					}
-					else // not at end yet.. set new drum hit
-					{
-						dRemainingFrames = ddata.len[dNoteIndex];
-						currentDrumNote = ddata.drumNote[dNoteIndex];
-						setNewDrumHit(currentDrumNote);
+#include "BC/ExportPipe.h"
 
-						// if this is a rest (freq = 65535), set flag
-						if(currentDrumNote == 65535)
-						{
-							restDrum();
-						}
-					}
-				}
-			}
+// nChunks buffers of chunkSize floats each - all allocated here, once
+ExportPipe::ExportPipe(int nChunks, int chunkSize)
+{
+	pool.resize(nChunks * chunkSize);
+	empty.reserve(nChunks);
+	for(int i=0; i<nChunks; i++)
+		empty.push_back(&pool[i * chunkSize]);
+	
+	full.resize(nChunks + 1); // every chunk, plus the end of the song behind them
+	fullFrames.resize(nChunks + 1);
+	fullRead = 0;
+	nFull = 0;
+}
 
-			// if all channels have reached end... and loop is enabled, go back to beginning
-			if(	channelDone[0] && channelDone[1] && channelDone[2] &&
-				channelDone[3] && channelDone[4] && channelDone[5] &&
-				channelDone[6] && channelDone[7] && channelDone[8] && dChannelDone)
-			{	
-				// final point check!
-				// ... if there are events to process at this final moment... process them here
-				
-				for(int i=0;i<9;i++)
-				{	
-					bool eventsDone = false;
-					while(!eventsDone)
-					{
-						// if next event in vector is set to happen at this frame pos, process
-						if( (eventIndex[i] < data[i].nEvents) )
-						{
-							processEvent(i, data[i].eventType[eventIndex[i]], data[i].eventParam[eventIndex[i]]);
-							eventIndex[i]++;
-						}
-						else
-							eventsDone = true;
-					}
-				}
-				
-				// process drum events pending at the final point before loop
-				bool eventsDone = false;
-				while(!eventsDone)
-				{
-					// if next event in vector is set to happen at this frame pos, process
-					if( (dEventIndex < ddata.nEvents) )
-					{
-						processDrumEvent(ddata.eventType[dEventIndex], ddata.eventParam[dEventIndex]);
-						dEventIndex++;
-					}
-					else
-						eventsDone = true;
-				}
-				
-				if(loopEnabled)
-				{
-					// cout << "Looping back to beginning...\n";
-					// enable channels again
-					enableChannels(true, true, true, true, true, true, true, true, true, true);
+ExportPipe::~ExportPipe()
+{}
 
-					// enable drum channel
-					enableDrumChannel();
+// render side - wait for a chunk to render into
+float* ExportPipe::getEmpty()
+{
+	std::unique_lock<std::mutex> guard(lock);
+	while(empty.empty())
+		emptyReady.wait(guard);
+	
+	float* chunk = empty.back();
+	empty.pop_back();
+	return chunk;
+}
 
-					// go back to the beginning
-					goToBeginning();
-				}
-				else if(!loopEnabled && repeatsRemaining > 1) // if repeat times is left.. process
-																// when set to 1, it's last time
-				{
-					repeatsRemaining--;
-					// cout << "Back to beginning... repeats remaining = " << repeatsRemaining << endl;
-					
-					// enable channels again
-					enableChannels(true, true, true, true, true, true, true, true, true, true);
+// render side - pass a rendered chunk on to the encoder (nFrames = 0 - the song is over)
+void ExportPipe::putFull(float* chunk, int nFrames)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	int w = (fullRead + nFull) % full.size();
+	full[w] = chunk;
+	fullFrames[w] = nFrames;
+	nFull++;
+	fullReady.notify_one();
+}
 
-					// enable drum channel
-					enableDrumChannel();
+// encoder side - wait for the next rendered chunk
+float* ExportPipe::getFull(int &nFrames)
+{
+	std::unique_lock<std::mutex> guard(lock);
+	while(nFull == 0)
+		fullReady.wait(guard);
+	
+	float* chunk = full[fullRead];
+	nFrames = fullFrames[fullRead];
+	fullRead = (fullRead + 1) % full.size();
+	nFull--;
+	return chunk;
+}
 
-					// go back to the beginning
-					goToBeginning();					
-				}
-			}
+// encoder side - hand a written chunk back for rendering
+void ExportPipe::putEmpty(float* chunk)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	empty.push_back(chunk);
+	emptyReady.notify_one();
+}
 
-			// if song is not finished, update frame position - advance player
-			if(!songFinished)
-			{
-				// update player position
-				framePos++;
-				advance();
 
-				// if you have reached the absolute last frame position of the song
-				// (including last delay effects) - only then end the track officially
-				if(framePos >= songLastFrame)
-				{
-					songFinished = true;
-					playing = false;
-					
-					/*----------
-					
-					// DEBUG
-					cout << "song officially finished!\n";
-					cout << "framePos = " << framePos << endl;
-					cout << "getSongLastFrame() = " << getSongLastFrame() << endl;
-
-					for(int i=0; i<9; i++)
-						cout << "channel " << i << " length = " << data[i].totalFrames << "\n";
-					cout << "d channel length = " << ddata.totalFrames << "\n";
-					
-					----------*/
-				}
-			}
 
 
-		}
+// AheadRing.cpp /////////////////////////////////////////
+// AheadRing class - Implementation //////////////////////
+
+#include "BC/AheadRing.h"
+
+AheadRing::AheadRing(int capacity)
+{
+	frames.resize(capacity);
+	writePos = 0;
+	readPos = 0;
+	dropPos = 0;
+}
+
+AheadRing::~AheadRing()
+{}
+
+// frames rendered and not played yet
+int AheadRing::getQueued()
+{
+	return writePos.load(std::memory_order_acquire) - readPos.load(std::memory_order_acquire);
+}
+
+// render thread - room left
+int AheadRing::getSpace()
+{
+	return frames.size() - getQueued();
+}
+
+// render thread - one more frame (check getSpace() first)
+void AheadRing::put(const AheadFrame &frame)
+{
+	long pos = writePos.load(std::memory_order_relaxed);
+	frames[pos % frames.size()] = frame;
+	writePos.store(pos + 1, std::memory_order_release);
+}
+
+// callback - next frame to play, false if the render thread is behind
+bool AheadRing::get(AheadFrame &frame)
+{
+	long pos = readPos.load(std::memory_order_relaxed);
+	if(pos == writePos.load(std::memory_order_acquire))
+		return false;
+	frame = frames[pos % frames.size()];
+	readPos.store(pos + 1, std::memory_order_release);
+	return true;
+}
+
+// callback - a frame still queued, without taking it
+const AheadFrame& AheadRing::at(long pos)
+	{ return frames[pos % frames.size()]; }
+
+long AheadRing::getReadPos()
+	{ return readPos.load(std::memory_order_relaxed); }
+
+long AheadRing::getWritePos()
+	{ return writePos.load(std::memory_order_relaxed); }
+
+long AheadRing::getDropPos()
+	{ return dropPos.load(std::memory_order_acquire); }
+
+// render thread - frames before pos are out of date
+void AheadRing::dropTo(long pos)
+	{ dropPos.store(pos, std::memory_order_release); }
+
+// callback - skip the out of date frames
+void AheadRing::skipTo(long pos)
+	{ readPos.store(pos, std::memory_order_release); }
+
+
+
+
+// Trace.cpp /////////////////////////////////////////////
+// Trace class - Implementation //////////////////////////
+
+#include <cstdio>
+#include <thread>
+#include <functional>
+#include "BC/Trace.h"
+
+const int Trace::MAX_SPANS;
+std::vector<Trace::Span> Trace::spans;
+std::atomic<int> Trace::nextSpan(0);
+std::atomic<int> Trace::nRecorded(0);
+std::atomic<bool> Trace::running(false);
+std::chrono::steady_clock::time_point Trace::origin;
+std::string Trace::traceFile = "";
+std::mutex Trace::lock;
+
+// begin recording spans - written to filename by stop()
+// false if already tracing, or if the file can't be written
+bool Trace::start(const std::string &filename)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	if(running.load())
+		return false;
+	
+	FILE* out = fopen(filename.c_str(), "w");
+	if(out == NULL)
+		return false;
+	fclose(out);
+	
+	spans.resize(MAX_SPANS);
+	nextSpan.store(0);
+	nRecorded.store(0);
+	origin = std::chrono::steady_clock::now();
+	traceFile = filename;
+	running.store(true, std::memory_order_release);
+	return true;
+}
+
+// stop recording and write the trace out
+bool Trace::stop()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	if(!running.load())
+		return false;
+	running.store(false);
+	
+	// close the buffer - then wait for spans still being written
+	int claimed = nextSpan.exchange(MAX_SPANS);
+	int nSpans = std::min(claimed, MAX_SPANS);
+	while(nRecorded.load(std::memory_order_acquire) < nSpans)
+		std::this_thread::yield();
+	
+	FILE* out = fopen(traceFile.c_str(), "w");
+	if(out == NULL)
+		return false;
+	
+	// threads numbered 1, 2, 3... in the order they show up
+	std::vector<unsigned int> threads;
+	fprintf(out, "{\"traceEvents\": [\n");
+	fprintf(out, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 0, \"args\": {\"name\": \"BCPlayer\"}}");
+	for(int i=0; i<nSpans; i++)
+	{
+		const Span &span = spans[i];
+		int tid = std::find(threads.begin(), threads.end(), span.thread) - threads.begin() + 1;
+		if(tid > static_cast<int>(threads.size()))
+			threads.push_back(span.thread);
+		fprintf(out, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+			span.name, tid, span.begin / 1000.0, (span.end - span.begin) / 1000.0);
+	}
+	fprintf(out, "\n],\n\"displayTimeUnit\": \"ms\",\n\"otherData\": {\"droppedSpans\": %d}}\n",
+		std::max(0, claimed - MAX_SPANS));
+	return fclose(out) == 0;
+}
+
+bool Trace::isRunning()
+	{ return running.load(std::memory_order_acquire); }
+
+// nsec since start()
+long long Trace::now()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now() - origin).count();
+}
+
+// a finished span - into the next free slot, no locks
+void Trace::record(const char* name, long long begin, long long end)
+{
+	if(!running.load(std::memory_order_acquire))
+		return;
+	int i = nextSpan.fetch_add(1);
+	if(i >= MAX_SPANS)
+		return;
+	
+	Span &span = spans[i];
+	span.name = name;
+	span.begin = begin;
+	span.end = end;
+	span.thread = static_cast<unsigned int>(std::hash<std::thread::id>()(std::this_thread::get_id()));
+	nRecorded.fetch_add(1, std::memory_order_release);
+}
+
+
+
+// MPlayer.cpp ////////////////////////////////////////
+// MPlayer Class - Implementation /////////////////////
+
+// include dependencies
+
+#include <algorithm>
+#include <iostream>
+#include <vector>
+#include <string>
+#include <math.h>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+//#?include <windows.h> // DEBUG
+
+/*----------
+
+#include <lame/lame.h>
+
+----------*/
+
+#include "BC/sndfile.h"
+#include "BC/ExportPipe.h"
+#include "BC/MPlayer.h"
+#include "BC/Trace.h"
+
+const int MPlayer::SAMPLE_RATE = 44100;
+const int MPlayer::FRAMES_PER_BUFFER = 256;
+const double MPlayer::MIN_TEMPO_SCALE = 0.25;
+const double MPlayer::MAX_TEMPO_SCALE = 4.0;
+
+using namespace std;
+
+// real port audio callback function
+// (redirected from 'paCallback')
+
+int MPlayer::playerCallback (
+		const void *inputBuffer, void *outputBuffer,
+		unsigned long framesPerBuffer,
+		const PaStreamCallbackTimeInfo* timeInfo,
+		PaStreamCallbackFlags statusFlags )
+{
+	BC_TRACE_SPAN("MPlayer::playerCallback");
+	float* out = static_cast<float*>(outputBuffer);
+	// static_cast<int>(framesPerBuffer); // since this has no effect..
+	static_cast<void>(timeInfo);
+	static_cast<void>(statusFlags);
+	static_cast<void>(inputBuffer);
+
+	// odd while a callback runs - see waitForCallback()
+	callbackEpoch++;
+	
+	// render-ahead mode - the music is rendered already, just SFX to add
+	AheadRing* ring = ahead.load();
+	if(ring != NULL)
+	{
+		int result = playAhead(ring, out, framesPerBuffer);
+		callbackEpoch++;
+		return result;
+	}
+	if(aheadActive.load(std::memory_order_relaxed)) // just switched back - carry on counting from there
+	{
+		streamPos = streamFrame.load(std::memory_order_relaxed);
+		aheadActive.store(false, std::memory_order_relaxed);
+	}
+
+	float soundAmplitudeLeft;
+	float soundAmplitudeRight;
+	
+	// pick up SFX start requests queued by the game thread since last buffer
+	// (no SFX bound yet - the stream starts before BCPlayer gets to bindSFX())
+	if(sfx != NULL)
+		sfx->collectTriggers();
+	
+	// same for track start / stop / fade requests
+	collectTrackCommands();
+	
+	// ... and for songs parsed in the background
+	collectIncomingSongs();
+	
+	bool songWasFinished = songFinished;
+
+	for(unsigned long ii=0; ii<framesPerBuffer; ii++)
+	{
+		// start scheduled SFX exactly on their target frame
+		if(sfx != NULL && sfx->nPendingTriggers > 0)
+			sfx->fireTriggers(streamPos, framePos, playing);
+		
+		// music - all the tracks mixed
+		renderStreamFrame(soundAmplitudeLeft, soundAmplitudeRight);
 
 		//
 		//	output to port audio buffer - variable 'sampleAmplitude' (float value for one frame)
@@ -5054,8 +7361,401 @@ int MPlayer::playerCallback (
 		out++; // move buffer pointer
 		*out = soundAmplitudeRight; // write RIGHT channel mix to buffer
 		out++; // move buffer pointer
+		
+		streamPos++;
+	}
+	
+	// song frames the song didn't get to won't come now
+	if(songFinished && !songWasFinished && sfx != NULL)
+		sfx->dropSongTriggers();
+	
+	publishTrackPositions();
+	
+	streamFrame.store(streamPos, std::memory_order_relaxed);
+	
+	callbackEpoch++;
+	return paContinue;
+}
+
+// returns once no callback that started before this call is still running
+// - so one that comes after sees whatever was stored before it (returns straight away with the stream stopped)
+void MPlayer::waitForCallback()
+{
+	unsigned int epoch = callbackEpoch.load();
+	if(epoch % 2 == 0)
+		return;
+	while(callbackEpoch.load() == epoch)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+}
+
+// one frame of the stream - every track playing, mixed
+// (the audio callback's work, less picking up requests and SFX triggers - render-ahead mode shares it)
+void MPlayer::renderStreamFrame(float &left, float &right)
+{
+	// swap in background-loaded songs on their target frame
+	// (first - so a track started / stopped right after its load gets the new song)
+	if(nSongSwapsPending > 0)
+		fireSongSwaps();
+	
+	// start / stop / fade tracks on their target frame
+	if(nPendingTrackCommands > 0)
+		fireTrackCommands();
+	
+	if(!playing) // if player is not playing or finished playing, just pass 0
+	{
+		left = 0.0f;
+		right = 0.0f;
+		
+		// place holder for BCPlayer...
+		// in BCPlayer, if music is stopped, you get sound effects only :)
+		if(sfx != NULL)
+		{
+			left = sfx->getOutput(0);
+			right = sfx->getOutput(1);
+		}
+	}
+	// player IS playing... get mix - output - advance frame - check for end of channel
+	else
+		renderFrame(left, right);
+	
+	// any other tracks playing are mixed into this same stream
+	bool tracksMixed = false;
+	for(int t=1; t<N_TRACKS; t++)
+	{
+		MPlayer* p = track[t].load(std::memory_order_acquire);
+		if(p != NULL && p->playing)
+		{
+			float trackLeft, trackRight;
+			p->streamPos = streamPos;
+			p->renderFrame(trackLeft, trackRight);
+			left += trackLeft;
+			right += trackRight;
+			tracksMixed = true;
+		}
+	}
+	
+	// limit the sum of the tracks
+	if(tracksMixed)
+	{
+		left = min(masterOutCap, max(-masterOutCap, left));
+		right = min(masterOutCap, max(-masterOutCap, right));
+	}
+}
+
+// render-ahead mode - for machines where synthesis can't always keep up with the callback
+// a thread of its own renders the music lookaheadMs (100 - 500) ahead, the callback just plays it
+// and mixes in SFX; game thread changes to the music go through aheadLock and flushAhead()
+// (track commands and tempo changes are picked up by the render thread - they land lookaheadMs later)
+bool MPlayer::startRenderAhead(int lookaheadMs)
+{
+	if(ahead.load() != NULL)
+		return false;
+	lookaheadMs = min(500, max(100, lookaheadMs));
+	
+	aheadFrames = SAMPLE_RATE * lookaheadMs / 1000;
+	for(int t=0; t<N_TRACKS; t++)
+	{
+		MPlayer* p = getTrack(t);
+		if(p != NULL)
+		{
+			p->aheadHeardFrame = p->framePos;
+			p->aheadHeardPlaying = p->playing;
+		}
+	}
+	aheadVolume = masterGain;
+	aheadGain = masterGain;
+	aheadEvents.clear();
+	aheadFadeLen = 0;
+	aheadFadePos = 0;
+	aheadActive = false;
+	
+	// room for the lookahead and a couple of blocks rendered on a flush
+	AheadRing* ring = new AheadRing(aheadFrames + FRAMES_PER_BUFFER * 4);
+	
+	// SFX move out to the callback - the render path lets go of them once no callback can still be using it
+	aheadSFX = sfx;
+	ahead.store(ring);
+	waitForCallback();
+	sfx = NULL;
+	musicEventOut = &aheadEvents; // let out by the callback from now on
+	
+	aheadRunning = true;
+	aheadThread = std::thread(&MPlayer::renderAheadLoop, this);
+	return true;
+}
+
+// back to rendering in the callback - carrying on from what was heard last
+void MPlayer::stopRenderAhead()
+{
+	AheadRing* ring = ahead.load();
+	if(ring == NULL)
+		return;
+	
+	aheadRunning = false;
+	aheadThread.join();
+	
+	// back to where the callback has got to
+	if(aheadActive)
+	{
+		if(!songFinished)
+			seek(aheadHeardFrame);
+		for(int t=1; t<N_TRACKS; t++)
+		{
+			MPlayer* p = getTrack(t);
+			if(p != NULL)
+				p->rewindToHeard();
+		}
+	}
+	musicEventOut = &musicEvents;
+	sfx = aheadSFX;
+	ahead.store(NULL);
+	
+	// the callback may still be playing from the ring - let it finish first
+	waitForCallback();
+	delete ring;
+}
+
+bool MPlayer::renderAheadEnabled()
+	{ return ahead.load() != NULL; }
+
+// frames the callback had to play silence for - the render thread fell behind
+long MPlayer::getAheadUnderruns()
+	{ return aheadUnderruns.load(); }
+
+// render-ahead mode - the music just changed (call with aheadLock held)
+// drops what was rendered before the change - the callback fades it out under the new frames
+// keepPosition - the change didn't move the song: first go back to where the listener is
+// (the render thread is up to lookaheadMs further on - the other tracks always go back)
+void MPlayer::flushAhead(bool keepPosition)
+{
+	AheadRing* ring = ahead.load();
+	if(ring == NULL)
+		return;
+	
+	if(aheadActive)
+	{
+		if(keepPosition && !songFinished)
+			seek(aheadHeardFrame);
+		for(int t=1; t<N_TRACKS; t++)
+		{
+			MPlayer* p = getTrack(t);
+			if(p != NULL)
+				p->rewindToHeard();
+		}
+	}
+	
+	// the new frames play from about now
+	streamPos = streamFrame.load();
+	long dropPos = ring->getWritePos();
+	renderAheadBlock(FRAMES_PER_BUFFER * 2); // something to fade into straight away
+	ring->dropTo(dropPos);
+}
+
+// render-ahead mode - track 1 - 3: back to where the listener is
+// (a track started since the last frame heard starts over from now, one stopped stays stopped)
+void MPlayer::rewindToHeard()
+{
+	if(!playing)
+		return;
+	if(!aheadHeardPlaying)
+		goToBeginning();
+	else if(!songFinished)
+		seek(aheadHeardFrame);
+}
+
+// song frame the listener is at - behind the rendered one in render-ahead mode (main player)
+long MPlayer::getHeardFramePos()
+{
+	if(ahead.load() != NULL && aheadActive)
+		return aheadHeardFrame.load(std::memory_order_relaxed);
+	return framePos;
+}
+
+// master volume for the song and every track (0.0 - 1.0) - call with aheadLock held
+// in render-ahead mode the callback brings the frames already rendered round to it
+// (a ramp on top of them - close enough until the ones rendered at the new volume come through)
+void MPlayer::setMusicVolume(float gain)
+{
+	bool wasSilent = (masterGain <= 0.0f);
+	for(int t=0; t<N_TRACKS; t++)
+	{
+		MPlayer* p = getTrack(t);
+		if(p != NULL)
+			p->setMasterGain(gain);
+	}
+	aheadVolume.store(gain, std::memory_order_relaxed);
+	aheadVolumeChanges.fetch_add(1, std::memory_order_release);
+	
+	// nothing to bring up in frames rendered silent - render them again
+	if(wasSilent)
+		flushAhead(true);
+}
+
+// render-ahead mode - the render thread
+void MPlayer::renderAheadLoop()
+{
+	// the callback may still be in the middle of a buffer of its own - wait until it's switched over
+	while(aheadRunning && !aheadActive)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	
+	{
+		std::lock_guard<std::mutex> guard(aheadLock);
+		streamPos = streamFrame.load();
+	}
+	
+	AheadRing* ring = ahead.load();
+	while(aheadRunning)
+	{
+		if(ring->getQueued() >= aheadFrames)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(2));
+			continue;
+		}
+		
+		std::lock_guard<std::mutex> guard(aheadLock);
+		renderAheadBlock(FRAMES_PER_BUFFER);
+	}
+}
+
+// render-ahead mode - the next nFrames into the ring (as much of it as there is room for)
+void MPlayer::renderAheadBlock(int nFrames)
+{
+	BC_TRACE_SPAN("MPlayer::renderAheadBlock");
+	AheadRing* ring = ahead.load();
+	
+	collectTrackCommands();
+	collectIncomingSongs();
+	
+	for(int i=0; i<nFrames && ring->getSpace() > 0; i++)
+	{
+		AheadFrame frame;
+		frame.songFrame = framePos;
+		frame.songPlaying = playing;
+		for(int t=1; t<N_TRACKS; t++)
+		{
+			MPlayer* p = track[t].load(std::memory_order_acquire);
+			frame.trackFrame[t - 1] = (p != NULL) ? p->framePos : 0;
+			frame.trackPlaying[t - 1] = (p != NULL) && p->playing;
+		}
+		frame.gain = masterGain;
+		frame.volumeChange = aheadVolumeChanges.load(std::memory_order_relaxed);
+		
+		int eventsBefore = aheadEvents.writeIndex.load(std::memory_order_relaxed);
+		renderStreamFrame(frame.left, frame.right);
+		frame.events = (aheadEvents.writeIndex.load(std::memory_order_relaxed) - eventsBefore
+			+ MusicEventQueue::QUEUE_SIZE) % MusicEventQueue::QUEUE_SIZE;
+		ring->put(frame);
+		streamPos++;
 	}
+	
+	publishTrackPositions();
+}
 
+// render-ahead mode - the audio callback: play what was rendered, add SFX
+int MPlayer::playAhead(AheadRing* ring, float* out, unsigned long framesPerBuffer)
+{
+	aheadActive.store(true, std::memory_order_relaxed);
+	aheadSFX->collectTriggers();
+	long pos = streamFrame.load(std::memory_order_relaxed);
+	
+	int volumeChanges = aheadVolumeChanges.load(std::memory_order_acquire);
+	float volume = aheadVolume.load(std::memory_order_relaxed);
+	const float gainStep = 1.0f / AHEAD_FADE_FRAMES;
+	MusicEvent e;
+	
+	// flushed? skip the out of date frames - fading the first of them out under the new ones
+	// (their music events are dropped - the new frames bring their own)
+	long readPos = ring->getReadPos();
+	long dropPos = ring->getDropPos();
+	if(dropPos > readPos)
+	{
+		aheadFadeLen = min(static_cast<long>(AHEAD_FADE_FRAMES), dropPos - readPos);
+		for(int i=0; i<aheadFadeLen; i++)
+			aheadFade[i] = ring->at(readPos + i);
+		aheadFadePos = 0;
+		for(long p=readPos; p<dropPos; p++)
+			for(int n=ring->at(p).events; n>0 && aheadEvents.poll(e); n--);
+		ring->skipTo(dropPos);
+	}
+	
+	AheadFrame frame;
+	frame.songFrame = aheadHeardFrame.load(std::memory_order_relaxed);
+	frame.songPlaying = aheadHeardPlaying.load(std::memory_order_relaxed);
+	for(int t=1; t<N_TRACKS; t++)
+	{
+		MPlayer* p = track[t].load(std::memory_order_acquire);
+		if(p != NULL)
+		{
+			frame.trackFrame[t - 1] = p->aheadHeardFrame.load(std::memory_order_relaxed);
+			frame.trackPlaying[t - 1] = p->aheadHeardPlaying.load(std::memory_order_relaxed);
+		}
+	}
+	for(unsigned long ii=0; ii<framesPerBuffer; ii++)
+	{
+		if(ring->get(frame))
+		{
+			// the music events of the frame go out as it's heard
+			for(int n=frame.events; n>0 && aheadEvents.poll(e); n--)
+			{
+				musicEvents.post(e.type, e.param, e.songFrame, pos);
+				if(e.type == MusicEvent::END) // song frames the song didn't get to won't come now
+					aheadSFX->dropSongTriggers();
+			}
+			
+			// frames rendered before a volume change - ramp them to the new volume
+			float targetGain = (frame.volumeChange == volumeChanges) ? frame.gain : volume;
+			aheadGain += max(-gainStep, min(gainStep, targetGain - aheadGain));
+			if(aheadGain != frame.gain && frame.gain > 0.0f)
+			{
+				float scale = aheadGain / frame.gain;
+				frame.left *= scale;
+				frame.right *= scale;
+			}
+		}
+		else // render thread is behind
+		{
+			frame.left = 0.0f;
+			frame.right = 0.0f;
+			frame.songPlaying = false;
+			aheadUnderruns.fetch_add(1, std::memory_order_relaxed);
+		}
+		
+		if(aheadFadePos < aheadFadeLen)
+		{
+			float fade = 1.0f - static_cast<float>(aheadFadePos + 1) / (aheadFadeLen + 1);
+			frame.left += (aheadFade[aheadFadePos].left - frame.left) * fade;
+			frame.right += (aheadFade[aheadFadePos].right - frame.right) * fade;
+			aheadFadePos++;
+		}
+		
+		// start scheduled SFX exactly on their target frame
+		if(aheadSFX->nPendingTriggers > 0)
+			aheadSFX->fireTriggers(pos, frame.songFrame, frame.songPlaying);
+		
+		// SFX on top of the music - limited together
+		float left = frame.left + aheadSFX->getOutput(0);
+		float right = frame.right + aheadSFX->getOutput(1);
+		*out = min(masterOutCap, max(-masterOutCap, left));
+		out++;
+		*out = min(masterOutCap, max(-masterOutCap, right));
+		out++;
+		
+		pos++;
+	}
+	
+	aheadHeardFrame.store(frame.songFrame, std::memory_order_relaxed);
+	aheadHeardPlaying.store(frame.songPlaying, std::memory_order_relaxed);
+	for(int t=1; t<N_TRACKS; t++)
+	{
+		MPlayer* p = track[t].load(std::memory_order_acquire);
+		if(p != NULL)
+		{
+			p->aheadHeardFrame.store(frame.trackFrame[t - 1], std::memory_order_relaxed);
+			p->aheadHeardPlaying.store(frame.trackPlaying[t - 1], std::memory_order_relaxed);
+		}
+	}
+	streamFrame.store(pos, std::memory_order_relaxed);
+	
 	return paContinue;
 }
 
@@ -5087,6 +7787,13 @@ MPlayer::MPlayer()
 
 	tableType = 1; // OSC's default type - square table
 	masterGain = 0.7f;
+	stemFrame = NULL;
+	stemStride = 0;
+	capHits = 0;
+	clipsBefore = 0;
+	channelSquares = NULL;
+	blockFrame = -1;
+	renderStats = RenderStats();
 	masterOutCap = 0.88f;
 
 	compThreshold = 0.5f;
@@ -5096,16 +7803,80 @@ MPlayer::MPlayer()
 	songLastFrame = 0;
 	songLastFramePure = 0;
 	bookmark = 0;
+	streamFrame = 0;
+	streamPos = 0;
+	beatFrames = 0;
+	measureFrames = 0;
+	nextMusicEventFrame = 0;
+	markerIndex = 0;
+	loopStartFrame = 0;
+	loopPointEnabled = true;
+	loopStateReady = false;
+	playing = false;
+	sfx = NULL;
+	track[0] = this;
+	for(int t=1; t<N_TRACKS; t++)
+		track[t] = NULL;
+	trackWriteIndex = 0;
+	trackReadIndex = 0;
+	nPendingTrackCommands = 0;
+	trackGain = 1.0f;
+	trackGainTarget = 1.0f;
+	trackGainStep = 0.0f;
+	trackFadeFramesLeft = 0;
+	stopWhenFaded = false;
+	tempoScale = 1.0;
+	tempoScaleTarget = 1.0;
+	tempoScaleStep = 0.0;
+	tempoRampFramesLeft = 0;
+	songFrameCredit = 0.0;
+	nextBeatFrame = 0;
+	transposeCents = 0;
+	for(int i=0; i<9; i++)
+	{
+		channelTransposeCents[i] = 0;
+		transposeRatio[i] = 1.0;
+	}
+	incomingSong = NULL;
+	outgoingSong = NULL;
+	songGeneration = 0;
+	songSwapBoundary = 0;
+	songSwapKeepPosition = false;
+	songSwapFrame = -1;
+	songSwapSongFrame = -1;
+	songSwapFromFrame = 0;
+	nSongSwapsPending = 0;
+	publishedFramePos = -1;
+	publishedTempoScale = 1.0;
+	publishedBeatFrames = 0;
+	publishedMeasureFrames = 0;
+	ahead = NULL;
+	aheadRunning = false;
+	aheadActive = false;
+	callbackEpoch = 0;
+	aheadFrames = 0;
+	aheadSFX = NULL;
+	aheadHeardFrame = 0;
+	aheadHeardPlaying = false;
+	aheadVolume = 0.0f;
+	aheadVolumeChanges = 0;
+	aheadGain = 0.0f;
+	musicEventOut = &musicEvents;
+	aheadUnderruns = 0;
+	aheadFadeLen = 0;
+	aheadFadePos = 0;
 	for(int i=0; i<9; i++)
-		eventIndex[i] = 0;
-	dEventIndex = 0;
+		streamIndex[i] = 0;
+	dStreamIndex = 0;
 
 	// call this function once to set various parameters settings to default
 	resetForNewSong();
 }
 
 MPlayer::~MPlayer()
-{}
+{
+	stopRenderAhead();
+}
 
 void MPlayer::handlePaError(PaError e)
 {
@@ -5226,6 +7997,38 @@ bool MPlayer::getStreamState()
 // function to set back to default before loading new song (or 'play' current song again)
 // reset all oscillator + delay settings etc. - before parsing source
 void MPlayer::resetForNewSong()
+{
+	resetRuntimeSettings();
+	
+	// clear delay buffer
+	delay[0].clearBuffer(); // left delay
+	delay[1].clearBuffer(); // right delay
+	
+	resetSongSettings();
+}
+
+// the game's changes to the song playing - back to its own tempo, level and key
+void MPlayer::resetRuntimeSettings()
+{
+	// back to the song's own tempo
+	tempoScale = 1.0;
+	tempoScaleTarget = 1.0;
+	tempoRampFramesLeft = 0;
+	songFrameCredit = 0.0;
+	
+	// ... at full level, not faded out from an earlier crossfade
+	resetTrackGain();
+	
+	// ... and its own key
+	transposeCents = 0;
+	for(int i=0; i<9; i++)
+		channelTransposeCents[i] = 0;
+	updateTransposeRatios();
+}
+
+// the part of resetForNewSong() that belongs to the song itself
+// - a live edit swapped in keeps the runtime tempo / key and whatever is left in the delay
+void MPlayer::resetSongSettings()
 {
 	// loop is enabled by default
 	loopEnabled = true;
@@ -5242,10 +8045,6 @@ void MPlayer::resetForNewSong()
 	//for(int i=0; i<9; i++)
 	//	osc[i].initializeForFirstNote();
 
-	// clear delay buffer
-	delay[0].clearBuffer(); // left delay
-	delay[1].clearBuffer(); // right delay
-
 	// reset delay time + gain parameters
 	// ... first delay / delay time (in milliseconds) + gain
 	delayEnabled = true;
@@ -5291,6 +8090,9 @@ void MPlayer::resetForNewSong()
 
 void MPlayer::close()
 {
+	// render thread first - nothing to render for once the stream's gone
+	stopRenderAhead();
+
 	// close port audio stream and terminate
 
 	err = Pa_StopStream( stream );
@@ -5309,6 +8111,7 @@ void MPlayer::close()
 void MPlayer::start()
 {
 	goToBeginning();
+	resetTrackGain(); // a crossfade away from this song left it silent
 
 	// set enabler flag
 	playing = true;
@@ -5329,6 +8132,7 @@ void MPlayer::cleanUpForNewFile()
 	
 void MPlayer::goToBeginning()
 {
+	BC_TRACE_SPAN("MPlayer::goToBeginning");
 	// get the total song frame length
 	songLastFrame = getSongLastFrame();
 	songLastFramePure = getSongLastFramePure();
@@ -5341,38 +8145,29 @@ void MPlayer::goToBeginning()
 		channelDone[i] = false;
 		remainingFrames[i] = 0;
 		freqNote[i] = 0;
-		noteIndex[i] = 0;
-		eventIndex[i] = 0;
+		streamIndex[i] = 0;
 	}
 
 	// for drum channel
 	dChannelDone = false;
 	dRemainingFrames = 0;
 	currentDrumNote = 0;
-	dNoteIndex = 0;
-	dEventIndex = 0;
+	dStreamIndex = 0;
 	
 	// set the starting note for each music channel (ch 1 to 9)
 	for(int i=0; i<9; i++)
 	{
-		// if there are event requests (freq >= 70000), digest those first
-		bool eventsDone = false;
-		
-		while(!eventsDone)
+		// if there are event requests at the very start, digest those first
+		const SeqRecord *r = &data[i].stream[0];
+		while(r->op == SeqRecord::EVENT)
 		{
-			// if next event in vector is set to happen at this frame pos, process
-			if( (data[i].eventFrame[eventIndex[i]] == 0) && (eventIndex[i] < data[i].nEvents) )
-			{
-				processEvent(i, data[i].eventType[eventIndex[i]], 
-								data[i].eventParam[eventIndex[i]]);
-				eventIndex[i]++;
-			}
-			else
-				eventsDone = true;
+			runEvent(i, *r);
+			r++;
 		}
 
-		remainingFrames[i] = data[i].len[noteIndex[i]];
-		freqNote[i] = data[i].freqNote[noteIndex[i]];
+		remainingFrames[i] = r->value;
+		freqNote[i] = r->freq;
+		streamIndex[i] = (r - &data[i].stream[0]) + 1;
 
 		// if very first note is a rest (freq = 65535), silence channel
 		if(freqNote[i]==65535.0)
@@ -5393,23 +8188,17 @@ void MPlayer::goToBeginning()
 	//
 	// set starting note for drum channel
 
-	// if there are event requests (freq >= 70000), digest those first
-	bool eventsDone = false;
-	
-	while(!eventsDone)
+	// if there are event requests at the very start, digest those first
+	const SeqRecord *r = &ddata.stream[0];
+	while(r->op == SeqRecord::EVENT)
 	{
-		// if next event in vector is set to happen at this frame pos, process
-		if( (ddata.eventFrame[dEventIndex] == 0) && (dEventIndex < ddata.nEvents) )
-		{
-			processDrumEvent(ddata.eventType[dEventIndex], ddata.eventParam[dEventIndex]);
-			dEventIndex++;
-		}
-		else
-			eventsDone = true;
+		runDrumEvent(*r);
+		r++;
 	}
 
-	dRemainingFrames = ddata.len[dNoteIndex];
-	currentDrumNote = ddata.drumNote[dNoteIndex];
+	dRemainingFrames = r->value;
+	currentDrumNote = r->drum;
+	dStreamIndex = (r - &ddata.stream[0]) + 1;
 	activateDrumChannel();
 	setNewDrumHit(currentDrumNote);
 
@@ -5423,6 +8212,8 @@ void MPlayer::goToBeginning()
 		dChannelDone = true;
 		disableDrumChannel();
 	}
+	
+	alignMusicEvents();
 }
 
 // calculates the song's frame length - including time for last delay effects
@@ -5465,6 +8256,126 @@ long MPlayer::getSongLastFramePure()
 long MPlayer::getFramePos()
 	{ return framePos; }
 
+// set the beat (quarter note) and measure lengths in frames - used for music event posting
+void MPlayer::setMusicalTiming(long beatLength, long measureLength)
+{
+	beatFrames = beatLength;
+	measureFrames = measureLength;
+}
+
+// register a MARKER=n found in the source at this song frame
+// channel - 0 to 8, or 9 for the drum channel
+void MPlayer::addMarker(long frame, int id, int channel)
+{
+	markerFrame.push_back(frame);
+	markerId.push_back(id);
+	markerChannel.push_back(channel);
+}
+
+void MPlayer::clearMarkers()
+{
+	markerFrame.clear();
+	markerId.clear();
+	markerChannel.clear();
+	markerIndex = 0;
+}
+
+// drop the markers that came from one channel (that channel is about to be parsed again)
+void MPlayer::clearChannelMarkers(int channel)
+{
+	size_t kept = 0;
+	for(size_t i=0; i<markerFrame.size(); i++)
+	{
+		if(markerChannel[i] == channel)
+			continue;
+		markerFrame[kept] = markerFrame[i];
+		markerId[kept] = markerId[i];
+		markerChannel[kept] = markerChannel[i];
+		kept++;
+	}
+	markerFrame.resize(kept);
+	markerId.resize(kept);
+	markerChannel.resize(kept);
+	markerIndex = 0;
+}
+
+// markers come in channel by channel - put them in song order once parsing is done
+// (same frame - lower channel first, so it doesn't matter which channels were parsed last)
+void MPlayer::sortMarkers()
+{
+	// insertion sort - there are only a handful and we need to keep them together
+	for(size_t i=1; i<markerFrame.size(); i++)
+	{
+		long frame = markerFrame[i];
+		int id = markerId[i];
+		int channel = markerChannel[i];
+		size_t j = i;
+		while(j > 0 && (markerFrame[j-1] > frame || (markerFrame[j-1] == frame && markerChannel[j-1] > channel)))
+		{
+			markerFrame[j] = markerFrame[j-1];
+			markerId[j] = markerId[j-1];
+			markerChannel[j] = markerChannel[j-1];
+			j--;
+		}
+		markerFrame[j] = frame;
+		markerId[j] = id;
+		markerChannel[j] = channel;
+	}
+}
+
+// point the next beat and next marker at the current framePos
+// (after going back to the beginning or seeking)
+void MPlayer::alignMusicEvents()
+{
+	if(beatFrames > 0)
+		nextBeatFrame = ( (framePos + beatFrames - 1) / beatFrames ) * beatFrames;
+	else
+		nextBeatFrame = songLastFramePure + 1; // no timing yet - never post beats
+	nextMusicEventFrame = nextBeatFrame;
+	
+	markerIndex = lower_bound(markerFrame.begin(), markerFrame.end(), framePos) - markerFrame.begin();
+	
+	// markers may come sooner than the next beat
+	if(markerIndex < static_cast<int>(markerFrame.size()) && markerFrame[markerIndex] < nextMusicEventFrame)
+		nextMusicEventFrame = markerFrame[markerIndex];
+}
+
+// called from audio callback when framePos reaches nextMusicEventFrame
+// posts beat / measure / marker events due at this frame, then finds the next one
+// (framePos may have stepped over the exact frame when tempo is scaled up)
+void MPlayer::postMusicEvents()
+{
+	if(beatFrames > 0 && framePos >= nextBeatFrame && nextBeatFrame < songLastFramePure)
+	{
+		long beatNumber = nextBeatFrame / beatFrames;
+		long beatsPerMeasure = max(1L, measureFrames / beatFrames);
+		if(beatNumber % beatsPerMeasure == 0)
+			musicEventOut->post(MusicEvent::MEASURE, beatNumber / beatsPerMeasure, framePos, streamPos);
+		musicEventOut->post(MusicEvent::BEAT, beatNumber % beatsPerMeasure, framePos, streamPos);
+	}
+	
+	int nMarkers = markerFrame.size();
+	while(markerIndex < nMarkers && markerFrame[markerIndex] <= framePos)
+	{
+		musicEventOut->post(MusicEvent::MARKER, markerId[markerIndex], framePos, streamPos);
+		markerIndex++;
+	}
+	
+	// whichever comes first - next beat or next marker
+	if(beatFrames > 0)
+		nextBeatFrame = (framePos / beatFrames + 1) * beatFrames;
+	else
+		nextBeatFrame = songLastFramePure + 1;
+	nextMusicEventFrame = nextBeatFrame;
+	if(markerIndex < nMarkers && markerFrame[markerIndex] < nextMusicEventFrame)
+		nextMusicEventFrame = markerFrame[markerIndex];
+}
+
+// returns how many frames the audio callback has output since the stream opened
+// (keeps counting while the song is paused - use as the clock for SFX scheduling)
+long MPlayer::getStreamFrame()
+	{ return streamFrame.load(std::memory_order_relaxed); }
+
 // checks if player is currently playing
 bool MPlayer::isPlaying()
 	{ return playing; }
@@ -5512,7 +8423,49 @@ void MPlayer::disableRingMod(int channel)
 
 void MPlayer::setNewNote(int channel, double freq)
 {
-	osc[channel].setNewNote(freq);
+	osc[channel].setNewNote(freq * transposeRatio[channel]);
+}
+
+// transpose the whole song - takes effect right away, even on notes already sounding
+// (audio thread, or a player not playing - the game sends a TrackCommand::TRANSPOSE)
+void MPlayer::setTranspose(int semitones, int cents)
+{
+	transposeCents = semitones * 100 + cents;
+	updateTransposeRatios();
+}
+
+// transpose one channel (0 - 8) on top of the whole-song transpose
+void MPlayer::setChannelTranspose(int channel, int semitones, int cents)
+{
+	if(channel < 0 || channel > 8)
+		return;
+	channelTransposeCents[channel] = semitones * 100 + cents;
+	updateTransposeRatios();
+}
+
+// work out each channel's frequency ratio and retune what's sounding
+void MPlayer::updateTransposeRatios()
+{
+	for(int i=0; i<9; i++)
+	{
+		int total = transposeCents + channelTransposeCents[i];
+		total = min(4800, max(-4800, total)); // 4 octaves either way
+		double ratio = (total == 0) ? 1.0 : pow(2.0, total / 1200.0);
+		if(transposeRatio[i] != ratio)
+		{
+			transposeRatio[i] = ratio;
+			retuneChannel(i);
+		}
+	}
+}
+
+// bring a note already sounding to the current transpose - phase and envelope carry on
+void MPlayer::retuneChannel(int channel)
+{
+	if(channelDone[channel] || freqNote[channel] <= 0.0 || freqNote[channel] == 65535.0)
+		return;
+	osc[channel].freq = freqNote[channel] * transposeRatio[channel];
+	osc[channel].setIncrement(osc[channel].freq);
 }
 
 void MPlayer::setToRest(int channel)
@@ -5551,48 +8504,411 @@ void MPlayer::setDChannelGain(float gain)
 float MPlayer::getDChannelGain()
 	{ return nosc.getGain(); }
 
-void MPlayer::enableChannels(bool enable1, bool enable2, bool enable3, bool enable4,
-	bool enable5, bool enable6, bool enable7, bool enable8, bool enable9, bool enableD)
+void MPlayer::enableChannels(bool enable1, bool enable2, bool enable3, bool enable4,
+	bool enable5, bool enable6, bool enable7, bool enable8, bool enable9, bool enableD)
+{
+	enabled[0] = enable1; enabled[1] = enable2; enabled[2] = enable3;
+	enabled[3] = enable4; enabled[4] = enable5; enabled[5] = enable6;
+	enabled[6] = enable7; enabled[7] = enable8; enabled[8] = enable9;
+	dEnabled = enableD;
+}
+
+void MPlayer::enableChannel(int channel)
+	{ enabled[channel] = true; }
+
+void MPlayer::disableChannel(int channel)
+	{ enabled[channel] = false; }
+
+void MPlayer::enableDrumChannel()
+	{ dEnabled = true; }
+
+void MPlayer::disableDrumChannel()
+	{ dEnabled = false; }
+
+void MPlayer::silenceChannel(int channel)
+	{ silenced[channel] = true; }
+
+void MPlayer::silenceDrumChannel()
+	{ dSilenced = true; }
+
+void MPlayer::activateChannel(int channel)
+	{ silenced[channel] = false; }
+
+void MPlayer::activateDrumChannel()
+	{ dSilenced = false; }
+
+void MPlayer::enableLooping()
+	{ loopEnabled = true; }
+
+void MPlayer::disableLooping()
+	{ loopEnabled = false; }
+	
+void MPlayer::setRepeatsRemaining(int value)
+	{ repeatsRemaining = value; }
+	
+// render one frame of this player's song (while playing) and move the song along
+// - the audio callback calls this for the main song and for every other track playing
+void MPlayer::renderFrame(float &left, float &right)
+{
+	// let the game know about beats / measures / markers landing on this frame
+	if(framePos >= nextMusicEventFrame)
+		postMusicEvents();
+	
+	// get mix of all 9 channels (plus drums) at current position
+	left = getMix(0, trackGain); // get mix for LEFT channel
+	right = getMix(1, trackGain); // get mix for RIGHT channel
+
+	// crossfades, tempo changes etc. move along one frame
+	if(trackFadeFramesLeft > 0)
+		updateTrackGain();
+	if(tempoRampFramesLeft > 0)
+		updateTempoScale();
+	
+	// the song moves on tempoScale frames for every frame we output (none, one or a few)
+	// - the oscillators always move on one, so pitch and envelopes are left alone
+	bool synthRunning = !songFinished;
+	songFrameCredit += tempoScale;
+	while(songFrameCredit >= 1.0 && !songFinished)
+	{
+		songFrameCredit -= 1.0;
+		advanceSongFrame();
+	}
+	if(synthRunning)
+		advance();
+}
+
+// one frame of song time - events, next notes, looping, end of song
+void MPlayer::advanceSongFrame()
+{
+	// move every channel along - events, next notes
+	sequenceFrame();
+
+	// if all channels have reached end... and loop is enabled, go back to beginning
+	if(	channelDone[0] && channelDone[1] && channelDone[2] &&
+		channelDone[3] && channelDone[4] && channelDone[5] &&
+		channelDone[6] && channelDone[7] && channelDone[8] && dChannelDone)
+	{	
+		// final point check!
+		// ... if there are events to process at this final moment... process them here
+		
+		playOutEvents();
+		
+		if(loopEnabled)
+		{
+			// cout << "Looping back to beginning...\n";
+			// go back to the loop start (or the very beginning)
+			loopBack();
+			musicEventOut->post(MusicEvent::LOOP, 0, framePos, streamPos);
+		}
+		else if(!loopEnabled && repeatsRemaining > 1) // if repeat times is left.. process
+														// when set to 1, it's last time
+		{
+			repeatsRemaining--;
+			// cout << "Back to beginning... repeats remaining = " << repeatsRemaining << endl;
+			
+			// go back to the loop start (or the very beginning)
+			loopBack();
+			musicEventOut->post(MusicEvent::LOOP, repeatsRemaining, framePos, streamPos);
+		}
+	}
+
+	// if song is not finished, update frame position - advance player
+	if(!songFinished)
+	{
+		// update player position
+		framePos++;
+
+		// if you have reached the absolute last frame position of the song
+		// (including last delay effects) - only then end the track officially
+		if(framePos >= songLastFrame)
+		{
+			songFinished = true;
+			playing = false;
+			musicEventOut->post(MusicEvent::END, 0, framePos, streamPos);
+			
+			/*----------
+			
+			// DEBUG
+			cout << "song officially finished!\n";
+			cout << "framePos = " << framePos << endl;
+			cout << "getSongLastFrame() = " << getSongLastFrame() << endl;
+
+			for(int i=0; i<9; i++)
+				cout << "channel " << i << " length = " << data[i].totalFrames << "\n";
+			cout << "d channel length = " << ddata.totalFrames << "\n";
+			
+			----------*/
+		}
+	}
+}
+
+// step the sequencer by one frame - digest due events, move on to next notes
+// (shared by audio callback, export and loop start preparation)
+void MPlayer::sequenceFrame()
+{
+	// if reached end of note, go to next record (for regular channels ch0 - 8)
+	for(int i=0; i<9; i++)
+	{
+		if(!channelDone[i])
+		{
+			const SeqRecord *r = &data[i].stream[streamIndex[i]];
+			
+			// if there are event requests due at this frame pos, digest those first
+			while(r->op == SeqRecord::EVENT && r->frame <= framePos)
+			{
+				runEvent(i, *r);
+				r++;
+			}
+			
+			remainingFrames[i]--;
+			if(remainingFrames[i] <= 0)
+			{
+				// and if you get to the end of MML signal, set flag
+				if(r->op == SeqRecord::END)
+				{
+					channelDone[i] = true;
+					setToRest(i); // set to rest.. and let delay finish
+				}
+				else
+				{
+					remainingFrames[i] = r->value;
+					freqNote[i] = r->freq;
+
+					// if this is a rest, set this channel to rest
+					if(r->op == SeqRecord::REST)
+						setToRest(i);
+					// otherwise, this is a valid note - so set this note
+					else
+						setNewNote(i, freqNote[i]);
+				}
+				r++;
+			}
+			streamIndex[i] = r - &data[i].stream[0];
+		}
+	}
+
+	// now handle drum channel!
+	if(!dChannelDone)
+	{
+		const SeqRecord *r = &ddata.stream[dStreamIndex];
+		
+		// if there are event requests due at this frame pos, digest those first
+		while(r->op == SeqRecord::EVENT && r->frame <= framePos)
+		{
+			runDrumEvent(*r);
+			r++;
+		}
+		
+		dRemainingFrames--;
+		if(dRemainingFrames <= 0)
+		{
+			// and if you get to the end of MML signal, set flag
+			if(r->op == SeqRecord::END)
+			{
+				dChannelDone = true;
+				restDrum(); // rest.. and let delay effect finish off
+			}
+			else // not at end yet.. set new drum hit
+			{
+				dRemainingFrames = r->value;
+				currentDrumNote = r->drum;
+				setNewDrumHit(currentDrumNote);
+
+				// if this is a rest (note = 65535), rest drum channel
+				if(currentDrumNote == 65535)
+				{
+					restDrum();
+				}
+			}
+			r++;
+		}
+		dStreamIndex = r - &ddata.stream[0];
+	}
+}
+
+// all channels are done - process whatever events are left at this final point
+void MPlayer::playOutEvents()
 {
-	enabled[0] = enable1; enabled[1] = enable2; enabled[2] = enable3;
-	enabled[3] = enable4; enabled[4] = enable5; enabled[5] = enable6;
-	enabled[6] = enable7; enabled[7] = enable8; enabled[8] = enable9;
-	dEnabled = enableD;
+	for(int i=0; i<9; i++)
+	{
+		vector<SeqRecord> &stream = data[i].stream;
+		for(int n=stream.size(); streamIndex[i]<n; streamIndex[i]++)
+		{
+			if(stream[streamIndex[i]].op == SeqRecord::EVENT)
+				runEvent(i, stream[streamIndex[i]]);
+		}
+	}
+	
+	// drum events pending at the final point before loop
+	vector<SeqRecord> &dStream = ddata.stream;
+	for(int n=dStream.size(); dStreamIndex<n; dStreamIndex++)
+	{
+		if(dStream[dStreamIndex].op == SeqRecord::EVENT)
+			runDrumEvent(dStream[dStreamIndex]);
+	}
 }
 
-void MPlayer::enableChannel(int channel)
-	{ enabled[channel] = true; }
+// set the loop start (LOOPSTART in the source) - 0 means loop from the top
+void MPlayer::setLoopStart(long frame)
+{
+	loopStartFrame = frame;
+	loopStateReady = false;
+}
 
-void MPlayer::disableChannel(int channel)
-	{ enabled[channel] = false; }
+long MPlayer::getLoopStart()
+	{ return loopStartFrame; }
 
-void MPlayer::enableDrumChannel()
-	{ dEnabled = true; }
+// when disabled, songs with a LOOPSTART loop from the very top like any other song
+void MPlayer::enableLoopPoint()
+	{ loopPointEnabled = true; }
 
-void MPlayer::disableDrumChannel()
-	{ dEnabled = false; }
+void MPlayer::disableLoopPoint()
+	{ loopPointEnabled = false; }
 
-void MPlayer::silenceChannel(int channel)
-	{ silenced[channel] = true; }
+// copy out everything the sequencer needs to resume from the current frame
+void MPlayer::saveState(PlayerState &s)
+{
+	for(int i=0; i<9; i++)
+	{
+		s.osc[i] = osc[i];
+		s.enabled[i] = enabled[i];
+		s.ringModEnabled[i] = ringModEnabled[i];
+		s.ringModFeed[i] = ringModFeed[i];
+		s.ringModMute[i] = ringModMute[i];
+		s.channelDone[i] = channelDone[i];
+		s.remainingFrames[i] = remainingFrames[i];
+		s.freqNote[i] = freqNote[i];
+		s.streamIndex[i] = streamIndex[i];
+	}
+	s.nosc = nosc;
+	s.framePos = framePos;
+	s.dEnabled = dEnabled;
+	s.dChannelDone = dChannelDone;
+	s.dRemainingFrames = dRemainingFrames;
+	s.dStreamIndex = dStreamIndex;
+	s.currentDrumNote = currentDrumNote;
+}
+
+// put back a state saved with saveState()
+// (delay lines, mute flags and master gain are left as they are)
+void MPlayer::loadState(const PlayerState &s)
+{
+	for(int i=0; i<9; i++)
+	{
+		osc[i] = s.osc[i];
+		enabled[i] = s.enabled[i];
+		ringModEnabled[i] = s.ringModEnabled[i];
+		ringModFeed[i] = s.ringModFeed[i];
+		ringModMute[i] = s.ringModMute[i];
+		channelDone[i] = s.channelDone[i];
+		remainingFrames[i] = s.remainingFrames[i];
+		freqNote[i] = s.freqNote[i];
+		streamIndex[i] = s.streamIndex[i];
+	}
+	nosc = s.nosc;
+	framePos = s.framePos;
+	dEnabled = s.dEnabled;
+	dChannelDone = s.dChannelDone;
+	dRemainingFrames = s.dRemainingFrames;
+	dStreamIndex = s.dStreamIndex;
+	currentDrumNote = s.currentDrumNote;
+}
+
+// run the sequencer (no mixing) from the top up to the loop start and keep that state
+// so looping back is a plain state copy - call right after parsing, before goToBeginning()
+void MPlayer::prepareLoopState()
+{
+	loopStateReady = false;
+	if(loopStartFrame <= 0 || loopStartFrame >= getSongLastFramePure())
+		return;
+	
+	// keep the freshly parsed state - we're going to play through the intro
+	PlayerState* parsedState = new PlayerState;
+	saveState(*parsedState);
+	
+	// the snapshot is taken untransposed - loopBack() retunes it to whatever is current
+	double ratio[9];
+	for(int i=0; i<9; i++)
+	{
+		ratio[i] = transposeRatio[i];
+		transposeRatio[i] = 1.0;
+	}
+	
+	goToBeginning();
+	
+	// stop one frame short, just as the callback does when it loops:
+	// sequence the frame, then framePos++ and advance() bring us to the loop start
+	while(framePos < loopStartFrame - 1)
+	{
+		sequenceFrame();
+		framePos++;
+		advance();
+	}
+	sequenceFrame();
+	saveState(loopState);
+	loopStateReady = true;
+	
+	for(int i=0; i<9; i++)
+		transposeRatio[i] = ratio[i];
+	loadState(*parsedState);
+	delete parsedState;
+}
 
-void MPlayer::silenceDrumChannel()
-	{ dSilenced = true; }
+// build every drum hit the song can play - the default tones and each tone change (tuning, length, noise) its drum channel
+// asks for - here, off the audio thread, so hits and tone changes in the callback only look them up
+// (a tone that isn't here - set some other way - is worked out live)
+void MPlayer::prepareDrumHits()
+{
+	NOSC::HitBank* bank = new NOSC::HitBank;
+	NOSC tone; // default tones, as resetDrumTones() leaves them
+	tone.fillHitBank(*bank);
+	
+	for(size_t i=0; i<ddata.stream.size(); i++)
+	{
+		const SeqRecord &r = ddata.stream[i];
+		if(r.op == SeqRecord::EVENT && tuneDrum(tone, r))
+			tone.fillHitBank(*bank);
+	}
+	
+	// the old bank goes once nothing here points into it
+	drumHits.reset(bank);
+	nosc.useHitBank(bank);
+}
 
-void MPlayer::activateChannel(int channel)
-	{ silenced[channel] = false; }
+// jump back for another loop or repeat
+void MPlayer::loopBack()
+{
+	if(loopPointEnabled && loopStateReady)
+	{
+		// keep each oscillator's last output so popguard smooths over the splice
+		float lastAmp[9];
+		for(int i=0; i<9; i++)
+			lastAmp[i] = osc[i].lastAmp;
+		
+		loadState(loopState);
+		
+		for(int i=0; i<9; i++)
+		{
+			osc[i].lastAmp = lastAmp[i];
+			if(transposeRatio[i] != 1.0)
+				retuneChannel(i);
+		}
+		
+		alignMusicEvents();
+	}
+	else
+	{
+		// enable channels again
+		enableChannels(true, true, true, true, true, true, true, true, true, true);
 
-void MPlayer::activateDrumChannel()
-	{ dSilenced = false; }
+		// enable drum channel
+		enableDrumChannel();
 
-void MPlayer::enableLooping()
-	{ loopEnabled = true; }
+		// go back to the beginning
+		goToBeginning();
+	}
+}
 
-void MPlayer::disableLooping()
-	{ loopEnabled = false; }
-	
-void MPlayer::setRepeatsRemaining(int value)
-	{ repeatsRemaining = value; }
-	
 void MPlayer::advance()
 {
 	// advance each music oscillator
@@ -5603,50 +8919,146 @@ void MPlayer::advance()
 	nosc.advance();
 }
 
+// advance() for the voices outside the block - renderVoiceBlock() has moved the others on already
+void MPlayer::advanceUnblocked()
+{
+	for(int i=0; i<9; i++)
+	{
+		if(!inBlock[i])
+			osc[i].advance();
+	}
+	nosc.advance();
+}
+
+// frames from here up to the next one where the sequencer changes anything - a note, an event,
+// a channel coming to its end - and no more than maxFrames and VOICE_BLOCK
+// (that frame is the block's last, so the change comes before the voices advance from it)
+int MPlayer::voiceBlockLength(long maxFrames)
+{
+	long n = min(maxFrames, static_cast<long>(VOICE_BLOCK));
+	for(int i=0; i<9; i++)
+	{
+		if(!channelDone[i])
+		{
+			const SeqRecord &r = data[i].stream[streamIndex[i]];
+			n = min(n, static_cast<long>(remainingFrames[i]));
+			if(r.op == SeqRecord::EVENT)
+				n = min(n, r.frame - framePos + 1);
+		}
+	}
+	if(!dChannelDone)
+	{
+		const SeqRecord &r = ddata.stream[dStreamIndex];
+		n = min(n, static_cast<long>(dRemainingFrames));
+		if(r.op == SeqRecord::EVENT)
+			n = min(n, r.frame - framePos + 1);
+	}
+	return static_cast<int>(max(1L, n));
+}
+
+// render the plain voices (sounding, no ring modulation either way) for the next nFrames frames
+// - the rest go through getMix() / advance() frame by frame, as they do live
+void MPlayer::renderVoiceBlock(int nFrames)
+{
+	for(int i=0; i<9; i++)
+		inBlock[i] = enabled[i] && silenced[i] == false && !ringModEnabled[i] && !ringModMute[i];
+	for(int i=0; i<9; i++)
+	{
+		// a ring mod feed gets called on again by the voice it feeds
+		if(ringModEnabled[i] && enabled[i] && silenced[i] == false && ringModFeed[i] != -1)
+			inBlock[ringModFeed[i]] = false;
+	}
+	for(int i=0; i<9; i++)
+	{
+		if(inBlock[i])
+			osc[i].renderBlock(voiceBlock[i], nFrames);
+	}
+}
+
 // returns one frame float value of the mix of all channels
 // at current framePos
 //
 // param - LEFT channel = 0, RIGHT channel = 1
-float MPlayer::getMix(int channel)
+//		 - level - this song's level among the tracks playing (1.0 when exporting)
+float MPlayer::getMix(int channel, float level)
 {
 	float mix = 0.0;
 
 	// mix all 9 channels
 	for(int i=0; i<9; i++)
 	{
-		if(enabled[i] && silenced[i] == false && !ringModEnabled[i] && !ringModMute[i])
-			mix += compress(osc[i].getOutput());
+		float voice;
+		if(blockFrame >= 0 && inBlock[i]) // rendered a block at a time (exports)
+			voice = compress(voiceBlock[i][blockFrame * 2 + channel]);
+		else if(enabled[i] && silenced[i] == false && !ringModEnabled[i] && !ringModMute[i])
+			voice = compress(osc[i].getOutput());
 		else if(ringModEnabled[i] && enabled[i] && silenced[i] == false && ringModFeed[i]!=-1)
-			mix += compress(osc[i].getOutput() * osc[ringModFeed[i]].getOutput());
+			voice = compress(osc[i].getOutput() * osc[ringModFeed[i]].getOutput());
+		else
+			continue;
+		
+		mix += voice;
+		if(stemFrame != NULL || channelSquares != NULL) // exporting stems / measuring - keep each voice's share, too
+			keepShare(i, channel, voice * masterGain * level);
 	}
 
 	// mix drum channel, too
 	if(dEnabled && dSilenced == false)
-		mix += compress(nosc.getOutput());
+	{
+		float voice = compress(nosc.getOutput());
+		mix += voice;
+		if(stemFrame != NULL || channelSquares != NULL)
+			keepShare(9, channel, voice * masterGain * level);
+	}
 
 	// update delay - delay output is returned - so add to mix
 	if(delayEnabled)
-		mix += delay[channel].update(mix);
+	{
+		float echo = delay[channel].update(mix);
+		mix += echo;
+		if(stemFrame != NULL || channelSquares != NULL)
+			keepShare(10, channel, echo * masterGain * level);
+	}
 
 	// apply master gain and compress
 	mix = compress(mix * masterGain);
 	
+	// this song's level among the tracks playing (crossfades etc.)
+	mix *= level;
+	
 	// place holder for BCPlayer...
 	// in BCPlayer, add sound effects on top of music!
-	mix += sfx->getOutput(channel);
+	// (only the player that owns the stream has SFX bound)
+	if(sfx != NULL)
+		mix += sfx->getOutput(channel);
 	
 	// mix += sfx->getOutput(channel); // add the entire SFX mix
 										// for BCPlayer only!	
 
-	// limit
+	// limit (counting - for the render stats)
 	if(mix >= masterOutCap)
+	{
 		mix = masterOutCap;
+		capHits++;
+	}
 	if(mix <= -masterOutCap)
+	{
 		mix = -masterOutCap;
+		capHits++;
+	}
 
 	return mix;
 }
 
+// one voice's share of this frame - into its stem, and / or the render stats
+void MPlayer::keepShare(int voice, int channel, float share)
+{
+	if(stemFrame != NULL)
+		stemFrame[voice * stemStride + channel] = share;
+	if(channelSquares != NULL)
+		channelSquares[voice] += static_cast<double>(share) * share;
+}
+
 // compress master mix signal
 float MPlayer::compress(float input)
 {
@@ -5704,528 +9116,725 @@ void MPlayer::setMasterGain(float g)
 
 
 // process one event at current frame for a specified channel
+// (event type / parameter as written by the MML parser)
 void MPlayer::processEvent(int channel, int eType, int eParam)
 {
-	// cout << "Event: ch=" << channel << " type=" << eType << " param=" << eParam << "\t";
+	SeqRecord r;
+	EventCode::lower(eType, eParam, r);
+	runEvent(channel, r);
+}
 
-	// -1 is end of event series for the channel
-	if(eType==-1)
-	{
-		// cout << "Channel " << channel << ": end of events!\n";
-	}
+// run one lowered event for a specified channel (see EventCode)
+void MPlayer::runEvent(int channel, const SeqRecord &r)
+{
+	OSC &o = osc[channel];
 	
-	// type 0 - specify the volume
-	else if(eType==0)
-	{
-		// convert the passed value(1-10) to float (0.0 to 0.5f)
-		float gainToSet
-			= static_cast<float>(eParam) / 20.0f;
-		setChannelGain(channel, gainToSet);
-		// // cout << "VOLUME=" << eParam << endl;
-	}
-	// type 1 - increment volume
-	else if(eType==1)
-	{
-		float gainToSet = min(0.5f, getChannelGain(channel)+0.05f);
-		setChannelGain(channel, gainToSet);		
-		// cout << "channel " << channel << " VOLUME++ new gain=" << gainToSet << "\n";
-	}
-	// type 2 - decrement volume
-	else if(eType==2)
-	{
-		float gainToSet = max(0.001f, getChannelGain(channel)-0.05f);
-		setChannelGain(channel, gainToSet);
-		// cout << "channel " << channel << " VOLUME-- new gain=" << gainToSet << "\n";
-	}
-	// type 10 - set waveform 
-	else if(eType==10)
-	{
-		osc[channel].setTable(eParam); // set wavetable for this value
-		// cout << "WAVEFORM=" << eParam << endl;
-	}
-	// type 11 - flip waveform vertically (helpful for pulse waves etc.)
-	else if(eType==11)
-	{
-		osc[channel].flipYAxis(); // set flipping status to INVERTED
-		cout << "channel " << channel << " - WAVEFLIP" << endl;
-	}
-	// type 1000 - "DEFAULTTONE"
-	else if(eType==1000)
-	{
-		osc[channel].setTable(1); // square wave
-		osc[channel].setEnvelope(0, 0, 0, 0, 0.65f, 0.65f);
-		// cout << "DEFAULTTONE\n";
-	}
-	// type 1001 - "PRESET=BEEP"
-	else if(eType==1001)
-	{
-		osc[channel].setTable(1); // square wave
-		osc[channel].setEnvelope(0, 0, 0, 0, 0.65f, 0.65f);
-		// cout << "PRESET=BEEP\n";
-	}
-	// type 1002 - "PRESET=POPPY"
-	else if(eType==1002)
-	{
-		osc[channel].setTable(1); // square wave
-		osc[channel].setEnvelope(0, 50, 10, 50, 0.90f, 0.40f);
-		// cout << "PRESET=POPPY\n";
-	}
-	// type 1002 - "PRESET=POPPYVIB"
-	else if(eType==1003)
-	{
-		osc[channel].setTable(1); // square wave
-		osc[channel].setEnvelope(0, 50, 10, 50, 0.90f, 0.40f);
-		osc[channel].enableLFO();
-		osc[channel].setLFOrange(22);
-		osc[channel].setLFOwaitTime(250);
-		osc[channel].setLFOspeed(6.0);
-		// cout << "PRESET=POPPYVIB\n";
-	}
-	// type 1003 - "PRESET=BELL"
-	else if(eType==1004)
-	{
-		osc[channel].setTable(1); // square wave
-		osc[channel].setEnvelope(0, 0, 800, 0, 0.80f, 0.0f);
-		// cout << "PRESET=BELL\n";
-	}
-	// type 20 - "ATTACKTIME="
-	else if(eType==20)
-	{
-		osc[channel].setAttackTime(eParam); // set attack time to this value
-		// cout << "ATTACKTIME=" << eParam << endl;
-	}
-	// type 21 - "PEAKTIME="
-	else if(eType==21)
-	{
-		osc[channel].setPeakTime(eParam); // set peak time to this value
-		// cout << "PEAKTIME=" << eParam << endl;
-	}
-	// type 22 - "DECAYTIME="
-	else if(eType==22)
-	{
-		osc[channel].setDecayTime(eParam); // set decay time to this value
-		// cout << "DECAYTIME=" << eParam << endl;
-	}
-	// type 23 - "RELEASETIME="
-	else if(eType==23)
-	{
-		osc[channel].setReleaseTime(eParam); // set release time to this value
-		// cout << "RELEASETIME=" << eParam << endl;
-	}
-	// type 24 - "PEAKLEVEL="
-	else if(eType==24)
+	switch(r.event)
 	{
-		float valuef = static_cast<float>(eParam) / 100.0f;
-		osc[channel].setPeakLevel(valuef); // set peak level to this value
-		// cout << "PEAKLEVEL=" << eParam << endl; 
-	}
-	// type 25 - "SUSTAINLEVEL="
-	else if(eType==25)
-	{
-		float valuef = static_cast<float>(eParam) / 100.0f;
-		osc[channel].setSustainLevel(valuef); // set sustain level to this value
-		// cout << "SUSTAINLEVEL=" << eParam << endl;
-	}
-	// type 30 - "LFO=ON/OFF"
-	else if(eType==30)
-	{
-		if(eParam==1)
-		{
-			osc[channel].enableLFO();
-			// cout << "LFO=ON\n";
-		}
-		else if(eParam==0)
-		{
-			osc[channel].disableLFO();
-			// cout << "LFO=ON\n";
-		}
-	}
-	// type 31 - "LFORANGE="
-	else if(eType==31)
-	{
-		osc[channel].setLFOrange(eParam); // set LFO range to this value
-		// cout << "LFORANGE=" << eParam << endl;
-	}
-	// type 32 - "LFOSPEED="
-	else if(eType==32)
-	{
-		double valued = static_cast<double>(eParam);
-		osc[channel].setLFOspeed(valued); // set LFO speed to this value
-		// cout << "LFOSPEED=" << eParam << endl;
-	}
-	// type 33 - "LFOWAIT="
-	else if(eType==33)
-	{
-		osc[channel].setLFOwaitTime(eParam); // set LFO wait time to this value
-		// cout << "LFOWAIT=" << eParam << endl;
-	}
-	// type 40 - "ASTRO="
-	else if(eType==40)
-	{
-		if(eParam==0)
-		{
+		case EventCode::NOP:
+			break;
+		
+		// "V=" - gain already converted from the 1-10 scale (0.0 to 0.5f)
+		case EventCode::VOLUME:
+			setChannelGain(channel, r.level);
+			break;
+		case EventCode::VOLUME_UP:
+			setChannelGain(channel, min(0.5f, getChannelGain(channel)+0.05f));
+			break;
+		case EventCode::VOLUME_DOWN:
+			setChannelGain(channel, max(0.001f, getChannelGain(channel)-0.05f));
+			break;
+		
+		case EventCode::WAVEFORM:
+			o.setTable(r.value);
+			break;
+		// flip waveform vertically (helpful for pulse waves etc.)
+		case EventCode::WAVEFLIP:
+			o.flipYAxis(); // set flipping status to INVERTED
+			// DEBUG
+			// cout << "channel " << channel << " - WAVEFLIP" << endl;
+			break;
+		
+		// "DEFAULTTONE", "PRESET=BEEP"
+		case EventCode::PRESET_BEEP:
+			o.setTable(1); // square wave
+			o.setEnvelope(0, 0, 0, 0, 0.65f, 0.65f);
+			break;
+		case EventCode::PRESET_POPPY:
+			o.setTable(1); // square wave
+			o.setEnvelope(0, 50, 10, 50, 0.90f, 0.40f);
+			break;
+		case EventCode::PRESET_POPPYVIB:
+			o.setTable(1); // square wave
+			o.setEnvelope(0, 50, 10, 50, 0.90f, 0.40f);
+			o.enableLFO();
+			o.setLFOrange(22);
+			o.setLFOwaitTime(250);
+			o.setLFOspeed(6.0);
+			break;
+		case EventCode::PRESET_BELL:
+			o.setTable(1); // square wave
+			o.setEnvelope(0, 0, 800, 0, 0.80f, 0.0f);
+			break;
+		
+		// envelope - times already in frames, levels already 0.0 - 1.0
+		case EventCode::ATTACKTIME:
+			o.setAttackFrames(r.value);
+			break;
+		case EventCode::PEAKTIME:
+			o.setPeakFrames(r.value);
+			break;
+		case EventCode::DECAYTIME:
+			o.setDecayFrames(r.value);
+			break;
+		case EventCode::RELEASETIME:
+			o.setReleaseFrames(r.value);
+			break;
+		case EventCode::PEAKLEVEL:
+			o.setPeakLevel(r.level);
+			break;
+		case EventCode::SUSTAINLEVEL:
+			o.setSustainLevel(r.level);
+			break;
+		
+		case EventCode::LFO_ON:
+			o.enableLFO();
+			break;
+		case EventCode::LFO_OFF:
+			o.disableLFO();
+			break;
+		case EventCode::LFORANGE:
+			o.setLFOrange(r.value);
+			break;
+		case EventCode::LFOSPEED:
+			o.setLFOspeed(static_cast<double>(r.value));
+			break;
+		case EventCode::LFOWAIT:
+			o.setLFOwaitTime(r.value);
+			break;
+		
+		case EventCode::ASTRO:
+			setAstro(channel, r.value);
+			break;
+		case EventCode::ASTRO_OFF:
 			disableAstro(channel);
-		}
-		else
-			setAstro(channel, eParam); // set astro to this value
-		// cout << "ASTRO=" << eParam << endl;
-	}
-	// type 41 - "ASTRO=OFF"
-	else if(eType==41)
-	{
-		disableAstro(channel);
-		// cout << "ASTRO=OFF" << endl;
-	}
-	// type 50 - "FALL"
-	else if(eType==50)
-	{
-		osc[channel].startFall();
-		// cout << "FALL!" << endl;
-	}
-	// type 51 - "FALLSPEED="
-	else if(eType==51)
-	{
-		double valued = static_cast<double>(eParam);
-		osc[channel].setFallSpeed(valued); // set LFO speed to this value
-		// cout << "FALLSPEED=" << eParam << endl;
-	}
-	// type 52 - "FALLWAIT="
-	else if(eType==52)
-	{
-		double valued = static_cast<double>(eParam);
-		osc[channel].setFallWait(valued); // set LFO speed to this value
-		// cout << "FALLWAIT=" << eParam << endl;
-	}
-	// type 60 - "RISE"
-	else if(eType==60)
-	{
-		osc[channel].startRise();
-		// cout << "RISE!" << endl;
+			break;
+		
+		case EventCode::FALL:
+			o.startFall();
+			break;
+		case EventCode::FALLSPEED:
+			o.setFallSpeed(static_cast<double>(r.value));
+			break;
+		case EventCode::FALLWAIT:
+			o.setFallWait(static_cast<double>(r.value));
+			break;
+		case EventCode::RISE:
+			o.startRise();
+			break;
+		case EventCode::RISESPEED:
+			o.setRiseSpeed(static_cast<double>(r.value));
+			break;
+		case EventCode::RISERANGE:
+			o.setRiseRange(static_cast<double>(r.value));
+			break;
+		
+		case EventCode::BEEFUP:
+			o.enableBeefUp();
+			o.setBeefUpFactor(r.level);
+			break;
+		case EventCode::BEEFUP_OFF:
+			o.disableBeefUp();
+			break;
+		
+		// ring modulation - value is the modulator/feeder channel number
+		case EventCode::RINGMOD:
+			enableRingMod(channel, r.value);
+			break;
+		case EventCode::RINGMOD_OFF:
+			disableRingMod(channel);
+			break;
 	}
-	// type 61 - "RISESPEED="
-	else if(eType==61)
+}
+
+
+// process one event at current frame for the drum channel
+// (event type / parameter as written by the MML parser)
+void MPlayer::processDrumEvent(int eType, int eParam)
+{
+	SeqRecord r;
+	EventCode::lowerDrum(eType, eParam, r);
+	runDrumEvent(r);
+}
+
+// run one lowered event for the drum channel (see EventCode)
+void MPlayer::runDrumEvent(const SeqRecord &r)
+{
+	switch(r.event)
 	{
-		double valued = static_cast<double>(eParam);
-		osc[channel].setRiseSpeed(valued); // set LFO speed to this value
-		// cout << "RISESPEED=" << eParam << endl;
+		case EventCode::DRUM_NOP:
+			break;
+		
+		// gain already converted from the 1-10 scale (0.0 to 0.5f)
+		case EventCode::DRUM_VOLUME:
+			setDChannelGain(r.level);
+			break;
+		case EventCode::DRUM_VOLUME_UP:
+			setDChannelGain(min(0.5f, getDChannelGain()+0.05f));
+			break;
+		case EventCode::DRUM_VOLUME_DOWN:
+			setDChannelGain(max(0.001f, getDChannelGain()-0.05f));
+			break;
+		
+		// tone changes (reset, tuning, noise, lengths)
+		case EventCode::DRUM_RESET:
+		case EventCode::DRUM_KICKPITCH:
+		case EventCode::DRUM_SNAREPITCH:
+		case EventCode::DRUM_HIHATPITCH:
+		case EventCode::DRUM_WHITENOISE:
+		case EventCode::DRUM_PINKNOISE:
+		case EventCode::DRUM_KICKNOISE:
+		case EventCode::DRUM_SNARENOISE:
+		case EventCode::DRUM_HIHATNOISE:
+		case EventCode::DRUM_KICKLENGTH:
+		case EventCode::DRUM_SNARELENGTH:
+		case EventCode::DRUM_HIHATLENGTH:
+		case EventCode::DRUM_NOISELEVEL:
+			tuneDrum(nosc, r);
+			break;
+		
+		case EventCode::DRUM_BEEFUP:
+			nosc.enableBeefUp();
+			nosc.setBeefUpFactor(r.level);
+			break;
+		case EventCode::DRUM_BEEFUP_OFF:
+			nosc.disableBeefUp();
+			break;
+		
+		// square wave mix level (default is 1.0f)
+		case EventCode::DRUM_SQUARELEVEL:
+			nosc.setSquareLevel(r.level);
+			break;
 	}
-	// type 62 - "RISERANGE="
-	else if(eType==62)
+}
+
+// change a drum tone - everything a cached hit is made from
+// tuning - passed value = 0 to 100 (scale)
+// kick 50 - 350hz, snare 200 - 1240hz, hihat 1200 - 3600hz
+// (false if r doesn't change a tone)
+bool MPlayer::tuneDrum(NOSC &n, const SeqRecord &r)
+{
+	switch(r.event)
 	{
-		double valued = static_cast<double>(eParam);
-		osc[channel].setRiseRange(valued); // set LFO speed to this value
-		// cout << "RISERANGE=" << eParam << endl;
+		// reset all drum settings
+		case EventCode::DRUM_RESET:
+			n.resetDrumTones();
+			return true;
+		
+		case EventCode::DRUM_KICKPITCH:
+			n.tuneKick((static_cast<double>(r.value) / 100.0) * 300.0 + 50.0);
+			return true;
+		case EventCode::DRUM_SNAREPITCH:
+			n.tuneSnare((static_cast<double>(r.value) / 100.0) * 1040.0 + 200.0);
+			return true;
+		case EventCode::DRUM_HIHATPITCH:
+			n.tuneHiHat((static_cast<double>(r.value) / 100.0) * 2400.0 + 1200.0);
+			return true;
+		
+		case EventCode::DRUM_WHITENOISE:
+			n.useWhiteNoise();
+			return true;
+		case EventCode::DRUM_PINKNOISE:
+			n.usePinkNoise();
+			return true;
+		case EventCode::DRUM_KICKNOISE:
+			n.setKickNoiseType(r.value);
+			return true;
+		case EventCode::DRUM_SNARENOISE:
+			n.setSnareNoiseType(r.value);
+			return true;
+		case EventCode::DRUM_HIHATNOISE:
+			n.setHiHatNoiseType(r.value);
+			return true;
+		
+		// lengths in milliseconds
+		case EventCode::DRUM_KICKLENGTH:
+			n.setKickLength(r.value);
+			return true;
+		case EventCode::DRUM_SNARELENGTH:
+			n.setSnareLength(r.value);
+			return true;
+		case EventCode::DRUM_HIHATLENGTH:
+			n.setHiHatLength(r.value);
+			return true;
+		
+		// noise element mix level (default is 1.0f)
+		case EventCode::DRUM_NOISELEVEL:
+			n.setNoiseLevel(r.level);
+			return true;
 	}
-	// type 70 - "BEEFUP="
-	else if(eType==70)
+	return false;
+}
+	
+
+
+// export pipeline - the encoder thread's end
+// writes rendered chunks to the sound files as they come, until the empty chunk at the end
+// (a chunk holds one block of blockSize floats for each file - the first block is measured, too)
+struct SoundFileWriter
+{
+	SNDFILE** files;
+	int nFiles;
+	int blockSize;
+	ExportPipe* pipe;
+	LoudnessMeter* meter;
+	
+	SoundFileWriter(SNDFILE** f, int n, int size, ExportPipe* p, LoudnessMeter* m)
+		: files(f), nFiles(n), blockSize(size), pipe(p), meter(m) {}
+	
+	void operator()()
 	{
-		// cout << "BEEFUP=" << eParam << endl;
-		double valuef = static_cast<float>(eParam);
-		if(eParam<0.1f) // if zero, turn off beef-up
+		int nFrames;
+		float* chunk = pipe->getFull(nFrames);
+		while(nFrames > 0)
 		{
-			osc[channel].disableBeefUp();
-			// cout << "BEEFUP disabled!\n";
-		}
-		else
-		{
-			osc[channel].enableBeefUp();
-			osc[channel].setBeefUpFactor( (valuef*3.0f/100.0f) + 1.0f ); // set BEEFUP to this value
+			meter->process(chunk, nFrames);
+			for(int i=0; i<nFiles; i++)
+				sf_writef_float(files[i], chunk + i * blockSize, nFrames);
+			pipe->putEmpty(chunk);
+			chunk = pipe->getFull(nFrames);
 		}
 	}
-	// type 80 - "RINGMOD="
-	else if(eType==80)
+};
+
+// set up libsndfile's info for the file's extension - wav (16 bit) or ogg (vorbis)
+// returns false for anything else
+static bool getExportFormat(const string &filename, SF_INFO &info)
+{
+	// get the extension part of filename
+	string strExt = "";
+	if(filename.find_last_of('.') != string::npos)
+		strExt = filename.substr(filename.find_last_of('.'));
+	std::transform(strExt.begin(), strExt.end(), strExt.begin(), ::tolower); // to lowercase
+
+	info.channels = 2;
+	info.samplerate = 44100;
+
+	if(strExt==".wav")
+		info.format = SF_FORMAT_WAV | SF_FORMAT_PCM_16;
+	else if(strExt==".ogg")
+		info.format = SF_FORMAT_OGG | SF_FORMAT_VORBIS;
+	else
+		return false;
+	return true;
+}
+
+// float sample to 16 bit, clipped
+static inline short toPCM16(float sample)
+{
+	if(sample > 1.0f) sample = 1.0f;
+	else if(sample < -1.0f) sample = -1.0f;
+	return static_cast<short>(lrintf(sample * 32767.0f));
+}
+
+// little endian, whatever the machine
+static void putLE(char* out, unsigned long value, int nBytes)
+{
+	for(int i=0; i<nBytes; i++)
+		out[i] = static_cast<char>((value >> (8 * i)) & 0xFF);
+}
+
+// 44 byte wav header for nFrames of 16 bit stereo at 44100hz
+// (sizes known up front - so it can go out first, to a sink that can't seek back)
+static void makeWavHeader(char* header, long nFrames)
+{
+	unsigned long dataBytes = nFrames * 4;
+	memcpy(header, "RIFF", 4);
+	putLE(header + 4, 36 + dataBytes, 4);
+	memcpy(header + 8, "WAVEfmt ", 8);
+	putLE(header + 16, 16, 4);			// fmt chunk size
+	putLE(header + 20, 1, 2);			// PCM
+	putLE(header + 22, 2, 2);			// channels
+	putLE(header + 24, 44100, 4);		// sample rate
+	putLE(header + 28, 44100 * 4, 4);	// bytes per second
+	putLE(header + 32, 4, 2);			// bytes per frame
+	putLE(header + 34, 16, 2);			// bits per sample
+	memcpy(header + 36, "data", 4);
+	putLE(header + 40, dataBytes, 4);
+}
+
+// export pipeline - the streaming end
+// turns rendered chunks into 16 bit PCM and hands them to the sink, until the empty chunk at the end
+// (once the sink fails, the rest is just taken off the pipe - failed tells the renderer to stop)
+struct PCMStreamWriter
+{
+	PCMWriteFunc write;
+	void* userData;
+	int chunkFrames;
+	ExportPipe* pipe;
+	std::atomic<bool>* failed;
+	LoudnessMeter* meter;
+	
+	PCMStreamWriter(PCMWriteFunc w, void* data, int frames, ExportPipe* p, std::atomic<bool>* f,
+		LoudnessMeter* m)
+		: write(w), userData(data), chunkFrames(frames), pipe(p), failed(f), meter(m) {}
+	
+	void operator()()
 	{
-		// cout << "channel " << channel << " - RINGMOD = " << eParam << endl;
-		if(eParam==0) // if 0 is passed, turn OFF
+		std::vector<char> bytes(chunkFrames * 4);
+		int nFrames;
+		float* chunk = pipe->getFull(nFrames);
+		while(nFrames > 0)
 		{
-			// cout << "RINGMOD=OFF, channel = " << channel << endl;
-			disableRingMod(channel); // stop ring modulation for this channel now
+			if(!*failed)
+			{
+				meter->process(chunk, nFrames);
+				for(int i=0; i<nFrames * 2; i++)
+					putLE(&bytes[i * 2], static_cast<unsigned short>(toPCM16(chunk[i])), 2);
+				if(write(&bytes[0], nFrames * 4, userData) != nFrames * 4)
+					*failed = true;
+			}
+			pipe->putEmpty(chunk);
+			chunk = pipe->getFull(nFrames);
 		}
-		else if(eParam >= 1) // if 1 or bigger is passed, assign ring modulator channel
-			enableRingMod(channel, eParam-1); // start ring modulation for this channel now
-											// the passed parameter is the modulator/feeder channel number
-		
 	}
-	// type 81 - "RINGMOD=OFF"
-	else if(eType==81)
+};
+
+// stream sinks for exportToStream()
+static long writeToFile(const char* data, long bytes, void* userData)
+{
+	return fwrite(data, 1, bytes, static_cast<FILE*>(userData));
+}
+
+static long writeToFD(const char* data, long bytes, void* userData)
+{
+	int fd = *static_cast<int*>(userData);
+	long written = 0;
+	while(written < bytes) // pipes may take it a piece at a time
 	{
-		// cout << "RINGMOD=OFF, channel = " << channel << endl;
-		disableRingMod(channel); // stop ring modulation for this channel now
+#ifdef _WIN32
+		long n = _write(fd, data + written, bytes - written);
+#else
+		long n = ::write(fd, data + written, bytes - written);
+#endif
+		if(n <= 0)
+			break;
+		written += n;
 	}
+	return written;
 }
 
-
-// process one event at current frame for a specified channel
-void MPlayer::processDrumEvent(int eType, int eParam)
+// export the song to a wav (16 bit) or ogg (vorbis) file
+// rendering runs here, encoding on a thread of its own - the two overlap
+// (mp3 needs the LAME encoder, which the player isn't built with)
+std::string MPlayer::exportToFile(string filename)
 {
-	// cout << "Event: Drums type=" << eType << "\t";
+	BC_TRACE_SPAN("MPlayer::exportToFile");
+	// set up info to pass to libsndfile
+	SF_INFO info;
+	if(!getExportFormat(filename, info))
+		return "Invalid file type";
 
-	// -1 is end of event series for the channel
-	if(eType==-1)
+	// open sound file for writing...
+	SNDFILE *sndFile = sf_open(filename.c_str(), SFM_WRITE, &info);
+	if(sndFile==NULL)
 	{
-		// cout << "Drum channel : end of events!\n";
+		string errMsg = "Error opening sound file: ";
+		errMsg += sf_strerror(sndFile);
+		return errMsg;
 	}
+
+	// go to the beginning of the song
+	goToBeginning();
+	long songFrameLen = getSongLastFrame();
 	
-	// type 0 - specify the volume
-	else if(eType==0)
-	{
-		// convert the passed value(1-10) to float (0.0 to 0.5f)
-		float gainToSet
-			= static_cast<float>(eParam) / 20.0f;
-		setDChannelGain(gainToSet);	
-		// cout << "VOLUME=" << eParam << endl;
-	}
-	// type 1 - increment volume
-	else if(eType==1)
-	{
-		float gainToSet = min(0.5f, getDChannelGain()+0.05f);
-		setDChannelGain(gainToSet);		
-		// cout << "VOLUME++\n";
-	}
-	// type 2 - decrement volume
-	else if(eType==2)
-	{
-		float gainToSet = max(0.001f, getDChannelGain()-0.05f);
-		setDChannelGain(gainToSet);
-		// cout << "VOLUME--\n";
-	}
-	// type 500 - reset all drum settings
-	else if(eType==500)
-	{
-		nosc.resetDrumTones();
-		// cout << "RESETDRUMS\n";
-	}
-	// type 510 - tune kick
-	// passed value = 0 to 100 (scale), set to freq ranging between 50 and 350hz
-	else if(eType==510)
-	{
-		double tuneFreq = (static_cast<double>(eParam) / 100.0) * 300.0 + 50.0;
-		nosc.tuneKick(tuneFreq);
-		// cout << "KICKPITCH - " << eParam << "%, " << tuneFreq << "hz\n";
-	}
-	// type 511 - tune snare
-	// passed value = 0 to 100 (scale), set to freq ranging between 200 and 1240hz
-	else if(eType==511)
-	{
-		double tuneFreq = (static_cast<double>(eParam) / 100.0) * 1040.0 + 200.0;
-		nosc.tuneSnare(tuneFreq);
-		// cout << "SNAREPITCH - " << eParam << "%, " << tuneFreq << "hz\n";
-	}
-	// type 512 - tune HiHat
-	// passed value = 0 to 100 (scale), set to freq ranging between 1200 and 3600hz
-	else if(eType==512)
+	// render into the pipe's chunks while the encoder writes (and measures) the ones before
+	ExportPipe pipe(EXPORT_CHUNKS, EXPORT_CHUNK_FRAMES * 2);
+	LoudnessMeter meter;
+	beginRenderStats();
+	std::thread encoder = std::thread(SoundFileWriter(&sndFile, 1, EXPORT_CHUNK_FRAMES * 2, &pipe, &meter));
+	
+	long currentFrame = 0;
+	while(framePos < songFrameLen)
 	{
-		double tuneFreq = (static_cast<double>(eParam) / 100.0) * 2400.0 + 1200.0;
-		nosc.tuneHiHat(tuneFreq);
-		// cout << "HIHATPITCH - " << eParam << "%, " << tuneFreq << "hz\n";
+		float* chunk = pipe.getEmpty();
+		int nFrames = fillExportBuffer(chunk, EXPORT_CHUNK_FRAMES, currentFrame, songFrameLen);
+		currentFrame += nFrames;
+		pipe.putFull(chunk, nFrames);
 	}
-	// type 520 - "BEEFUP="
-	else if(eType==520)
+	pipe.putFull(NULL, 0); // that's all
+	encoder.join();
+	setRenderStats(meter);
+
+	sf_write_sync(sndFile);
+	sf_close(sndFile);
+
+	return "Finished writing file: " + filename;
+}
+
+// export the full mix and every stem from one pass over the song
+// song.wav -> song_mix.wav, song_ch1.wav ... song_ch9.wav, song_drums.wav, song_delay.wav
+// stems are each voice's share of the mix with master gain applied - before the master compressor
+// and limiter, so they add up to the mix wherever those aren't working
+std::string MPlayer::exportStems(string filename)
+{
+	SF_INFO info;
+	if(!getExportFormat(filename, info))
+		return "Invalid file type";
+	
+	string base = filename.substr(0, filename.find_last_of('.'));
+	string ext = filename.substr(filename.find_last_of('.'));
+	string suffix[N_STEMS + 1] = { "_mix", "_ch1", "_ch2", "_ch3", "_ch4", "_ch5", "_ch6", "_ch7", "_ch8", "_ch9",
+									"_drums", "_delay" };
+	
+	// open all the files first - mix, then the stems in stem order
+	SNDFILE* files[N_STEMS + 1];
+	for(int i=0; i<N_STEMS + 1; i++)
 	{
-		// cout << "Drum BEEFUP=" << eParam << endl;
-		double valuef = static_cast<float>(eParam);
-		if(eParam<0.1f) // if zero, turn off beef-up
-		{
-			nosc.disableBeefUp();
-			// cout << "Drum - BEEFUP disabled!\n";
-		}
-		else
+		string name = base + suffix[i] + ext;
+		files[i] = sf_open(name.c_str(), SFM_WRITE, &info);
+		if(files[i] == NULL)
 		{
-			nosc.enableBeefUp();
-			nosc.setBeefUpFactor( (valuef*1.6f/100.0f) + 1.0f ); // set BEEFUP to this value
+			string errMsg = "Error opening sound file: " + name + " - ";
+			errMsg += sf_strerror(files[i]);
+			for(int j=0; j<i; j++)
+				sf_close(files[j]);
+			return errMsg;
 		}
 	}
-	// type 530 - use white noise
-	else if(eType==530)
-	{
-		nosc.useWhiteNoise();
-		// cout << "WHITENOISE - All drums\n";
-	}
-	// type 531 - use pink noise
-	else if(eType==531)
-	{
-		nosc.usePinkNoise();
-		// cout << "PINKNOISE - All drums\n";
-	}
-	// type 532 - set kick noise type
-	else if(eType==532)
-	{
-		nosc.setKickNoiseType(eParam);
-		// cout << "set kick noise type =" << eParam << "\n";
-	}
-	// type 533 - set snare noise type
-	else if(eType==533)
-	{
-		nosc.setSnareNoiseType(eParam);
-		// cout << "set snare noise type =" << eParam << "\n";
-	}
-	// type 534 - set hihat noise type
-	else if(eType==534)
-	{
-		nosc.setHiHatNoiseType(eParam);
-		// cout << "set hihat noise type =" << eParam << "\n";
-	}
-	// type 540 - set kick length
-	// passed value = 0 to 400 (milliseconds), set to int value ranging between 0 and 400 msec
-	else if(eType==540)
-	{
-		nosc.setKickLength(eParam);
-		// cout << "KICKLENGTH - " << eParam << "msec\n";
-	}
-	// type 541 - set snare length
-	// passed value = 0 to 1000 (milliseconds), set to int value ranging between 0 and 1000 msec
-	else if(eType==541)
-	{
-		nosc.setSnareLength(eParam);
-		// cout << "SNARELENGTH - " << eParam << "msec\n";
-	}
-	// type 542 - set hihat length
-	// passed value = 0 to 1000 (milliseconds), set to int value ranging between 0 and 1000 msec
-	else if(eType==542)
-	{
-		nosc.setHiHatLength(eParam);
-		// cout << "HIHATLENGTH - " << eParam << "msec\n";
-	}
-	// type 550 - set square wave element mix level (default is 100 = 1.0f)
-	// passed value = 0 to 100 (percent), set to float value ranging between 0 and 1.0f
-	else if(eType==550)
+	
+	goToBeginning();
+	long songFrameLen = getSongLastFrame();
+	
+	// each chunk - the mix block, then one block per stem
+	int blockSize = EXPORT_CHUNK_FRAMES * 2;
+	ExportPipe pipe(EXPORT_CHUNKS, blockSize * (N_STEMS + 1));
+	LoudnessMeter meter;
+	beginRenderStats();
+	std::thread encoder = std::thread(SoundFileWriter(files, N_STEMS + 1, blockSize, &pipe, &meter));
+	
+	long currentFrame = 0;
+	while(framePos < songFrameLen)
 	{
-		float valuef = static_cast<float>(eParam) / 100.0f;
-		nosc.setSquareLevel(valuef);
-		// cout << "SQUARELEVEL - " << eParam << "%, passing value = " << valuef << "\n";
+		float* chunk = pipe.getEmpty();
+		int nFrames = fillStemBuffer(chunk, chunk + blockSize, EXPORT_CHUNK_FRAMES, currentFrame, songFrameLen);
+		currentFrame += nFrames;
+		pipe.putFull(chunk, nFrames);
 	}
-	// type 551 - set noise element mix level (default is 100 = 1.0f)
-	// passed value = 0 to 100 (percent), set to float value ranging between 0 and 1.0f
-	else if(eType==551)
+	pipe.putFull(NULL, 0);
+	encoder.join();
+	setRenderStats(meter);
+	
+	for(int i=0; i<N_STEMS + 1; i++)
 	{
-		float valuef = static_cast<float>(eParam) / 100.0f;
-		nosc.setNoiseLevel(valuef);
-		// cout << "NOISELEVEL - " << eParam << "%, passing value = " << valuef << "\n";
+		sf_write_sync(files[i]);
+		sf_close(files[i]);
 	}
+	
+	return "Finished writing stems: " + base + "_*" + ext;
 }
 
+// fillExportBuffer() - plus each stem, into stems (N_STEMS blocks of framesToWrite stereo frames)
+int MPlayer::fillStemBuffer(float* buffer, float* stems, int framesToWrite, long startFrame, int songFrameLen)
+{
+	// voices that don't play stay silent
+	for(int i=0; i<N_STEMS * framesToWrite * 2; i++)
+		stems[i] = 0.0f;
 	
+	// getMix() writes each voice's share here as it mixes
+	stemFrame = stems;
+	stemStride = framesToWrite * 2;
+	int framesWritten = fillExportBuffer(buffer, framesToWrite, startFrame, songFrameLen);
+	stemFrame = NULL;
+	
+	return framesWritten;
+}
 
 
-/*----------
-
-std::string MPlayer::exportToFile(string filename)
+// stream the song out as 16 bit stereo PCM (44100hz, little endian) - raw, or with a wav header first
+// to any sink - write gets the bytes in order, a chunk at a time, from a thread of its own
+// memory use stays the same however long the song is - nothing touches the disk
+std::string MPlayer::exportToStream(PCMWriteFunc write, void* userData, bool wavHeader)
 {
-
-	// get the extension part of filename
-	string strExt = filename.substr(filename.find_last_of('.'));
-	std::transform(strExt.begin(), strExt.end(), strExt.begin(), ::tolower); // to lowercase
-
-	// set up info to pass to libsndfile
-	SF_INFO info;
-	info.channels = 2;
-	info.samplerate = 44100;
-
-	// number of total frames we need
+	goToBeginning();
 	long songFrameLen = getSongLastFrame();
-
-	// just to fill up with zeros...
-	for(int i=0;i<88200;i++)
-		sndBuffer[i] = 0;
-
-	if(strExt==".mp3") // mp3 file - will use lame encoder
+	
+	if(wavHeader)
 	{
-		// try with 8192 in one chunk
-		 // * mp3buf_size in bytes = 1.25 * num_samples + 7200
-		 //    1.25 x 8192 + 7200 = 17440
-		int writeChunkSize = 8192;
-		const int MP3_SIZE = 17440;
-		unsigned char mp3_buffer[MP3_SIZE];
-
-		FILE *mp3 = fopen(filename.c_str(), "wb");
+		char header[44];
+		makeWavHeader(header, songFrameLen);
+		if(write(header, 44, userData) != 44)
+			return "Error writing to stream";
+	}
+	
+	ExportPipe pipe(EXPORT_CHUNKS, EXPORT_CHUNK_FRAMES * 2);
+	std::atomic<bool> failed(false);
+	LoudnessMeter meter;
+	beginRenderStats();
+	std::thread sender = std::thread(PCMStreamWriter(write, userData, EXPORT_CHUNK_FRAMES, &pipe, &failed,
+		&meter));
+	
+	long currentFrame = 0;
+	while(framePos < songFrameLen && !failed)
+	{
+		float* chunk = pipe.getEmpty();
+		int nFrames = fillExportBuffer(chunk, EXPORT_CHUNK_FRAMES, currentFrame, songFrameLen);
+		currentFrame += nFrames;
+		pipe.putFull(chunk, nFrames);
+	}
+	pipe.putFull(NULL, 0);
+	sender.join();
+	setRenderStats(meter);
+	
+	if(failed)
+		return "Error writing to stream";
+	return "Finished writing stream";
+}
 
-		// initialize lame object
-		lame_t lame = lame_init();
-		lame_set_in_samplerate(lame, 44100);
-		lame_set_VBR(lame, vbr_default);
-		lame_init_params(lame);
+// ... to a stdio stream (stdout, a popen() pipe) - must be opened binary
+std::string MPlayer::exportToStream(FILE* out, bool wavHeader)
+{
+	std::string result = exportToStream(writeToFile, out, wavHeader);
+	fflush(out);
+	return result;
+}
 
-		int read, write;
-		long currentSongFrame = 0;
+// ... to a file descriptor (a pipe, a socket)
+std::string MPlayer::exportToStream(int fd, bool wavHeader)
+{
+	return exportToStream(writeToFD, &fd, wavHeader);
+}
 
-		// go to the beginning of the song
+// get ready to render frames startFrame up to endFrame - returns endFrame, kept within the song
+// (endFrame < 0 = to the end of the song)
+long MPlayer::startRender(long startFrame, long endFrame)
+{
+	long songFrameLen = getSongLastFrame();
+	if(endFrame < 0 || endFrame > songFrameLen)
+		endFrame = songFrameLen;
+	
+	if(startFrame > 0)
+		seek(startFrame);
+	else
 		goToBeginning();
+	
+	return endFrame;
+}
 
-		bool done = false;
-
-		while(!done)
-		{
-			// let's fill the sound buffer with 8192 samples
-			read = fillExportBuffer(sndBuffer, writeChunkSize, currentSongFrame, songFrameLen);
-			currentSongFrame += read;
-
-			// if reached end of song, will get out of loop and finish
-			if(framePos >= songFrameLen)
-				done = true;
-
-			write = lame_encode_buffer_interleaved_ieee_float
-					(lame, sndBuffer, read, mp3_buffer, MP3_SIZE);
-			fwrite(mp3_buffer, write, 1, mp3);
-		}
-
-		// finish and close lame
-		write = lame_encode_flush(lame, mp3_buffer, MP3_SIZE);
-		lame_close(lame);
-		fclose(mp3);
-
-		return "Finished writing mp3: " + filename;
+// render frames startFrame up to endFrame of the song into memory - no device, no file
+// buffer takes (endFrame - startFrame) * 2 floats, stereo interleaved, written in place
+// (a block at a time - measured while it's still in the cache)
+// returns the number of frames rendered
+long MPlayer::renderToBuffer(float* buffer, long startFrame, long endFrame)
+{
+	endFrame = startRender(startFrame, endFrame);
+	
+	LoudnessMeter meter;
+	beginRenderStats();
+	// count the frames written, not framePos - a REPEAT goes back to the loop start and
+	// would run on past the end of the buffer
+	long framesToRender = endFrame - max(startFrame, 0L);
+	long framesRendered = 0;
+	while(framesRendered < framesToRender)
+	{
+		float* block = buffer + framesRendered * 2;
+		int nFrames = fillExportBuffer(block, min(framesToRender - framesRendered, static_cast<long>(EXPORT_CHUNK_FRAMES)),
+			framePos, endFrame);
+		meter.process(block, nFrames);
+		framesRendered += nFrames;
 	}
+	setRenderStats(meter);
+	
+	return framesRendered;
+}
 
-	else if(strExt==".wav" || strExt==".ogg") // for wav and ogg, will use libsndfile
+// same, as 16 bit samples - rendered a block at a time and converted into buffer
+long MPlayer::renderToBuffer(short* buffer, long startFrame, long endFrame)
+{
+	endFrame = startRender(startFrame, endFrame);
+	
+	float block[EXPORT_CHUNK_FRAMES * 2];
+	LoudnessMeter meter;
+	beginRenderStats();
+	long framesToRender = endFrame - max(startFrame, 0L);
+	long framesRendered = 0;
+	while(framesRendered < framesToRender)
 	{
-		if(strExt==".wav")
-			info.format = SF_FORMAT_WAV | SF_FORMAT_PCM_16;
-		if(strExt==".ogg")
-			info.format = SF_FORMAT_OGG | SF_FORMAT_VORBIS;
-
-		// open sound file for writing...
-		SNDFILE *sndFile = sf_open(filename.c_str(), SFM_WRITE, &info);
-		if(sndFile==NULL)
-		{
-			// delete [] sndBuffer; // release memory
-			string errMsg = "Error opening sound file: ";
-			errMsg += sf_strerror(sndFile);
-			return errMsg;
-		}
-
-		// go to the beginning of the song
-		goToBeginning();
-		// songFrameLen -> total frame length of song
-		long currentFrame = 0;
-		int writeChunkSize = 4096; // n of frames to write in each call
-		bool done = false;
-
-		while(!done)
-		{
-			// fill up sound buffer with a chunk of music data
-			int nFramesWritten = fillExportBuffer(sndBuffer, writeChunkSize, currentFrame, songFrameLen);
+		int nFrames = fillExportBuffer(block, min(framesToRender - framesRendered, static_cast<long>(EXPORT_CHUNK_FRAMES)),
+			framePos, endFrame);
+		meter.process(block, nFrames);
+		short* out = buffer + framesRendered * 2;
+		for(int i=0; i<nFrames * 2; i++)
+			out[i] = toPCM16(block[i]);
+		framesRendered += nFrames;
+	}
+	setRenderStats(meter);
+	
+	return framesRendered;
+}
 
-			// write to file just this much
-			int framesWrittenFile = sf_writef_float(sndFile, sndBuffer, writeChunkSize);
+// a render to measure begins - count limiter clips and each voice's level from here
+void MPlayer::beginRenderStats()
+{
+	clipsBefore = capHits;
+	for(int i=0; i<N_STEMS; i++)
+		channelSum[i] = 0.0;
+	channelSquares = channelSum;
+}
 
-			// currentFrame += nFramesWritten; // update current position
-			if(framePos >= songFrameLen) // reached end...
-				done = true;
-		}
+// keep what the meter measured (and the limiter / voices since beginRenderStats()) for getRenderStats()
+void MPlayer::setRenderStats(LoudnessMeter &meter)
+{
+	channelSquares = NULL;
+	renderStats = meter.getStats();
+	renderStats.clipCount = capHits - clipsBefore;
+	for(int i=0; i<RenderStats::N_CHANNELS; i++)
+		renderStats.channelRMS[i] = channelSum[i] > 0.0 && renderStats.frames > 0
+			? 10.0 * log10(channelSum[i] / (renderStats.frames * 2.0)) : -HUGE_VAL;
+}
 
-		sf_write_sync(sndFile);
-		sf_close(sndFile);
+// what the last export / offline render measured - loudness, peaks, RMS, limiter clips
+RenderStats MPlayer::getRenderStats()
+	{ return renderStats; }
 
-		return "Finished writing file: " + filename;
-	}
-	else
-	{
-		return "Invalid file type";
-	}
+// a number for JSON - null if there isn't one (e.g. the loudness of silence)
+static std::string jsonNumber(double value)
+{
+	if(!(value > -HUGE_VAL && value < HUGE_VAL))
+		return "null";
+	char text[32];
+	snprintf(text, sizeof(text), "%.2f", value);
+	return text;
 }
 
-----------*/
-
+// write getRenderStats() out as JSON - e.g. next to the exported file, as mySong.ogg.json
+bool MPlayer::writeRenderStats(string filename)
+{
+	FILE* file = fopen(filename.c_str(), "w");
+	if(file == NULL)
+		return false;
+	
+	const RenderStats &s = renderStats;
+	fprintf(file, "{\n");
+	fprintf(file, "\t\"frames\": %ld,\n", s.frames);
+	fprintf(file, "\t\"seconds\": %.3f,\n", s.frames / 44100.0);
+	fprintf(file, "\t\"integratedLoudness\": %s,\n", jsonNumber(s.integratedLoudness).c_str());
+	fprintf(file, "\t\"truePeak\": %s,\n", jsonNumber(s.truePeak).c_str());
+	fprintf(file, "\t\"samplePeak\": %s,\n", jsonNumber(s.samplePeak).c_str());
+	fprintf(file, "\t\"rms\": [%s, %s],\n", jsonNumber(s.rms[0]).c_str(), jsonNumber(s.rms[1]).c_str());
+	fprintf(file, "\t\"channelRms\": {");
+	const char* channelName[RenderStats::N_CHANNELS] = { "ch1", "ch2", "ch3", "ch4", "ch5", "ch6", "ch7", "ch8", "ch9",
+		"drums", "delay" };
+	for(int i=0; i<RenderStats::N_CHANNELS; i++)
+		fprintf(file, "%s\"%s\": %s", i > 0 ? ", " : "", channelName[i], jsonNumber(s.channelRMS[i]).c_str());
+	fprintf(file, "},\n");
+	fprintf(file, "\t\"clipCount\": %ld\n", s.clipCount);
+	fprintf(file, "}\n");
+	
+	bool result = ferror(file) == 0;
+	fclose(file);
+	return result;
+}
 
 // fill the export buffer with music data for exporting
 // just a chunk at a time - from startFrame in the song
@@ -6236,9 +9845,19 @@ int MPlayer::fillExportBuffer(float* buffer, int framesToWrite, long startFrame,
 	bool writeFinished = false;
 	long writeIndex = 0;
 	int framesWritten = 0;
+	int blockLen = 0;
 
 	while(!writeFinished)
 	{
+		// the plain voices are rendered a block at a time - up to the next note or event
+		// (and no further than this chunk, or the end of the song)
+		if(blockFrame < 0)
+		{
+			blockLen = voiceBlockLength(min(static_cast<long>(framesToWrite - framesWritten), songFrameLen - framePos));
+			renderVoiceBlock(blockLen);
+			blockFrame = 0;
+		}
+
 		// get mix of all 9 channels (plus drums) at current position
 		//soundAmplitudeLeft = getMix(0); // get mix for LEFT channel
 		//soundAmplitudeRight = getMix(1); // get mix for RIGHT channel
@@ -6247,150 +9866,29 @@ int MPlayer::fillExportBuffer(float* buffer, int framesToWrite, long startFrame,
 		//	output to export buffer
 		//
 
-		buffer[writeIndex] = getMix(0); // write LEFT channel mix to buffer
+		buffer[writeIndex] = getMix(0, 1.0f); // write LEFT channel mix to buffer (full level - track fades are live only)
 		writeIndex++; // move buffer pointer
-		buffer[writeIndex] = getMix(1); // write RIGHT channel mix to buffer
+		buffer[writeIndex] = getMix(1, 1.0f); // write RIGHT channel mix to buffer
 		writeIndex++; // move buffer pointer
 
 		framesWritten++;
+		if(stemFrame != NULL) // stems, too - on to the next frame
+			stemFrame += 2;
 
-		// if reached end of note, go to next index (for regular channels ch0 - 2)
-		for(int i=0; i<9; i++)
-		{
-			if(!channelDone[i])
-			{
-				
-				// if there are event requests, digest those first
-				bool eventsDone = false;
-				
-				while(!eventsDone)
-				{
-					// if next event in vector is set to happen at this frame pos, process
-					if( (data[i].eventFrame[eventIndex[i]] <= framePos) && (eventIndex[i] < data[i].nEvents) )
-					{
-						processEvent(i, data[i].eventType[eventIndex[i]], 
-										data[i].eventParam[eventIndex[i]]);
-						eventIndex[i]++;
-					}
-					else
-						eventsDone = true;
-				}	
-				
-				remainingFrames[i]--;
-				if(remainingFrames[i] <= 0)
-				{
-					noteIndex[i]++;
-
-					// cout << "Frame " << framePos << " channel " << i << " - note index = " <<  noteIndex[i];
-
-					// and if you get to the end of MML signal (freq = -1.0), set flag
-					if(data[i].freqNote[noteIndex[i]] < 0)
-					{
-						channelDone[i] = true;
-						setToRest(i); // set to rest.. and let delay finish
-						// disableChannel(i); // disable this channel
-					}
-					else
-					{
-						remainingFrames[i] = data[i].len[noteIndex[i]];
-						freqNote[i] = data[i].freqNote[noteIndex[i]];
-
-						// if this is a rest (freq = 65535), set this channel to rest
-						if(freqNote[i]==65535.0)
-							setToRest(i);
-						// otherwise, this is a valid note - so set this note
-						else
-							setNewNote(i, freqNote[i]);
-					}
-				}
-			}
-		}
-
-		// now handle drum channel!
-		if(!dChannelDone)
-		{
-			
-			// if there are event requests, digest those first
-			bool eventsDone = false;
-			
-			while(!eventsDone)
-			{
-				// if next event in vector is set to happen at this frame pos, process
-				if( (ddata.eventFrame[dEventIndex] <= framePos) && (dEventIndex < ddata.nEvents) )
-				{
-					processDrumEvent(ddata.eventType[dEventIndex], ddata.eventParam[dEventIndex]);
-					dEventIndex++;
-				}
-				else
-					eventsDone = true;
-			}
-			
-			dRemainingFrames--;
-			if(dRemainingFrames <= 0)
-			{
-				dNoteIndex++; // move onto the next drum note index
-
-				// and if you get to the end of MML signal (drumNote = -1.0), set flag
-				if(ddata.drumNote[dNoteIndex] < 0 || dNoteIndex >= ddata.getSize())
-				{
-					dChannelDone = true;
-					restDrum(); // rest.. and let delay effect finish off
-					// disableDrumChannel(); // disable this channel
-				}
-				else // not at end yet.. set new drum hit
-				{
-					dRemainingFrames = ddata.len[dNoteIndex];
-					currentDrumNote = ddata.drumNote[dNoteIndex];
-					setNewDrumHit(currentDrumNote);
-
-					// if this is a rest (freq = 65535), set flag
-					if(currentDrumNote == 65535)
-					{
-						restDrum();
-					}
-				}
-			}
-		}
+		// move every channel along - events, next notes
+		sequenceFrame();
 
 		
 		// if all channels have reached end... and loop is enabled, go back to beginning
-		if(	channelDone[0] && channelDone[1] && channelDone[2] &&
-			channelDone[3] && channelDone[4] && channelDone[5] &&
-			channelDone[6] && channelDone[7] && channelDone[8] && dChannelDone)
-		{
-			
-			// final point check!
-			// ... if there are events to process at this final moment... process them here
-			
-			for(int i=0;i<9;i++)
-			{
-				bool eventsDone = false;
-				while(!eventsDone)
-				{
-					// if next event in vector is set to happen at this frame pos, process
-					if( (eventIndex[i] < data[i].nEvents) )
-					{
-						processEvent(i, data[i].eventType[eventIndex[i]], data[i].eventParam[eventIndex[i]]);
-						eventIndex[i]++;
-					}
-					else
-						eventsDone = true;
-				}
-			}
+		if(	channelDone[0] && channelDone[1] && channelDone[2] &&
+			channelDone[3] && channelDone[4] && channelDone[5] &&
+			channelDone[6] && channelDone[7] && channelDone[8] && dChannelDone)
+		{
 			
-			// process drum events pending at the final point before loop
-			bool eventsDone = false;
-			while(!eventsDone)
-			{
-				// if next event in vector is set to happen at this frame pos, process
-				if( (dEventIndex < ddata.nEvents) )
-				{
-					processDrumEvent(ddata.eventType[dEventIndex], ddata.eventParam[dEventIndex]);
-					dEventIndex++;
-				}
-				else
-					eventsDone = true;
-			}			
+			// final point check!
+			// ... if there are events to process at this final moment... process them here
+			
+			playOutEvents();
 			
 			
 			if(repeatsRemaining > 1) // if repeat times is left.. process
@@ -6399,14 +9897,8 @@ int MPlayer::fillExportBuffer(float* buffer, int framesToWrite, long startFrame,
 				repeatsRemaining--;
 				// cout << "Back to beginning... repeats remaining = " << repeatsRemaining << endl;
 				
-				// enable channels again
-				enableChannels(true, true, true, true, true, true, true, true, true, true);
-
-				// enable drum channel
-				enableDrumChannel();
-
-				// go back to the beginning
-				goToBeginning();					
+				// go back to the loop start (or the very beginning)
+				loopBack();
 			}
 		}		
 		
@@ -6416,7 +9908,18 @@ int MPlayer::fillExportBuffer(float* buffer, int framesToWrite, long startFrame,
 		{
 			// update player position
 			framePos++;
-			advance();
+			
+			// the block's last frame - every voice moves on from the sequencer's changes
+			if(blockFrame == blockLen - 1)
+			{
+				advance();
+				blockFrame = -1;
+			}
+			else
+			{
+				advanceUnblocked();
+				blockFrame++;
+			}
 
 			// if you have reached the absolute last frame position of the song
 			// (including last delay effects) - only then end the track officially
@@ -6477,208 +9980,141 @@ float MPlayer::getHistoricalAverage(int channel)
 // in the track
 void MPlayer::seek(long destination)
 {
+	BC_TRACE_SPAN("MPlayer::seek");
 	// if requested destination is further than the last point of track
 	// make it the last point of the track
 	if(destination > songLastFrame)
 		destination = songLastFrame;
 	
-	bool seekDone = false; // flag to keep track of task completion
 	goToBeginning(); // go to beginning of track first
 	
 	//
-	//  now seek to destination...
+	//  now seek to destination... stepping note by note rather than frame by frame,
+	//  with notes and events switching on the same frames as they would in playback
 	//
 	
-	while(!seekDone)
+	for(int i=0; i<9; i++)
 	{
-		for(int i=0; i<9; i++)
+		const SeqRecord *r = &data[i].stream[streamIndex[i]];
+		long tick = 0;		// next frame the sequencer would step at
+		long noteStart = 0;	// first frame the current note's oscillator advances at
+		bool noteChanged = false;
+		
+		// zap through until very last note before the seekpoint, including events
+		while(!channelDone[i])
 		{
-			long seekPos = 0;
-			
-			// for each music channel...
-			// zap through until very last note before the seekpoint
-			// including events
+			// frame the current note ends at (and the next one is set up)
+			long noteEnd = tick + max(remainingFrames[i], 1) - 1;
+			if(noteEnd >= destination)
+				break;
 			
-			// first process all the events up to destination
-			bool eventsZappingDone = false;
-			while(!eventsZappingDone)
+			while(r->op == SeqRecord::EVENT && r->frame <= noteEnd)
 			{
-				// if next event in vector is set to happen at this frame pos, process
-				if( (data[i].eventFrame[eventIndex[i]] <= destination) && (eventIndex[i] < data[i].nEvents) )
-				{
-					processEvent(i, data[i].eventType[eventIndex[i]], 
-									data[i].eventParam[eventIndex[i]]);
-					eventIndex[i]++;
-				}
-				else
-					eventsZappingDone = true;
+				runEvent(i, *r);
+				r++;
 			}
 			
-			bool zappingDone = false;
-			
-			while(!zappingDone)
+			// if the next note is end signal, finish this channel
+			if(r->op == SeqRecord::END)
 			{
-
-				// if the next note is end signal, finish this channel
-				if(data[i].freqNote[noteIndex[i]] < 0)
-				{
-					channelDone[i] = true;
-					setToRest(i);
-					zappingDone = true;
-				}
-				
-				// if not finished yet, advance note index.. til very last note before destination
-				if(!channelDone[i])
-				{
-					// if adding next note will cause to go past destination, stop here
-					if( ( seekPos + static_cast<long>(data[i].len[noteIndex[i]]) ) >= destination )
-					{
-						zappingDone = true;
-						// DEBUG
-						// cout << "Zapping for ch " << i << " done at: " << seekPos << endl;
-						
-						// now set up the channel ready for this note
-						remainingFrames[i] = data[i].len[noteIndex[i]];
-						freqNote[i] = data[i].freqNote[noteIndex[i]];
-						
-						// if it's a rest, hadle accordingly
-						if(freqNote[i]==65535.0)
-							setToRest(i);
-						else // otherwise we have a note
-							setNewNote(i, freqNote[i]);
-							
-					}
-					// otherwise it's good to add this next note length
-					else
-					{
-						seekPos += data[i].len[noteIndex[i]];
-						noteIndex[i]++; // advance to next note
-						remainingFrames[i] = data[i].len[noteIndex[i]];
-					}
-				}				
+				channelDone[i] = true;
+				setToRest(i);
+			}
+			else
+			{
+				remainingFrames[i] = r->value;
+				freqNote[i] = r->freq;
 			}
+			r++;
+			tick = noteEnd + 1;
+			noteStart = noteEnd;
+			noteChanged = true;
+		}
 		
-			// now process this last note
-			bool lastNoteProcessingDone = false;
-			
-			while(!lastNoteProcessingDone)
+		// now process this last note
+		if(!channelDone[i])
+		{
+			while(r->op == SeqRecord::EVENT && r->frame < destination)
 			{
-				// first off, if your channel is done for, exit!
-				if(channelDone[i])
-					lastNoteProcessingDone = true;
-				// if you've reached destination, quit!
-				else if(seekPos >= destination)
-					lastNoteProcessingDone = true;
-				// otherwise advance seekPos and process note
-				else
-				{
-					seekPos++;
-					osc[i].advance();
-					remainingFrames[i]--;
-				}
+				runEvent(i, *r);
+				r++;
 			}
+			remainingFrames[i] -= destination - tick;
 			
-			// cout << "SEEK done: Channel " << i << " seekPos = " << seekPos << endl;
+			// now set up the channel ready for this note
+			if(noteChanged)
+			{
+				// if it's a rest, hadle accordingly
+				if(freqNote[i]==65535.0)
+					setToRest(i);
+				else // otherwise we have a note
+					setNewNote(i, freqNote[i]);
+			}
+			for(long f=noteStart; f<destination; f++)
+				osc[i].advance();
 		}
+		streamIndex[i] = r - &data[i].stream[0];
+	}
+	
+	// for drum channel...
+	// zap through until very last note before the seekpoint
+	{
+		const SeqRecord *r = &ddata.stream[dStreamIndex];
+		long tick = 0;
+		long noteStart = 0;
+		bool noteChanged = false;
 		
-		// for drum channel...
-		// zap through until very last note before the seekpoint
-
-			long seekPos = 0;
+		while(!dChannelDone)
+		{
+			long noteEnd = tick + max(dRemainingFrames, 1) - 1;
+			if(noteEnd >= destination)
+				break;
 			
-			// first process all the events up to destination
-			bool eventsZappingDone = false;
-
-			while(!eventsZappingDone)
+			while(r->op == SeqRecord::EVENT && r->frame <= noteEnd)
 			{
-				// if next event in vector is set to happen at this frame pos, process
-				if( (ddata.eventFrame[dEventIndex] <= destination) && (dEventIndex < ddata.nEvents) )
-				{
-					processDrumEvent(ddata.eventType[dEventIndex], ddata.eventParam[dEventIndex]);
-					dEventIndex++;
-				}
-				else
-					eventsZappingDone = true;
+				runDrumEvent(*r);
+				r++;
 			}
 			
-			// for each music channel...
-			// zap through until very last note before the seekpoint
-			// including events
-			
-			bool zappingDone = false;
-			
-			while(!zappingDone)
+			if(r->op == SeqRecord::END)
 			{
-
-				// if the next note is end signal, finish this channel
-				if(ddata.drumNote[dNoteIndex] < 0 || dNoteIndex >= ddata.getSize())
-				{
-					dChannelDone = true;
-					restDrum();
-					zappingDone = true;
-				}
-				
-				// if not finished yet, advance note index.. til very last note before destination
-				if(!dChannelDone)
-				{
-					
-					long nextDNoteLen = static_cast<long>( ddata.len[dNoteIndex] );
-					
-					// if adding next note will cause to go past destination, stop here
-					if( ( seekPos + nextDNoteLen ) >= destination )
-					{
-						zappingDone = true;
-						// DEBUG
-						// cout << "Zapping for drum ch done at: " << seekPos << endl;
-						
-						// now set up the channel ready for this note
-						dRemainingFrames = ddata.len[dNoteIndex];
-						currentDrumNote = ddata.drumNote[dNoteIndex];
-						
-						// if it's a rest, hadle accordingly
-						if(currentDrumNote==65535.0)
-							restDrum();
-						else // otherwise we have a note
-							setNewDrumHit(currentDrumNote);
-							
-					}
-					// otherwise it's good to add this next note length
-					else
-					{
-						seekPos += ddata.len[dNoteIndex];
-						dNoteIndex++; // advance to next note
-						dRemainingFrames = ddata.len[dNoteIndex];
-					}
-				}				
+				dChannelDone = true;
+				restDrum();
+			}
+			else
+			{
+				dRemainingFrames = r->value;
+				currentDrumNote = r->drum;
 			}
+			r++;
+			tick = noteEnd + 1;
+			noteStart = noteEnd;
+			noteChanged = true;
+		}
 		
-			// now process this last note
-			bool lastNoteProcessingDone = false;
-			
-			while(!lastNoteProcessingDone)
+		if(!dChannelDone)
+		{
+			while(r->op == SeqRecord::EVENT && r->frame < destination)
 			{
-				// first off, if your channel is done for, exit!
-				if(dChannelDone)
-					lastNoteProcessingDone = true;
-				// if you've reached destination, quit!
-				else if(seekPos >= destination)
-					lastNoteProcessingDone = true;
-				// otherwise advance seekPos and process note
-				else
-				{
-					seekPos++;
-					nosc.advance();
-					dRemainingFrames--;
-				}
+				runDrumEvent(*r);
+				r++;
 			}
+			dRemainingFrames -= destination - tick;
 			
-			// cout << "SEEK done: Drum Channel seekPos = " << seekPos << endl;		
-		
-		// finally all our seeking tasks are done!
-		seekDone = true;
+			if(noteChanged)
+			{
+				setNewDrumHit(currentDrumNote);
+				if(currentDrumNote == 65535)
+					restDrum();
+			}
+			for(long f=noteStart; f<destination; f++)
+				nosc.advance();
+		}
+		dStreamIndex = r - &ddata.stream[0];
 	}
 	
 	framePos = destination;
+	alignMusicEvents();
 	// cout << "SEEK done: Player advanced to position " << framePos << endl;
 }
 
@@ -6744,6 +10180,476 @@ bool MPlayer::isSongFinished()
 void MPlayer::bindSFX(SFX *sfxObj)
 	{ sfx = sfxObj; }
 
+// hand another player to this one to be mixed into its stream as track n (1 to N_TRACKS-1)
+// - that player never opens an audio device of its own
+void MPlayer::attachTrack(int n, MPlayer* player)
+{
+	if(n < 1 || n >= N_TRACKS)
+		return;
+	player->playing = false;
+	track[n].store(player, std::memory_order_release); // (the audio and render threads see it built)
+}
+
+// the rendering side (audio callback, or render thread in render-ahead mode), once a buffer / block:
+// where each track is, for the loader thread to aim a live edit at (see prepareSwap())
+void MPlayer::publishTrackPositions()
+{
+	for(int t=0; t<N_TRACKS; t++)
+	{
+		MPlayer* p = track[t].load(std::memory_order_acquire);
+		if(p == NULL)
+			continue;
+		p->publishedFramePos.store((p->playing && !p->songFinished) ? p->framePos : -1, std::memory_order_relaxed);
+		p->publishedTempoScale.store(p->tempoScale, std::memory_order_relaxed);
+		p->publishedBeatFrames.store(p->beatFrames, std::memory_order_relaxed);
+		p->publishedMeasureFrames.store(p->measureFrames, std::memory_order_relaxed);
+	}
+}
+
+// track n's player - NULL if nothing is attached there
+MPlayer* MPlayer::getTrack(int n)
+	{ return track[n].load(std::memory_order_acquire); }
+
+// queue a start / stop / fade request for track n (game thread)
+// returns false if the request queue is full
+bool MPlayer::sendTrackCommand(int n, int type, int boundary, float gain, long fadeFrames, bool stopWhenSilent)
+{
+	TrackCommand c;
+	c.track = n;
+	c.type = type;
+	c.boundary = boundary;
+	c.gain = gain;
+	c.fadeFrames = fadeFrames;
+	c.stopWhenSilent = stopWhenSilent;
+	c.channel = -1;
+	c.cents = 0;
+	return queueTrackCommand(c);
+}
+
+// queue a transpose for track n - channel 0 - 8 or -1 for the whole song (game thread)
+// lands at the start of the next buffer the callback renders
+bool MPlayer::sendTransposeCommand(int n, int channel, int cents)
+{
+	TrackCommand c;
+	c.track = n;
+	c.type = TrackCommand::TRANSPOSE;
+	c.boundary = TrackCommand::NOW;
+	c.gain = 1.0f;
+	c.fadeFrames = 0;
+	c.stopWhenSilent = false;
+	c.channel = channel;
+	c.cents = cents;
+	return queueTrackCommand(c);
+}
+
+// game thread side of the request queue - false if it's full
+bool MPlayer::queueTrackCommand(const TrackCommand &c)
+{
+	if(c.track < 0 || c.track >= N_TRACKS || getTrack(c.track) == NULL)
+		return false;
+	
+	int w = trackWriteIndex.load(std::memory_order_relaxed);
+	int next = (w + 1) % TRACK_QUEUE_SIZE;
+	if(next == trackReadIndex.load(std::memory_order_acquire))
+		return false; // full
+	
+	trackQueue[w] = c;
+	trackQueue[w].frame = 0;
+	trackWriteIndex.store(next, std::memory_order_release);
+	return true;
+}
+
+// audio callback - take queued track requests and work out the stream frame for each
+void MPlayer::collectTrackCommands()
+{
+	int r = trackReadIndex.load(std::memory_order_relaxed);
+	int w = trackWriteIndex.load(std::memory_order_acquire);
+	
+	while(r != w && nPendingTrackCommands < TRACK_QUEUE_SIZE)
+	{
+		TrackCommand &c = pendingTrackCommand[nPendingTrackCommands];
+		c = trackQueue[r];
+		c.frame = getBoundaryStreamFrame(c.boundary);
+		nPendingTrackCommands++;
+		r = (r + 1) % TRACK_QUEUE_SIZE;
+	}
+	trackReadIndex.store(r, std::memory_order_release);
+}
+
+// audio callback - carry out the track requests due at this stream frame (in queued order)
+void MPlayer::fireTrackCommands()
+{
+	int kept = 0;
+	for(int i=0; i<nPendingTrackCommands; i++)
+	{
+		TrackCommand &c = pendingTrackCommand[i];
+		if(c.frame > streamPos)
+		{
+			pendingTrackCommand[kept] = c;
+			kept++;
+			continue;
+		}
+		
+		MPlayer* p = track[c.track].load(std::memory_order_acquire);
+		if(c.type == TrackCommand::START)
+		{
+			p->goToBeginning();
+			p->trackGain = c.gain;
+			p->trackFadeFramesLeft = 0;
+			p->playing = true;
+		}
+		else if(c.type == TrackCommand::STOP)
+			p->playing = false;
+		else if(c.type == TrackCommand::FADE)
+			p->startFade(c.gain, c.fadeFrames, c.stopWhenSilent);
+		else if(c.type == TrackCommand::TEMPO)
+			p->setTempoScale(c.gain, c.fadeFrames);
+		else if(c.type == TrackCommand::TRANSPOSE && c.channel < 0)
+			p->setTranspose(0, c.cents);
+		else if(c.type == TrackCommand::TRANSPOSE)
+			p->setChannelTranspose(c.channel, 0, c.cents);
+	}
+	nPendingTrackCommands = kept;
+}
+
+// stream frame where the next beat / measure of the leading track lands
+// (the leading track is the first one playing - the main song if it's on)
+long MPlayer::getBoundaryStreamFrame(int boundary)
+{
+	if(boundary == TrackCommand::NOW)
+		return streamPos;
+	
+	for(int t=0; t<N_TRACKS; t++)
+	{
+		MPlayer* p = track[t].load(std::memory_order_acquire);
+		if(p == NULL || !p->playing)
+			continue;
+		
+		return streamPos + p->streamFramesToBoundary(boundary);
+	}
+	return streamPos;
+}
+
+// output frames until this player's own next beat / measure - 0 if it isn't playing
+long MPlayer::streamFramesToBoundary(int boundary)
+{
+	if(boundary == TrackCommand::NOW || !playing)
+		return 0;
+	
+	long len = (boundary == TrackCommand::BEAT) ? beatFrames : measureFrames;
+	if(len <= 0)
+		return 0;
+	long next = (framePos + len - 1) / len * len; // right on the boundary counts
+	return static_cast<long>( ceil((next - framePos) / tempoScale) );
+}
+
+// audio callback - see if any track has a song waiting to be swapped in, and work out when
+void MPlayer::collectIncomingSongs()
+{
+	for(int t=0; t<N_TRACKS; t++)
+	{
+		MPlayer* p = track[t].load(std::memory_order_acquire);
+		if(p == NULL || p->songSwapFrame >= 0)
+			continue;
+		
+		MPlayer* song = p->incomingSong.load(std::memory_order_acquire);
+		if(song == NULL)
+			continue;
+		
+		// a paused track takes it right away
+		p->songSwapFrame = streamPos + p->streamFramesToBoundary(song->songSwapBoundary);
+		nSongSwapsPending++;
+	}
+}
+
+// audio callback - swap in the songs due at this stream frame
+// (a live edit of a playing track - when the track gets to the frame the loader got it ready for)
+void MPlayer::fireSongSwaps()
+{
+	for(int t=0; t<N_TRACKS; t++)
+	{
+		MPlayer* p = track[t].load(std::memory_order_acquire);
+		if(p == NULL || p->songSwapFrame < 0)
+			continue;
+		
+		MPlayer* song = p->incomingSong.load(std::memory_order_relaxed);
+		bool due;
+		if(song->songSwapSongFrame >= 0 && p->playing && !p->songFinished)
+			due = p->framePos >= song->songSwapSongFrame || p->framePos < song->songSwapFromFrame; // (or looped back)
+		else
+			due = p->songSwapFrame <= streamPos;
+		if(due)
+		{
+			p->adoptIncomingSong();
+			nSongSwapsPending--;
+		}
+	}
+}
+
+// audio callback - the incoming song becomes this player's song
+// data is traded, not copied - the old song goes back out in the incoming player
+// (the loader got the song's state ready already - prepareSwap() - so this is just copying)
+void MPlayer::adoptIncomingSong()
+{
+	MPlayer* song = incomingSong.load(std::memory_order_relaxed);
+	songSwapFrame = -1;
+	if(song == NULL)
+		return;
+	
+	long pos = framePos;
+	bool keepPosition = song->songSwapSongFrame >= 0 && playing && !songFinished;
+	bool looped = keepPosition && pos < song->songSwapFromFrame;
+	
+	// keep each oscillator's last output so popguard smooths over the splice
+	float lastAmp[9];
+	for(int i=0; i<9; i++)
+		lastAmp[i] = osc[i].lastAmp;
+	
+	takeSongSettings(song);
+	
+	if(keepPosition)
+	{
+		// carries on as if the new song had been playing all along (at the game's tempo / key)
+		if(!looped)
+			loadState(song->songSwapState);
+		else if(loopStateReady)
+			loadState(loopState);
+		else
+			loadState(song->songTopState);
+		
+		for(int i=0; i<9; i++)
+		{
+			osc[i].lastAmp = lastAmp[i];
+			if(transposeRatio[i] != 1.0)
+				retuneChannel(i);
+		}
+		
+		// the track may have stepped a frame or so past it (tempo up, render-ahead blocks)
+		while(!looped && framePos < pos && framePos < songLastFrame)
+		{
+			sequenceFrame();
+			framePos++;
+			advance();
+		}
+	}
+	else
+	{
+		// from the top at the song's own tempo, key and level - the loader cleared its delay
+		resetRuntimeSettings();
+		delay[0].swapBuffers(song->delay[0]);
+		delay[1].swapBuffers(song->delay[1]);
+		loadState(song->songTopState);
+	}
+	songFinished = false;
+	alignMusicEvents();
+	
+	incomingSong.store(NULL, std::memory_order_relaxed);
+	outgoingSong.store(song, std::memory_order_release);
+}
+
+// loader thread - get this (incoming) song ready to be swapped into target, so all the audio
+// callback has left to do is copy: its state at the top and - for a live edit of a playing track -
+// its state a little ahead of the track (on the next beat / measure after, if asked) - seeked here
+void MPlayer::prepareSwap(MPlayer* target)
+{
+	goToBeginning();
+	saveState(songTopState);
+	songSwapSongFrame = -1;
+	if(!songSwapKeepPosition)
+		return;
+	
+	long boundaryLen = 0;
+	if(songSwapBoundary == TrackCommand::BEAT)
+		boundaryLen = target->publishedBeatFrames.load();
+	else if(songSwapBoundary == TrackCommand::MEASURE)
+		boundaryLen = target->publishedMeasureFrames.load();
+	
+	// if the track gets there before the seek is done, aim further ahead
+	// (where the track is comes from what the rendering side publishes - see publishTrackPositions())
+	long margin = static_cast<long>(SWAP_MARGIN_FRAMES * max(1.0, target->publishedTempoScale.load()));
+	long lastFrame = getSongLastFramePure();
+	while(target->publishedFramePos.load() >= 0)
+	{
+		long from = target->publishedFramePos.load();
+		long aim = from + margin;
+		if(boundaryLen > 0)
+			aim = (aim + boundaryLen - 1) / boundaryLen * boundaryLen;
+		if(aim >= lastFrame)
+			return; // the new song is over by then - it goes in from the top
+		
+		seek(aim);
+		long now = target->publishedFramePos.load();
+		if(now >= 0 && now < aim)
+		{
+			saveState(songSwapState);
+			songSwapFromFrame = from;
+			songSwapSongFrame = aim;
+			return;
+		}
+		margin *= 2;
+	}
+}
+
+// everything parsing (and prepareLoopState) put into song - the rest of the player stays as it is
+void MPlayer::takeSongSettings(MPlayer* song)
+{
+	for(int i=0; i<9; i++)
+		data[i].swap(song->data[i]);
+	ddata.swap(song->ddata);
+	
+	markerFrame.swap(song->markerFrame);
+	markerId.swap(song->markerId);
+	markerChannel.swap(song->markerChannel);
+	sourceOrigin.swap(song->sourceOrigin);
+	drumHits.swap(song->drumHits); // (nothing freed here - the old bank goes out with song)
+	nosc.useHitBank(drumHits.get());
+	songGeneration++;
+	song->songGeneration++;
+	
+	takeSongParameters(song);
+}
+
+// same - copied, so song keeps its own (for rendering it on a player of its own)
+void MPlayer::copySongSettings(MPlayer* song)
+{
+	for(int i=0; i<9; i++)
+		data[i] = song->data[i];
+	ddata = song->ddata;
+	
+	markerFrame = song->markerFrame;
+	markerId = song->markerId;
+	markerChannel = song->markerChannel;
+	sourceOrigin = song->sourceOrigin;
+	drumHits = song->drumHits;
+	nosc.useHitBank(drumHits.get());
+	songGeneration++;
+	
+	takeSongParameters(song);
+}
+
+// changes whenever the song data here is traded for another's - so the parser can tell
+// the data it left in this player has been replaced since
+unsigned int MPlayer::getSongGeneration()
+	{ return songGeneration.load(std::memory_order_acquire); }
+
+// the rest of the song's settings - gains, tempo, loop, delay
+void MPlayer::takeSongParameters(MPlayer* song)
+{
+	for(int i=0; i<9; i++)
+		setChannelGain(i, song->getChannelGain(i));
+	setDChannelGain(song->getDChannelGain());
+	
+	bookmark = song->bookmark;
+	beatFrames = song->beatFrames;
+	measureFrames = song->measureFrames;
+	
+	loopEnabled = song->loopEnabled;
+	repeatsRemaining = song->repeatsRemaining;
+	loopStartFrame = song->loopStartFrame;
+	loopStateReady = song->loopStateReady;
+	loopState = song->loopState;
+	
+	delayEnabled = song->delayEnabled;
+	delay[0].copyParameters(song->delay[0]);
+	delay[1].copyParameters(song->delay[1]);
+	masterGain = song->masterGain;
+	
+	songLastFrame = getSongLastFrame();
+	songLastFramePure = getSongLastFramePure();
+}
+
+// character position in the song's source of the note / event channel (0 - 8, 9 for drums)
+// starts at frame - -1 if there's none
+int MPlayer::getSourcePosAtFrame(int channel, long frame)
+{
+	if(channel < 0 || channel >= SourceOrigin::N_SECTIONS)
+		return -1;
+	SourceMap &map = (channel < 9) ? data[channel].sourceMap : ddata.sourceMap;
+	int p = map.getPosAtFrame(frame);
+	if(p < 0)
+		return -1;
+	return sourceOrigin.getSourcePos(channel, p);
+}
+
+// song frame of the first note / event at or after a character position in the song's source
+// (in the channel section the position is in - or the next one) - -1 if there's none
+long MPlayer::getFrameAtSourcePos(int sourcePos)
+{
+	int p = 0;
+	int section = sourceOrigin.getSection(sourcePos, p);
+	if(section < 0)
+		return -1;
+	SourceMap &map = (section < 9) ? data[section].sourceMap : ddata.sourceMap;
+	return map.getFrameAtPos(p);
+}
+
+// source line (from 1) of a character position in the song's source
+int MPlayer::getSourceLine(int sourcePos)
+{
+	return sourceOrigin.getSourceLine(sourcePos);
+}
+
+// ramp this track's gain to target over fadeFrames
+void MPlayer::startFade(float target, long fadeFrames, bool stopWhenSilent)
+{
+	trackGainTarget = target;
+	stopWhenFaded = stopWhenSilent;
+	if(fadeFrames <= 0)
+		fadeFrames = 1;
+	trackGainStep = (target - trackGain) / static_cast<float>(fadeFrames);
+	trackFadeFramesLeft = fadeFrames;
+}
+
+// play the song at scale x its tempo (0.25 - 4.0), gliding there over rampFrames
+// note and event timing follow - pitch doesn't
+void MPlayer::setTempoScale(double scale, long rampFrames)
+{
+	tempoScaleTarget = min(MAX_TEMPO_SCALE, max(MIN_TEMPO_SCALE, scale));
+	if(rampFrames <= 0)
+	{
+		tempoScale = tempoScaleTarget;
+		tempoRampFramesLeft = 0;
+		return;
+	}
+	tempoScaleStep = (tempoScaleTarget - tempoScale) / static_cast<double>(rampFrames);
+	tempoRampFramesLeft = rampFrames;
+}
+
+double MPlayer::getTempoScale()
+	{ return tempoScale; }
+
+// one frame of tempo glide
+void MPlayer::updateTempoScale()
+{
+	tempoScale += tempoScaleStep;
+	tempoRampFramesLeft--;
+	if(tempoRampFramesLeft <= 0)
+		tempoScale = tempoScaleTarget;
+}
+
+// back to full level, no fade under way
+void MPlayer::resetTrackGain()
+{
+	trackGain = 1.0f;
+	trackGainTarget = 1.0f;
+	trackGainStep = 0.0f;
+	trackFadeFramesLeft = 0;
+	stopWhenFaded = false;
+}
+
+// one frame of gain ramp
+void MPlayer::updateTrackGain()
+{
+	trackGain += trackGainStep;
+	trackFadeFramesLeft--;
+	if(trackFadeFramesLeft <= 0)
+	{
+		trackGain = trackGainTarget;
+		if(stopWhenFaded && trackGain <= 0.0f)
+			playing = false;
+	}
+}
+
 //void MPlayer::bindSFX(SFX *sfxObj)
 //{ sfx = sfxObj; }
 
@@ -11,6 +11,9 @@ SFX::SFX()
 {
 	compThreshold = 0.6f;
 	compRatio = 5.0f;
+	triggerWriteIndex = 0;
+	triggerReadIndex = 0;
+	nPendingTriggers = 0;
 }
 
 float SFX::getGain(int slot)
@@ -75,6 +78,68 @@ void SFX::resume(int slot)
 		sound[slot].resume();
 }
 
+// queue a start request for a slot - call from the game thread
+// frame is either an absolute stream frame or a song frame (see timeBase)
+// returns false if the slot is invalid or the queue is full
+bool SFX::schedule(int slot, long frame, int timeBase)
+{
+	if(slot < 0 || slot >= N_SLOTS)
+		return false;
+	
+	int writeIndex = triggerWriteIndex.load(std::memory_order_relaxed);
+	int nextIndex = (writeIndex + 1) % N_TRIGGERS;
+	if(nextIndex == triggerReadIndex.load(std::memory_order_acquire)) // ring is full
+		return false;
+	
+	triggerRing[writeIndex].slot = slot;
+	triggerRing[writeIndex].frame = frame;
+	triggerRing[writeIndex].timeBase = timeBase;
+	triggerWriteIndex.store(nextIndex, std::memory_order_release);
+	return true;
+}
+
+// move newly queued triggers into the pending list
+// called once per buffer from the audio callback
+void SFX::collectTriggers()
+{
+	int readIndex = triggerReadIndex.load(std::memory_order_relaxed);
+	int writeIndex = triggerWriteIndex.load(std::memory_order_acquire);
+	
+	while(readIndex != writeIndex && nPendingTriggers < N_TRIGGERS)
+	{
+		pendingTrigger[nPendingTriggers] = triggerRing[readIndex];
+		nPendingTriggers++;
+		readIndex = (readIndex + 1) % N_TRIGGERS;
+	}
+	triggerReadIndex.store(readIndex, std::memory_order_release);
+}
+
+// start every pending slot whose target frame has come
+// called every frame from the audio callback, before getOutput()
+void SFX::fireTriggers(long streamFrame, long songFrame, bool songPlaying)
+{
+	int i = 0;
+	while(i < nPendingTriggers)
+	{
+		bool due;
+		if(pendingTrigger[i].timeBase == SONG_TIME)
+			due = songPlaying && songFrame >= pendingTrigger[i].frame;
+		else
+			due = streamFrame >= pendingTrigger[i].frame;
+		
+		if(due)
+		{
+			sound[pendingTrigger[i].slot].start();
+			
+			// fill the hole with the last one - order doesn't matter
+			nPendingTriggers--;
+			pendingTrigger[i] = pendingTrigger[nPendingTriggers];
+		}
+		else
+			i++;
+	}
+}
+
 // 0 - left, 1 - right
 float SFX::getOutput(int channel)
 {
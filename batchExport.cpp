@@ -0,0 +1,210 @@
+// batchExport.cpp ///////////////////////////////////////
+// exports a whole list of songs at once /////////////////
+//
+// each worker thread takes the next song / format off the list until there is none left
+// and exports it with an engine of its own (a fresh player and a parser - no audio device),
+// so a song comes out the same whichever worker gets it
+// prints each song's time as it finishes, then the total throughput
+// -stats: loudness / peaks too - and a JSON sidecar next to each file (song.ogg.json)
+//
+// usage: batchExport [-j workers] [-f wav,ogg] [-o output folder] [-stats] song.txt ...
+//        (e.g. batchExport -j 4 -f ogg -o export bcsource/*.txt)
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstdio>
+#include "BC/BCPlayer.h"
+
+using namespace std;
+
+// one song to export to one format
+struct ExportJob
+{
+	string source;
+	string target;
+	double seconds;	// time it took
+	double length;	// song length in seconds
+	string result;
+	RenderStats stats;
+};
+
+// song.txt -> <folder>/song.<format> (next to the song if there's no folder)
+static string targetName(const string &source, const string &folder, const string &format)
+{
+	string name = source;
+	size_t slash = name.find_last_of("/\\");
+	size_t dot = name.find_last_of('.');
+	if(dot != string::npos && (slash == string::npos || dot > slash))
+		name = name.substr(0, dot);
+
+	if(!folder.empty())
+	{
+		if(slash != string::npos)
+			name = name.substr(slash + 1);
+		name = folder + "/" + name;
+	}
+	return name + "." + format;
+}
+
+// a worker - exports jobs off the shared list until it runs out
+struct ExportWorker
+{
+	vector<ExportJob>* jobs;
+	atomic<int>* nextJob;
+	mutex* printLock;
+	bool writeStats;
+
+	ExportWorker(vector<ExportJob>* j, atomic<int>* n, mutex* p, bool stats)
+		: jobs(j), nextJob(n), printLock(p), writeStats(stats) {}
+
+	void operator()()
+	{
+		MML mml;
+		mml.initialize(44100, 120.0);
+
+		int i = nextJob->fetch_add(1);
+		while(i < static_cast<int>(jobs->size()))
+		{
+			ExportJob &job = (*jobs)[i];
+			chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+			// a new player for every song - nothing carries over from the one before
+			MPlayer* player = new MPlayer();
+			if(!mml.loadSong(job.source, player))
+				job.result = "Error loading file: " + job.source;
+			else
+			{
+				job.length = player->getSongLastFrame() / 44100.0;
+				job.result = player->exportToFile(job.target);
+				job.stats = player->getRenderStats();
+				if(writeStats)
+					player->writeRenderStats(job.target + ".json");
+			}
+			delete player;
+
+			chrono::steady_clock::time_point end = chrono::steady_clock::now();
+			job.seconds = chrono::duration_cast<chrono::duration<double> >(end - start).count();
+
+			{
+				lock_guard<mutex> guard(*printLock);
+				printf("%-40s %7.2f sec  (%6.1fx realtime)  %s\n", job.target.c_str(), job.seconds,
+					job.seconds > 0.0 ? job.length / job.seconds : 0.0, job.result.c_str());
+				if(writeStats)
+					printf("%-40s %7.2f LUFS  %6.2f dBTP  %ld clipped\n", "", job.stats.integratedLoudness,
+						job.stats.truePeak, job.stats.clipCount);
+			}
+
+			i = nextJob->fetch_add(1);
+		}
+	}
+};
+
+int main(int argc, char* argv[])
+{
+	int nWorkers = thread::hardware_concurrency();
+	if(nWorkers < 1)
+		nWorkers = 1;
+	vector<string> formats;
+	string folder = "";
+	bool writeStats = false;
+	vector<string> songs;
+
+	for(int a=1; a<argc; a++)
+	{
+		string arg = argv[a];
+		if(arg == "-j" && a + 1 < argc)
+			nWorkers = atoi(argv[++a]);
+		else if(arg == "-f" && a + 1 < argc)
+		{
+			string list = argv[++a];
+			size_t start = 0;
+			while(start <= list.size())
+			{
+				size_t comma = list.find(',', start);
+				if(comma == string::npos)
+					comma = list.size();
+				if(comma > start)
+					formats.push_back(list.substr(start, comma - start));
+				start = comma + 1;
+			}
+		}
+		else if(arg == "-o" && a + 1 < argc)
+			folder = argv[++a];
+		else if(arg == "-stats")
+			writeStats = true;
+		else
+			songs.push_back(arg);
+	}
+
+	if(songs.empty())
+	{
+		cout << "usage: batchExport [-j workers] [-f wav,ogg] [-o output folder] [-stats] song.txt ...\n";
+		return 1;
+	}
+	if(formats.empty())
+		formats.push_back("wav");
+	if(nWorkers < 1)
+		nWorkers = 1;
+
+	vector<ExportJob> jobs;
+	for(size_t s=0; s<songs.size(); s++)
+	{
+		for(size_t f=0; f<formats.size(); f++)
+		{
+			ExportJob job;
+			job.source = songs[s];
+			job.target = targetName(songs[s], folder, formats[f]);
+			job.seconds = 0.0;
+			job.length = 0.0;
+			job.stats = RenderStats();
+			jobs.push_back(job);
+		}
+	}
+	// two songs of the same name from different folders would land on one file (-o)
+	for(size_t j=0; j<jobs.size(); j++)
+	{
+		for(size_t k=0; k<j; k++)
+		{
+			if(jobs[k].target == jobs[j].target)
+			{
+				cout << jobs[k].source << " and " << jobs[j].source << " would both export to "
+					<< jobs[j].target << " - export them to separate folders\n";
+				return 1;
+			}
+		}
+	}
+
+	if(nWorkers > static_cast<int>(jobs.size()))
+		nWorkers = jobs.size();
+
+	cout << jobs.size() << " exports on " << nWorkers << " workers\n";
+
+	atomic<int> nextJob(0);
+	mutex printLock;
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+	vector<thread> workers;
+	for(int w=0; w<nWorkers; w++)
+		workers.push_back(thread(ExportWorker(&jobs, &nextJob, &printLock, writeStats)));
+	for(int w=0; w<nWorkers; w++)
+		workers[w].join();
+
+	chrono::steady_clock::time_point end = chrono::steady_clock::now();
+	double total = chrono::duration_cast<chrono::duration<double> >(end - start).count();
+
+	double audio = 0.0;
+	for(size_t j=0; j<jobs.size(); j++)
+		audio += jobs[j].length;
+
+	printf("total: %d exports, %.1f sec of audio in %.2f sec  (%.1fx realtime, %.2f songs/sec)\n",
+		static_cast<int>(jobs.size()), audio, total, total > 0.0 ? audio / total : 0.0,
+		total > 0.0 ? jobs.size() / total : 0.0);
+
+	return 0;
+}
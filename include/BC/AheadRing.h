@@ -0,0 +1,55 @@
+// AheadRing.h ///////////////////////////////////////////
+// AheadRing Class - Definition //////////////////////////
+
+#ifndef AHEADRING_H
+#define AHEADRING_H
+
+#include <vector>
+#include <atomic>
+
+// one frame of music rendered ahead - and where the song was when it was rendered
+struct AheadFrame
+{
+	float left;
+	float right;
+	long songFrame;
+	bool songPlaying;
+	long trackFrame[3];		// tracks 1 - 3 (of MPlayer::N_TRACKS) - where they were ...
+	bool trackPlaying[3];
+	float gain;				// master volume it was rendered at ...
+	int volumeChange;		// ... and how many volume changes it came after
+	int events;				// music events posted while rendering it
+};
+
+// render-ahead mode - carries frames from the render thread to the audio callback
+// one writer, one reader, no locks: positions only ever count up (slot = position % capacity)
+// a flush moves the reader on to dropPos - everything queued before it is skipped
+class AheadRing
+{
+
+public:
+
+	AheadRing(int capacity);
+	~AheadRing();
+
+	int getQueued();
+	int getSpace();
+	void put(const AheadFrame &frame);
+	bool get(AheadFrame &frame);
+	const AheadFrame& at(long pos);
+	long getReadPos();
+	long getWritePos();
+	long getDropPos();
+	void dropTo(long pos);
+	void skipTo(long pos);
+
+private:
+
+	std::vector<AheadFrame> frames;
+	std::atomic<long> writePos;	// render thread's
+	std::atomic<long> readPos;	// callback's
+	std::atomic<long> dropPos;	// flush - callback skips to here
+
+};
+
+#endif
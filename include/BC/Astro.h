@@ -14,15 +14,14 @@ public:
 	int frameCount;
 	int oneCycleFrames;
 	int middlePoint;
-	double processedFrequency;
-	bool statusChanged;
 
 	Astro();
 	~Astro();
 
 	void setSpeed(int nCyclesPerSecond);
-	double process(double freq);
-	bool stateChanged();
+	double getOctaves();
+	int framesToNextStep();
+	void skip(int frames);
 	void refresh();
 };
 
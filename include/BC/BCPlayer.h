@@ -5,8 +5,12 @@
 #define BCPLAYER_H
 
 #include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
 #include "BC/MPlayer.h"
 #include "BC/MML.h"
+#include "BC/Trace.h"
 
 class MPlayer;
 class MML;
@@ -18,9 +22,14 @@ public:
 	MPlayer mplayer;
 	MML mml;
 	SFX sfx;
+	
+	MML loaderMML; // parses songs loaded in the background
+	std::thread loaderThread;
+	std::atomic<bool> loaderBusy;
+	MPlayer* loaderTarget; // track the last background load went to
 
 	BCPlayer();
-	~BCPlayer(){}
+	~BCPlayer();
 	
 	bool initialize();
 	void terminate();
@@ -29,15 +38,27 @@ public:
 	std::string loadFileToString(const std::string &filename);
 	void loadString(const std::string &source);
 	void startMusic();
+	bool startMusicAtSourcePos(int sourcePos);
+	int getPlayingSourcePos(int channel);
+	int getSourceLine(int sourcePos);
 	void stopMusic();
 	void pauseMusic();
 	void restartMusic();
 	void enableLooping();
 	void disableLooping();
+	void enableLoopPoint();
+	void disableLoopPoint();
+	bool startRenderAhead(int lookaheadMs);
+	void stopRenderAhead();
 	bool musicFinished();
 	void setMusicVolume(float percent);
 	float getMusicVolume();
 	void seek(float percent);
+	long renderToBuffer(float* buffer, long startFrame, long endFrame);
+	long renderToBuffer(short* buffer, long startFrame, long endFrame);
+	long renderToBuffer(std::vector<float> &pcm);
+	long renderToBuffer(std::vector<short> &pcm);
+	MPlayer* newRenderPlayer();
 	
 	std::string loadSFX(int slot, std::string filename);
 	void setSFXVolume(int slot, int volumePercent);
@@ -48,6 +69,36 @@ public:
 	void stopSFX(int slot);
 	void pauseSFX(int slot);
 	void resumeSFX(int slot);
+	bool scheduleSFX(int slot, long streamFrame);
+	bool scheduleSFXAtSongFrame(int slot, long songFrame);
+	long getStreamFrame();
+	long getNextBeatFrame();
+	bool pollMusicEvent(MusicEvent &e);
+	void clearMusicEvents();
+	
+	MPlayer* getTrackPlayer(int n);
+	bool loadTrack(int n, const std::string &fileName);
+	bool loadTrackString(int n, const std::string &source);
+	bool startTrack(int n, int boundary);
+	bool stopTrack(int n, int boundary);
+	bool fadeTrack(int n, float volumePercent, float seconds, int boundary);
+	bool crossfadeTracks(int from, int to, float seconds, int boundary);
+	bool setTempo(float percent, float seconds);
+	bool setTrackTempo(int n, float percent, float seconds, int boundary);
+	float getTempo();
+	void setTranspose(int semitones, int cents);
+	void setChannelTranspose(int channel, int semitones, int cents);
+	bool trackIsLoaded(int n);
+	bool trackIsPlaying(int n);
+	bool loadTrackAsync(int n, const std::string &fileName, int boundary);
+	bool loadTrackStringAsync(int n, const std::string &source, int boundary, bool keepPosition);
+	bool musicLoading();
+	bool finishLoad();
+	bool finishSwap(MPlayer* p);
+	bool loadTrackNow(int n, const std::string &source, bool isFile);
+	MPlayer* newIncomingSong(MPlayer* p, int boundary, bool keepPosition);
+	bool prepareSong(MPlayer* song, MPlayer* target, const std::string &source, bool isFile);
+	void parseInBackground(MPlayer* song, std::string source, bool isFile);
 	
 };
 
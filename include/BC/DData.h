@@ -5,6 +5,8 @@
 #define DDATA_H
 
 #include <vector>
+#include "SourceMap.h"
+#include "SeqRecord.h"
 
 class DData
 {
@@ -24,10 +26,15 @@ public:
 	std::vector<long> eventFrame;
 	int nEvents;
 	
+	std::vector<SeqRecord> stream; // what the sequencer plays - built from the vectors above
+	SourceMap sourceMap; // where in the source each note / event came from
+	
 	DData();
 	DData(int sRate);
 	~DData();
 	void clear();
+	void buildStream();
+	void swap(DData &other);
 	int getSize();
 
 private:
@@ -34,6 +34,8 @@ public:
 
 	void clearBuffer();
 	void setParameters(int firstDelayTime, int delayTime, float delayGain);
+	void copyParameters(const DelayLine &other);
+	void swapBuffers(DelayLine &other);
 	float update(float input);
 };
 
@@ -0,0 +1,56 @@
+// Envelope.h ////////////////////////////////////////////
+// Envelope Class - Definition ///////////////////////////
+
+#ifndef ENVELOPE_H
+#define ENVELOPE_H
+
+// attack - peak - decay - sustain - release, as a chain of precomputed segments
+// each segment is a per-frame ramp (level = level * mul + add) and a frame count,
+// so a frame costs one multiply-add - the exact level is worked out only when a segment starts
+// (shared by OSC's note envelope and NOSC's drum envelopes - drums just have no sustain / release)
+class Envelope
+{
+
+public:
+
+	static const int ATTACK = 0;
+	static const int PEAK = 1;
+	static const int DECAY = 2;
+	static const int SUSTAIN = 3;
+	static const int RELEASE = 4;
+	static const int DONE = 5;
+
+	int nAttackFrames;
+	int nPeakFrames;
+	int nDecayFrames;
+	int nReleaseFrames;
+	float peakLevel;
+	float sustainLevel;
+	bool exponential;	// decay / release as exponential curves (linear by default)
+
+	int stage;
+	int pos;			// frames since note on (attack to sustain) or since note off (release)
+	int remaining;		// frames left in the current segment (-1 = holds)
+	double level;		// current output (double, so long ramps don't drift)
+	double mul;			// per frame ramp
+	double add;
+
+	Envelope();
+	~Envelope(){}
+
+	void setShape(int attack, int peak, int decay, int release, float peakLV, float sustainLV);
+	void setExponential(bool exp);
+	void reshape();
+	void noteOn();
+	void noteOff();
+	void advance();
+	float getOutput();
+
+private:
+
+	void enterSegment();
+	double curve(int frames);
+
+};
+
+#endif
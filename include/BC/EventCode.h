@@ -0,0 +1,80 @@
+// EventCode.h ///////////////////////////////////////////
+// EventCode - MML events lowered for the sequencer //////
+
+#ifndef EVENTCODE_H
+#define EVENTCODE_H
+
+#include "SeqRecord.h"
+
+// the event types the MML parser writes (0 = VOLUME, 1000 = DEFAULTTONE, 510 = KICKPITCH...)
+// are sparse - when a channel's stream is built each one is lowered to a small dense opcode,
+// with its parameter already converted to what the oscillator takes,
+// so MPlayer runs an event with one jump-table switch and no arithmetic
+class EventCode
+{
+
+public:
+
+	// music channels (ch 1 - 9)
+	static const short NOP = 0;
+	static const short VOLUME = 1;			// level = gain (0.0 - 0.5)
+	static const short VOLUME_UP = 2;
+	static const short VOLUME_DOWN = 3;
+	static const short WAVEFORM = 4;		// value = wave table number
+	static const short WAVEFLIP = 5;
+	static const short PRESET_BEEP = 6;		// DEFAULTTONE is the same
+	static const short PRESET_POPPY = 7;
+	static const short PRESET_POPPYVIB = 8;
+	static const short PRESET_BELL = 9;
+	static const short ATTACKTIME = 10;		// value = frames
+	static const short PEAKTIME = 11;		// value = frames
+	static const short DECAYTIME = 12;		// value = frames
+	static const short RELEASETIME = 13;	// value = frames
+	static const short PEAKLEVEL = 14;		// level = 0.0 - 1.0
+	static const short SUSTAINLEVEL = 15;	// level = 0.0 - 1.0
+	static const short LFO_ON = 16;
+	static const short LFO_OFF = 17;
+	static const short LFORANGE = 18;		// value = cents
+	static const short LFOSPEED = 19;		// value = cycles per second
+	static const short LFOWAIT = 20;		// value = milliseconds
+	static const short ASTRO = 21;			// value = astro speed
+	static const short ASTRO_OFF = 22;
+	static const short FALL = 23;
+	static const short FALLSPEED = 24;
+	static const short FALLWAIT = 25;
+	static const short RISE = 26;
+	static const short RISESPEED = 27;
+	static const short RISERANGE = 28;
+	static const short BEEFUP = 29;			// level = beef-up factor
+	static const short BEEFUP_OFF = 30;
+	static const short RINGMOD = 31;		// value = feeder channel (0 - 8)
+	static const short RINGMOD_OFF = 32;
+
+	// drum channel
+	static const short DRUM_NOP = 0;
+	static const short DRUM_VOLUME = 1;			// level = gain (0.0 - 0.5)
+	static const short DRUM_VOLUME_UP = 2;
+	static const short DRUM_VOLUME_DOWN = 3;
+	static const short DRUM_RESET = 4;
+	static const short DRUM_KICKPITCH = 5;		// value = 0 - 100 (scale)
+	static const short DRUM_SNAREPITCH = 6;		// value = 0 - 100 (scale)
+	static const short DRUM_HIHATPITCH = 7;		// value = 0 - 100 (scale)
+	static const short DRUM_BEEFUP = 8;			// level = beef-up factor
+	static const short DRUM_BEEFUP_OFF = 9;
+	static const short DRUM_WHITENOISE = 10;
+	static const short DRUM_PINKNOISE = 11;
+	static const short DRUM_KICKNOISE = 12;		// value = noise type
+	static const short DRUM_SNARENOISE = 13;
+	static const short DRUM_HIHATNOISE = 14;
+	static const short DRUM_KICKLENGTH = 15;	// value = milliseconds
+	static const short DRUM_SNARELENGTH = 16;
+	static const short DRUM_HIHATLENGTH = 17;
+	static const short DRUM_SQUARELEVEL = 18;	// level = 0.0 - 1.0
+	static const short DRUM_NOISELEVEL = 19;	// level = 0.0 - 1.0
+
+	static void lower(int eType, int eParam, SeqRecord &r);
+	static void lowerDrum(int eType, int eParam, SeqRecord &r);
+
+};
+
+#endif
@@ -0,0 +1,41 @@
+// ExportPipe.h //////////////////////////////////////////
+// ExportPipe Class - Definition /////////////////////////
+
+#ifndef EXPORTPIPE_H
+#define EXPORTPIPE_H
+
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+
+// carries rendered chunks from the render thread to the encoder thread
+// a fixed pool of chunk buffers goes round - render fills one, the encoder writes it out and
+// hands it back - so synthesis and encoding overlap, and nothing is allocated per chunk
+class ExportPipe
+{
+
+public:
+
+	ExportPipe(int nChunks, int chunkSize);
+	~ExportPipe();
+
+	float* getEmpty();
+	void putFull(float* chunk, int nFrames);
+	float* getFull(int &nFrames);
+	void putEmpty(float* chunk);
+
+private:
+
+	std::vector<float> pool;		// nChunks * chunkSize floats
+	std::vector<float*> empty;		// chunks free for rendering
+	std::vector<float*> full;		// rendered chunks waiting for the encoder, in order (ring)
+	std::vector<int> fullFrames;	// ... and how many frames each holds (0 = end of the song)
+	int fullRead;
+	int nFull;
+	std::mutex lock;
+	std::condition_variable emptyReady;
+	std::condition_variable fullReady;
+
+};
+
+#endif
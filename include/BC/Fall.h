@@ -23,12 +23,13 @@ public:
 
 	void setToDefault();
 	double getDeltaPerFrame(double fSpeed);
-	double setSpeed(double fSpeed);
-	double setWaitTime(double waitTimeSec);
+	void setSpeed(double fSpeed);
+	void setWaitTime(double waitTimeSec);
 	void refresh();
 	void start();
 	void stop();
-	double process(double freq);
+	double getOctaves();
+	void skip(int frames);
 
 };
 
@@ -58,7 +59,8 @@ public:
 	void refresh();
 	void start();
 	void stop();
-	double process(double freq);
+	double getOctaves();
+	void skip(int frames);
 
 };
 
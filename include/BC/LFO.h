@@ -11,7 +11,7 @@ class LFO
 	static const double LFO_SAMPLE_RATE;
 	static const int LFO_TABLE_SIZE;
 	static const double LFO_TWO_PI;
-	std::vector<float> table;
+	const float* table; // shared sine table
 	
 public:
 
@@ -29,11 +29,14 @@ public:
 	
 	void initialize();
 	void setTable(int type);
+	static const float* getSineTable();
+	static std::vector<float> buildSineTable();
 	void setWaitTime(int milliseconds);
 	void setRange(int cents);
 	void setSpeed(double cyclesPerSeconds);
 	void refresh();
-	double process(double originalFreq);
+	double getOctaves();
+	void skip(int frames);
 	
 private:	
 	
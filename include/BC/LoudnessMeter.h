@@ -0,0 +1,65 @@
+// LoudnessMeter.h ///////////////////////////////////////
+// LoudnessMeter Class - Definition //////////////////////
+
+#ifndef LOUDNESSMETER_H
+#define LOUDNESSMETER_H
+
+#include <vector>
+
+// what a render / export measured - levels to normalize songs by
+struct RenderStats
+{
+	static const int N_CHANNELS = 11;
+	
+	long frames;
+	double integratedLoudness;	// LUFS (ITU-R BS.1770 / EBU R128, gated) - -HUGE_VAL if all silence
+	double truePeak;			// dBTP (4x oversampled)
+	double samplePeak;			// dBFS
+	double rms[2];				// dBFS - left / right
+	double channelRMS[N_CHANNELS];	// dBFS - @1 - @9, drums, delay echo: each one's share of the mix (both sides)
+	long clipCount;				// samples the master limiter (masterOutCap) cut down
+};
+
+// measures stereo 44100hz float chunks as they go by - one pass, kept per 100 msec
+// loudness: K-weighting filter, 400 msec blocks overlapping by 75%, -70 LUFS / -10 LU gates
+class LoudnessMeter
+{
+
+public:
+
+	static const double PI;
+	static const int TAPS = 12;		// per phase of the true peak interpolator
+	static const int SUB_BLOCK = 4410;	// 100 msec
+
+	LoudnessMeter();
+	~LoudnessMeter(){}
+
+	void reset();
+	void process(const float* buffer, int nFrames);
+	RenderStats getStats();
+
+private:
+
+	void processChannel(const float* in, int n, int c);
+
+	double shelfB[3], shelfA[3];	// K-weighting - high shelf ...
+	double passB[3], passA[3];		// ... then high pass
+	double state[2][4];				// per channel - each stage's two filter states
+	double phase[3][TAPS];			// true peak interpolator - the 3 points between samples
+	double phaseGain;				// ... the most it can come out above the samples it's given
+	float history[2][TAPS * 2];		// per channel - the last TAPS samples, twice over (no wrapping)
+	int historyPos;
+
+	double blockSum[2];		// this 100 msec sub-block's weighted sum of squares
+	int blockFrames;
+	std::vector<double> subBlocks;	// every finished sub-block (both channels, mean square)
+
+	long frames;
+	double sumSquares[2];
+	double peak;
+	double truePeak;
+	int sinceLoud[2];	// per channel - samples since one that could take the true peak higher
+
+};
+
+#endif
@@ -5,6 +5,8 @@
 #define MDATA_H
 
 #include <vector>
+#include "SourceMap.h"
+#include "SeqRecord.h"
 
 class MData
 {
@@ -22,6 +24,9 @@ public:
 	std::vector<long> eventFrame;
 	int nEvents;
 	
+	std::vector<SeqRecord> stream; // what the sequencer plays - built from the vectors above
+	SourceMap sourceMap; // where in the source each note / event came from
+	
 	long totalFrames;
 	int sampleRate;
 	
@@ -29,6 +34,8 @@ public:
 	MData(int sRate);
 	~MData();
 	void clear();
+	void buildStream();
+	void swap(MData &other);
 	int getSize();
 
 private:
@@ -13,6 +13,8 @@ class MPlayer;
 // include dependencies
 
 #include <string>
+#include <vector>
+#include "SourceMap.h"
 
 class MML
 {
@@ -20,6 +22,8 @@ class MML
 public:
 
 	static const int N_EVENT_TAGS = 256;
+	static const int N_SECTIONS = 10; // @1 - @9 and @D
+	static const std::string LOAD_ERROR; // what loadFile() returns when the file can't be read
 
 	// constructor
 	MML();
@@ -30,11 +34,19 @@ public:
 
 	std::string setSource(std::string masterStr);
 	std::string getSource();
+	void mapCleanSource(const std::string &str);
 	std::string takeOutComments(std::string masterStr);
 	std::string takeOutSpaces(std::string str);
 	std::string loadFile(std::string filename, MPlayer* player);
+	bool loadSong(std::string filename, MPlayer* player);
 	std::string saveFile(std::string filename, MPlayer* player);
 	std::string parse(MPlayer* player);
+	std::string parseChanged(MPlayer* player);
+	int getSectionsParsed();
+	void beginParse(MPlayer* player);
+	void parseSection(MPlayer* player, int section);
+	void finishParse(MPlayer* player);
+	static unsigned long long hashSection(const std::string &str);
 	std::string parseChannelSource(MPlayer* player, int channel);
 	std::string parseDrumSource(MPlayer* player);
 	void parseGlobalSource(MPlayer* player);
@@ -59,6 +71,7 @@ public:
 	std::string source[9];
 	std::string dsource;
 	std::string gsource;
+	SourceOrigin origin; // where source[] / dsource were in originalSource - handed to the player parsed
 	
 	double tempo;
 	double sampleRate;
@@ -77,6 +90,17 @@ public:
 	double middleC;
 	double cZero;
 	
+	// what the last parse looked like - so parseChanged() can skip unchanged sections
+	MPlayer* hashPlayer;
+	unsigned int hashGeneration; // hashPlayer's song generation then - a swap since means its data is another song's
+	unsigned long long globalHash;
+	unsigned long long sectionHash[N_SECTIONS];
+	long sectionBookmark[N_SECTIONS];
+	long sectionLoopStart[N_SECTIONS];
+	int channelEndNoteLength; // note length left over after @9 - drums start with it
+	int drumStartNoteLength;
+	int nSectionsParsed;
+	
 private:
 	
 };
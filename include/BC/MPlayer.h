@@ -13,23 +13,85 @@ class NOSC;
 class DelayLine;
 
 #include <string>
+#include <vector>
+#include <atomic>
+#include <cstdio>
+#include <thread>
+#include <mutex>
+#include <memory>
 #include "OSC.h"
 #include "NOSC.h"
 #include "DelayLine.h"
 #include "MData.h"
 #include "DData.h"
+#include "EventCode.h"
+#include "MusicEvent.h"
+#include "AheadRing.h"
+#include "LoudnessMeter.h"
 #include "BC/portaudio.h"
 
 #include "SFX.h"
 
 //#include "SFX.h"
 
+// everything the sequencer needs to carry on playing from one particular frame
+// (captured once at the loop start - restored every time the song loops)
+struct PlayerState
+{
+	OSC osc[9];
+	NOSC nosc;
+	long framePos;
+	bool enabled[9];
+	bool dEnabled;
+	bool ringModEnabled[9];
+	int ringModFeed[9];
+	bool ringModMute[9];
+	bool channelDone[9];
+	bool dChannelDone;
+	int remainingFrames[9];
+	int dRemainingFrames;
+	double freqNote[9];
+	int streamIndex[9];
+	int dStreamIndex;
+	int currentDrumNote;
+};
+
+// game thread's request to start / stop / fade / retune one of the music tracks
+// (resolved to a stream frame by the audio callback, like SFX triggers)
+struct TrackCommand
+{
+	static const int START = 0;
+	static const int STOP = 1;
+	static const int FADE = 2;
+	static const int TEMPO = 3;
+	static const int TRANSPOSE = 4;
+	
+	static const int NOW = 0; // when it should happen
+	static const int BEAT = 1; // ... on the next beat of the leading track
+	static const int MEASURE = 2; // ... on the next measure of the leading track
+	
+	int track;
+	int type;
+	int boundary;
+	float gain; // START - gain to start with / FADE - gain to end up with / TEMPO - tempo scale
+	long fadeFrames; // FADE and TEMPO - frames to get there
+	bool stopWhenSilent; // FADE to 0 - stop the track once it's silent
+	int channel; // TRANSPOSE - channel (0 - 8), -1 = the whole song
+	int cents; // TRANSPOSE - in cents (100 per semitone)
+	long frame; // stream frame to act on - filled in by the audio callback
+};
+
+// sink for MPlayer::exportToStream() - gets the song's bytes in order, returns how many it took
+// (fewer than it was given = the sink failed, export stops)
+typedef long (*PCMWriteFunc)(const char* data, long bytes, void* userData);
 
 class MPlayer
 {
 	
 static const int SAMPLE_RATE;
 static const int FRAMES_PER_BUFFER;
+static const int EXPORT_CHUNKS = 4; // export pipeline - chunks going round between render and encoder
+static const int EXPORT_CHUNK_FRAMES = 4096;
 	
 public:
 	
@@ -38,6 +100,8 @@ public:
 	DelayLine delay[2]; // stereo, thus 2 channels
 	MData data[9]; // this holds the music data
 	DData ddata; // this holds the drum track data
+	SourceOrigin sourceOrigin; // where in the song's source its channel sections are
+	std::shared_ptr<const NOSC::HitBank> drumHits; // every drum hit the song can play - nosc (and its saved states) point into it
 	
 	bool playing;
 	bool enabled[9];
@@ -48,8 +112,33 @@ public:
 	long songLastFrame;
 	long songLastFramePure;
 	long bookmark;
+	std::atomic<long> streamFrame; // frames sent to the audio device so far
+	long streamPos; // audio callback's own copy of the stream position
+	
+	MusicEventQueue musicEvents; // beat / measure / marker notifications to game thread
+	long beatFrames;
+	long measureFrames;
+	long nextMusicEventFrame;
+	long nextBeatFrame;
+	std::vector<long> markerFrame; // MARKER=n positions in the song, sorted by frame
+	std::vector<int> markerId;
+	std::vector<int> markerChannel; // 0 - 8, 9 for drums
+	int markerIndex;
 	
 	float masterGain;
+	
+	static const int N_STEMS = 11; // tone channels 1 - 9, drums, delay return
+	float* stemFrame; // stem export - where getMix() puts each voice's share of this frame (NULL = not exporting)
+	int stemStride; // ... and the distance from one stem to the next
+	long capHits; // samples the limiter has cut at masterOutCap - for the render stats
+	long clipsBefore; // ... when the render being measured began
+	double* channelSquares; // render stats - getMix() adds up each voice's share squared here (NULL = not measuring)
+	static const int VOICE_BLOCK = 256; // exports - frames of each plain voice rendered at a time (OSC::renderBlock())
+	float voiceBlock[9][VOICE_BLOCK * 2]; // ... both sides of each frame
+	bool inBlock[9]; // the voices getMix() takes from voiceBlock
+	int blockFrame; // ... and the frame in it (-1 = rendering frame by frame)
+	double channelSum[N_STEMS];
+	RenderStats renderStats; // what the last export / offline render measured
 	int tableType;
 	float masterOutCap;
 	float compThreshold;
@@ -60,17 +149,83 @@ public:
 	bool ringModMute[9];
 	bool loopEnabled;
 	int repeatsRemaining;
+	long loopStartFrame; // LOOPSTART position in the song - 0 means loop from the very top
+	bool loopPointEnabled;
+	bool loopStateReady;
+	PlayerState loopState; // player state right at the loop start
+	
+	static const int N_TRACKS = 4; // main song + up to 3 more songs mixed into this one stream
+	static const int TRACK_QUEUE_SIZE = 64;
+	std::atomic<MPlayer*> track[N_TRACKS]; // track[0] is this player - the others never open a device
+	TrackCommand trackQueue[TRACK_QUEUE_SIZE]; // game thread -> audio callback
+	std::atomic<int> trackWriteIndex;
+	std::atomic<int> trackReadIndex;
+	TrackCommand pendingTrackCommand[TRACK_QUEUE_SIZE];
+	int nPendingTrackCommands;
+	float trackGain; // this player's level as a track - crossfades etc.
+	float trackGainTarget;
+	float trackGainStep;
+	long trackFadeFramesLeft;
+	bool stopWhenFaded;
+	
+	static const double MIN_TEMPO_SCALE;
+	static const double MAX_TEMPO_SCALE;
+	double tempoScale; // song frames played per output frame - 1.0 is the parsed tempo
+	double tempoScaleTarget;
+	double tempoScaleStep;
+	long tempoRampFramesLeft;
+	double songFrameCredit; // song time owed to the sequencer (fraction of a frame)
+	
+	int transposeCents; // whole song, in cents (100 per semitone)
+	int channelTransposeCents[9]; // on top of that, per channel
+	double transposeRatio[9]; // frequency ratio each channel plays at
+	
+	std::atomic<MPlayer*> incomingSong; // parsed on another thread - waiting to be swapped in
+	std::atomic<MPlayer*> outgoingSong; // holds the data swapped out - for the loader to free
+	std::atomic<unsigned int> songGeneration; // goes up whenever another song's data is swapped / copied in
+	int songSwapBoundary; // (on the incoming song) TrackCommand::NOW, BEAT or MEASURE
+	bool songSwapKeepPosition; // (on the incoming song) carry on from the same song frame
+	long songSwapFrame; // stream frame the swap is due at - -1 while none is scheduled
+	static const long SWAP_MARGIN_FRAMES = 4410; // a live edit is aimed this far ahead of the track (100 msec)
+	long songSwapSongFrame; // (on the incoming song) live edit - song frame the loader seeked it to (-1 = from the top)
+	long songSwapFromFrame; // (on the incoming song) ... and where the track was then
+	PlayerState songTopState; // (on the incoming song) its state at the top ...
+	PlayerState songSwapState; // ... and at songSwapSongFrame
+	int nSongSwapsPending;
+	std::atomic<long> publishedFramePos; // song frame the track was at, last buffer rendered (-1 = not playing)
+	std::atomic<double> publishedTempoScale; // ... its tempo scale then
+	std::atomic<long> publishedBeatFrames; // ... and its beat / measure length
+	std::atomic<long> publishedMeasureFrames;
 	bool songFinished;
+	
+	static const int AHEAD_FADE_FRAMES = 128;
+	std::atomic<AheadRing*> ahead; // render-ahead mode - music rendered ahead for the callback (NULL = off)
+	std::thread aheadThread;
+	std::atomic<bool> aheadRunning; // render thread carries on while this is set
+	std::atomic<bool> aheadActive; // callback has switched over to playing from the ring
+	std::atomic<unsigned int> callbackEpoch; // goes up as each callback starts and as it ends (odd = running)
+	std::mutex aheadLock; // render thread holds it a block at a time - game thread changes go in between
+	int aheadFrames; // lookahead to keep queued
+	SFX* aheadSFX; // SFX are mixed in the callback meanwhile
+	std::atomic<long> aheadHeardFrame; // song frame of the last frame the callback played
+	std::atomic<bool> aheadHeardPlaying; // ... and whether the song was playing there
+	std::atomic<float> aheadVolume; // master volume - set while frames rendered at the old one are queued ...
+	std::atomic<int> aheadVolumeChanges; // ... so the callback knows which frames came before the change
+	float aheadGain; // callback - volume the music is heard at (ramps to a new one)
+	MusicEventQueue aheadEvents; // render thread -> callback: music events, let out as their frames play
+	MusicEventQueue* musicEventOut; // where the song's music events go - musicEvents, or aheadEvents
+	std::atomic<long> aheadUnderruns; // frames the callback found nothing rendered for
+	AheadFrame aheadFade[AHEAD_FADE_FRAMES]; // flushed frames - faded out under the new ones
+	int aheadFadeLen;
+	int aheadFadePos;
 
 	bool channelDone[9];
 	bool dChannelDone;
 	int remainingFrames[9];
 	int dRemainingFrames;
 	double freqNote[9];
-	int noteIndex[9];
-	int dNoteIndex;
-	int eventIndex[9];
-	int dEventIndex;
+	int streamIndex[9];
+	int dStreamIndex;
 	int currentDrumNote;
 
 	float sndBuffer[88200];
@@ -85,6 +240,10 @@ public:
 
 	void setNewNote(int channel, double freq);
 	void setToRest(int channel);
+	void setTranspose(int semitones, int cents);
+	void setChannelTranspose(int channel, int semitones, int cents);
+	void updateTransposeRatios();
+	void retuneChannel(int channel);
 	void setNewDrumHit(int drumType);
 	void restDrum();
 	void setAllChannelGain(float gain1, float gain2, float gain3, float gain4, float gain5, 		float gain6, float gain7, float gain8, float gain9, float gainD);
@@ -104,8 +263,65 @@ public:
 	void enableLooping();
 	void disableLooping();
 	void setRepeatsRemaining(int value);
+	void setLoopStart(long frame);
+	long getLoopStart();
+	void enableLoopPoint();
+	void disableLoopPoint();
+	void saveState(PlayerState &s);
+	void loadState(const PlayerState &s);
+	void prepareLoopState();
+	void prepareDrumHits();
+	void loopBack();
+	void sequenceFrame();
+	void playOutEvents();
+	void renderFrame(float &left, float &right);
+	void advanceSongFrame();
+	void attachTrack(int n, MPlayer* player);
+	MPlayer* getTrack(int n);
+	void publishTrackPositions();
+	bool sendTrackCommand(int n, int type, int boundary, float gain, long fadeFrames, bool stopWhenSilent);
+	bool sendTransposeCommand(int n, int channel, int cents);
+	bool queueTrackCommand(const TrackCommand &c);
+	void collectTrackCommands();
+	void fireTrackCommands();
+	long getBoundaryStreamFrame(int boundary);
+	long streamFramesToBoundary(int boundary);
+	void collectIncomingSongs();
+	void fireSongSwaps();
+	void adoptIncomingSong();
+	void prepareSwap(MPlayer* target);
+	void takeSongSettings(MPlayer* song);
+	void copySongSettings(MPlayer* song);
+	void takeSongParameters(MPlayer* song);
+	unsigned int getSongGeneration();
+	int getSourcePosAtFrame(int channel, long frame);
+	long getFrameAtSourcePos(int sourcePos);
+	int getSourceLine(int sourcePos);
+	void startFade(float target, long fadeFrames, bool stopWhenSilent);
+	void updateTrackGain();
+	void resetTrackGain();
+	void resetRuntimeSettings();
+	void setTempoScale(double scale, long rampFrames);
+	double getTempoScale();
+	void updateTempoScale();
 	void advance();
-	float getMix(int channel);
+	void advanceUnblocked();
+	int voiceBlockLength(long maxFrames);
+	void renderVoiceBlock(int nFrames);
+	float getMix(int channel, float level);
+	void renderStreamFrame(float &left, float &right);
+	bool startRenderAhead(int lookaheadMs);
+	void stopRenderAhead();
+	void waitForCallback();
+	bool renderAheadEnabled();
+	long getAheadUnderruns();
+	void flushAhead(bool keepPosition);
+	void rewindToHeard();
+	long getHeardFramePos();
+	void setMusicVolume(float gain);
+	void renderAheadLoop();
+	void renderAheadBlock(int nFrames);
+	int playAhead(AheadRing* ring, float* out, unsigned long framesPerBuffer);
 	float compress(float input);
 	float getMasterGain();
 	void setMasterGain(float g);
@@ -142,6 +358,7 @@ public:
 	std::string getStreamStateString();
 	bool getStreamState();
 	void resetForNewSong();
+	void resetSongSettings();
 	void close();
 	void start();
 	void pause();
@@ -151,6 +368,14 @@ public:
 	long getSongLastFrame();
 	long getSongLastFramePure();
 	long getFramePos();
+	long getStreamFrame();
+	void setMusicalTiming(long beatLength, long measureLength);
+	void addMarker(long frame, int id, int channel);
+	void clearMarkers();
+	void clearChannelMarkers(int channel);
+	void sortMarkers();
+	void alignMusicEvents();
+	void postMusicEvents();
 	bool isPlaying();
 	int getTableType();
 	void setTableType(int type);
@@ -162,9 +387,25 @@ public:
 	void enableRingMod(int channel, int modulatorChannel);
 	void disableRingMod(int channel);
 	void processEvent(int channel, int eType, int eParam);
+	void runEvent(int channel, const SeqRecord &r);
 	void processDrumEvent(int eType, int eParam);
+	void runDrumEvent(const SeqRecord &r);
+	static bool tuneDrum(NOSC &n, const SeqRecord &r);
 	std::string exportToFile(string filename);
+	std::string exportStems(string filename);
+	std::string exportToStream(PCMWriteFunc write, void* userData, bool wavHeader);
+	std::string exportToStream(FILE* out, bool wavHeader);
+	std::string exportToStream(int fd, bool wavHeader);
 	int fillExportBuffer(float* buffer, int framesToWrite, long startFrame, int songFrameLen);
+	int fillStemBuffer(float* buffer, float* stems, int framesToWrite, long startFrame, int songFrameLen);
+	void keepShare(int voice, int channel, float share);
+	long startRender(long startFrame, long endFrame);
+	long renderToBuffer(float* buffer, long startFrame, long endFrame);
+	long renderToBuffer(short* buffer, long startFrame, long endFrame);
+	void beginRenderStats();
+	void setRenderStats(LoudnessMeter &meter);
+	RenderStats getRenderStats();
+	bool writeRenderStats(string filename);
 	float getHistoricalAverage(int channel);
 	void seek(long destination);
 	void seekAndStart(long destination);
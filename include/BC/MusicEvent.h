@@ -0,0 +1,46 @@
+// MusicEvent.h //////////////////////////////////////////
+// MusicEventQueue class - Definition ////////////////////
+
+#ifndef MUSICEVENT_H
+#define MUSICEVENT_H
+
+#include <atomic>
+
+// one notification about the song's position
+// posted by the audio callback at the exact frame it happens (is heard, in render-ahead mode)
+struct MusicEvent
+{
+	static const int BEAT = 0;		// param = beat number within the measure (0 = downbeat)
+	static const int MEASURE = 1;	// param = measure number from top of song
+	static const int MARKER = 2;	// param = id written in source as MARKER=n
+	static const int LOOP = 3;		// song looped back to the top
+	static const int END = 4;		// song reached its last frame
+	
+	int type;
+	int param;
+	long songFrame;		// position in the song
+	long streamFrame;	// position in the output stream (same clock as BCPlayer::getStreamFrame)
+};
+
+// single-producer (audio callback) / single-consumer (game thread) ring
+// posting never blocks or allocates - events are dropped while the ring is full
+class MusicEventQueue
+{
+
+public:
+
+	static const int QUEUE_SIZE = 256;
+	
+	MusicEvent ring[QUEUE_SIZE];
+	std::atomic<int> writeIndex;
+	std::atomic<int> readIndex;
+	
+	MusicEventQueue();
+	~MusicEventQueue(){}
+	
+	bool post(int type, int param, long songFrame, long streamFrame);
+	bool poll(MusicEvent &e);
+	void clear();
+};
+
+#endif
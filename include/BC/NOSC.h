@@ -5,6 +5,8 @@
 #define NOSC_H
 
 #include <vector>
+#include <memory>
+#include "Envelope.h"
 
 class NOSC
 {
@@ -16,9 +18,9 @@ static const int NOSC_HISTORY_SIZE = 64;
 
 public:
 
-	std::vector<float> nTable;
-	std::vector<float> nPinkTable;
-	std::vector<float> pTable;
+	const float* nTable; // these point into tables shared by every NOSC
+	const float* nPinkTable;
+	const float* pTable;
 
 	float noiseLevel; // user can change noise element mix level ... default = 1.0f;
 	float squareLevel; // user can change picthed element mix level ... default = 1.0f
@@ -36,7 +38,6 @@ public:
 	
 	// each drum will have an independent envelope shape
 	// kick, snare, hat (and quiet versions of them)
-	int nEnvFrames[6];
 	int nAttackFrames[6];
 	int nPeakFrames[6];
 	int nDecayFrames[6];
@@ -47,8 +48,42 @@ public:
 	double pitchFallLimit[6];
 	float pStartLevel[6];
 	float levelFallDelta[6];
-	int envPos;
-	bool envFinished;
+	Envelope env; // the sounding drum's envelope
+	
+	// a hit of each drum tone, worked out frame by frame once - the noise phase starts over with
+	// every hit, so its noise element and envelope come out the same each time and play back from
+	// here; the pitched element's phase carries on from the last hit, so only its fall is kept -
+	// the square itself is read live (built off the audio thread for every tone a song uses - see
+	// MPlayer::prepareDrumHits())
+	struct DrumHit
+	{
+		int dType;				// the tone it was built for
+		double frequency;
+		double pitchFallDelta;
+		double pitchFallLimit;
+		float pStartLevel;
+		float levelFallDelta;
+		int noiseType;
+		float noiseLevel;
+		int nAttackFrames;
+		int nPeakFrames;
+		int nDecayFrames;
+		float peakLevel;
+		std::vector<double> increment;	// pitched element - up to where it holds still
+		std::vector<double> level;
+		std::vector<double> pitchFall;
+		bool settled;	// ... and holds still after its last frame (otherwise carry on live)
+		std::vector<float> noise;		// noise element (at the noise level) - up to where the envelope holds
+		std::vector<double> envelope;	// (its level)
+		Envelope envelopeEnd;			// ... and the envelope from there on, live
+	};
+	typedef std::vector<std::unique_ptr<const DrumHit>> HitBank;
+	const HitBank* hitBank;	// the song's hits - owned by the player (NULL = every hit worked out live)
+	size_t hitSearch;		// where findHit() last found one
+	const DrumHit* hit[6];	// each drum's current tone in it (NULL = not there, worked out live)
+	const DrumHit* playing;	// the sounding hit's pitched element (NULL = worked out live)
+	const DrumHit* sounding;	// ... its noise element and envelope (NULL = worked out live)
+	int hitPos;				// ... and the frame of the hit it's at
 	
 	int noiseType[6];
 	
@@ -76,6 +111,15 @@ public:
 	void advance();
 	void advanceEnvelope();
 	void setIncrement(int dType);
+	double getIncrement(int dType, double pitchFall);
+	DrumHit* buildHit(int dType);
+	void useHitBank(const HitBank* bank);
+	void fillHitBank(HitBank &bank);
+	void findHit(int dType);
+	void leaveHit();
+	void leaveNoise();
+	void changeNoise(int dType);
+	static const DrumHit* getStillHit();
 	void initializePhase();
 	float getOutput();
 	float compress(float in);
@@ -119,6 +163,13 @@ public:
 	
 private:
 
+	struct Tables
+	{
+		std::vector<float> white;
+		std::vector<float> pink;
+		std::vector<float> pitched;
+		Tables();
+	};
 };
 
 #endif
\ No newline at end of file
@@ -11,6 +11,7 @@ class LFO;
 #include "Astro.h"
 #include "LFO.h"
 #include "Fall.h"
+#include "Envelope.h"
 
 using namespace std;
 
@@ -22,10 +23,18 @@ static const int ENV_TABLE_SIZE;
 static const double OSC_SAMPLE_RATE;
 static const float TWO_PI;
 static const int OSC_HISTORY_SIZE = 64;
+static const int N_WAVE_TABLES = 9; // waveform 0 - 8 (plus the default square)
+static const int MOD_BLOCK = 32; // frames between pitch modulation updates
+static const int RUN_FLIP = 1; // renderRun() kernels - one per combination of these
+static const int RUN_BEEF = 2;
+static const int RUN_SILENT = 4;
+static const int RUN_RAMP = 8;
+static const int RUN_MOD = 16;
+static const int N_RUN_KERNELS = 32;
 
 public:
 	
-	vector<float> table;
+	const float* table; // points into the shared wave table bank
 	
 	int tableType;
 	float yFlip;
@@ -43,20 +52,7 @@ public:
 	bool resting;
 	bool forceSilenceAtBeginning;
 	
-	int nEnvFrames;
-	int nAttackFrames;
-	int nPeakFrames;
-	int nDecayFrames;
-	int decayStartPos;
-	float peakLevel;
-	float decayAmount;
-	float sustainLevel;
-	int envPos;
-	bool envADfinished;
-	
-	int nReleaseFrames;
-	int releasePos;
-	bool envRfinished;
+	Envelope env;
 	
 	Astro astro;
 	bool astroEnabled;
@@ -70,6 +66,9 @@ public:
 	Rise rise;
 	bool riseActive;
 	
+	int modCount;		// frames left in this pitch modulation block
+	double modRatio;	// per frame increment ratio through the block
+	
 	bool beefUp;
 	float beefUpFactor;
 	float compRatio;
@@ -86,15 +85,23 @@ public:
 	~OSC();
 	
 	void setTable(int type);	
+	static const float* getWaveTable(int type);
+	static std::vector<float> buildWaveTables();
+	static void fillTable(float* table, int type);
 	void advance();
 	void setToRest();
 	void confirmFirstNoteIsRest();
 	void setNewNote(double newFreq);
 	void setFrequency(double noteFreq);
 	void setIncrement(double noteFreq);
+	void startModBlock();
 	void initializePhase();
 	void refreshForSongBeginning();
 	float getOutput();
+	void renderBlock(float* out, int nFrames);
+	int runLength(int maxRun);
+	int runConfig();
+	template<int CONFIG> void renderRun(float* out, int nFrames);
 	float compress(float in);
 	float popGuard(float in);
 	void enableBeefUp();
@@ -128,6 +135,11 @@ public:
 	void setPeakTime(int peakTimeMS);
 	void setDecayTime(int decayTimeMS);
 	void setReleaseTime(int releaseTimeMS);
+	void setAttackFrames(int frames);
+	void setPeakFrames(int frames);
+	void setDecayFrames(int frames);
+	void setReleaseFrames(int frames);
+	static int msToFrames(int milliseconds);
 	void setPeakLevel(float peakLV);
 	void setSustainLevel(float sustainLV);
 	void setEnvelope(int attackTimeMS, int peakTimeMS, int decayTimeMS, int releaseTimeMS,
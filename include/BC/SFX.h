@@ -5,6 +5,7 @@
 #define SFX_H
 
 #include <string>
+#include <atomic>
 #include "Sound.h"
 
 class Sound;
@@ -14,10 +15,37 @@ class SFX
 public:
 
 	static const int N_SLOTS = 16;
+	static const int N_TRIGGERS = 64;
+	
+	// time base for a scheduled trigger
+	static const int STREAM_TIME = 0; // absolute output stream frame
+	static const int SONG_TIME = 1; // frame position in the playing song
+	
+	// a start request queued from the game thread
+	// audio callback starts the slot at exactly this frame
+	struct Trigger
+	{
+		int slot;
+		long frame;
+		int timeBase;
+		int songEpoch; // SONG_TIME - the song it was meant for (see clearSongTriggers())
+	};
+	
 	Sound sound[N_SLOTS];
 	float compThreshold;
 	float compRatio;
 	
+	// single-producer (game thread) / single-consumer (audio callback) ring
+	Trigger triggerRing[N_TRIGGERS];
+	std::atomic<int> triggerWriteIndex;
+	std::atomic<int> triggerReadIndex;
+	std::atomic<int> songEpoch; // goes up as a new song is loaded - older SONG_TIME triggers are dropped
+	
+	// triggers already taken out of the ring - owned by audio callback only
+	Trigger pendingTrigger[N_TRIGGERS];
+	int nPendingTriggers;
+	int pendingSongEpoch;
+	
 	SFX();
 	~SFX(){}
 	
@@ -31,6 +59,11 @@ public:
 	void stop(int slot);
 	void pause(int slot);
 	void resume(int slot);
+	bool schedule(int slot, long frame, int timeBase);
+	void collectTriggers();
+	void clearSongTriggers();
+	void dropSongTriggers();
+	void fireTriggers(long streamFrame, long songFrame, bool songPlaying);
 	float getOutput(int channel);
 	float compress(float input);
 
@@ -0,0 +1,31 @@
+// SeqRecord.h ///////////////////////////////////////////
+// SeqRecord - one step of a channel's sequence //////////
+
+#ifndef SEQRECORD_H
+#define SEQRECORD_H
+
+// notes, rests and events of one channel, merged in the order the sequencer gets to them
+// - so playing a channel is a walk along one array with one cursor (16 bytes per step)
+struct SeqRecord
+{
+	static const short NOTE = 0;
+	static const short REST = 1;
+	static const short EVENT = 2;
+	static const short END = 3;
+
+	short op;
+	short event;		// EVENT - opcode (see EventCode)
+	union
+	{
+		int value;		// NOTE / REST / END - length in frames, EVENT - decoded parameter
+		float level;	// ... or the decoded gain / level, for level events
+	};
+	union
+	{
+		double freq;	// NOTE / REST / END - frequency (65535 for a rest, -1 at the end)
+		int drum;		// ... or the drum note, for the drum channel
+		long frame;		// EVENT - the sequencer frame it's due at
+	};
+};
+
+#endif
@@ -0,0 +1,57 @@
+// SourceMap.h ///////////////////////////////////////////
+// SourceMap Class - Definition //////////////////////////
+
+#ifndef SOURCEMAP_H
+#define SOURCEMAP_H
+
+#include <vector>
+
+// where each note / event of one channel came from in the MML source
+// one entry per source token, in song order - positions are relative to the channel's section
+// (so a channel that isn't re-parsed keeps a valid map when other sections change)
+class SourceMap
+{
+
+public:
+
+	std::vector<long> frame;	// song frame the token's note / event starts at
+	std::vector<int> pos;		// character position of the token in the section
+	std::vector<int> byPos;		// entry numbers, sorted by position (then frame)
+
+	SourceMap();
+	~SourceMap();
+	void clear();
+	void swap(SourceMap &other);
+	void add(long f, int p);
+	void finish();
+	int getPosAtFrame(long f);
+	long getFrameAtPos(int p);
+	int getSize();
+
+};
+
+// where a parsed song's channel sections were in its source - SourceMap positions go through this
+// (kept with the song, so it holds for the song a player has whatever its MML has parsed since)
+class SourceOrigin
+{
+
+public:
+
+	static const int N_SECTIONS = 10; // @1 - @9 and @D
+
+	std::vector<int> cleanPos;		// source position of each char left after comments / spaces are out
+	int sectionStart[N_SECTIONS];	// where each section begins in that cleaned string (-1 if absent)
+	int sectionLength[N_SECTIONS];
+	std::vector<int> lineStart;		// source position each line begins at
+
+	SourceOrigin();
+	~SourceOrigin();
+	void clear();
+	void swap(SourceOrigin &other);
+	int getSourcePos(int section, int p);
+	int getSection(int sourcePos, int &p);
+	int getSourceLine(int sourcePos);
+
+};
+
+#endif
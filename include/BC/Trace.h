@@ -0,0 +1,81 @@
+// Trace.h ///////////////////////////////////////////////
+// Trace Class - Definition //////////////////////////////
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+
+// span tracing, written out as a Chrome trace (chrome://tracing, ui.perfetto.dev)
+// build with -DBC_TRACE and each BC_TRACE_SPAN("name") records how long the rest of its block took,
+// on which thread - between Trace::start() and Trace::stop(), which writes the file
+// without BC_TRACE the spans compile to nothing (start / stop just write an empty trace)
+// spans go into a buffer set aside by start() - recording one never locks or allocates,
+// so the audio callback can be traced too (spans past MAX_SPANS are dropped)
+class Trace
+{
+
+public:
+
+	static const int MAX_SPANS = 262144;
+
+	struct Span
+	{
+		const char* name;
+		long long begin;	// nsec since start()
+		long long end;
+		unsigned int thread;
+	};
+
+	static bool start(const std::string &filename);
+	static bool stop();
+	static bool isRunning();
+	static long long now();
+	static void record(const char* name, long long begin, long long end);
+
+private:
+
+	static std::vector<Span> spans;
+	static std::atomic<int> nextSpan;	// spans claimed - past MAX_SPANS once stop() closes the buffer
+	static std::atomic<int> nRecorded;	// ... and written
+	static std::atomic<bool> running;
+	static std::chrono::steady_clock::time_point origin;
+	static std::string traceFile;
+	static std::mutex lock;				// start / stop only
+
+};
+
+// times the rest of the block it's declared in
+class TraceSpan
+{
+
+public:
+
+	TraceSpan(const char* spanName)
+		: name(spanName), begin(Trace::isRunning() ? Trace::now() : -1) {}
+	~TraceSpan()
+	{
+		if(begin >= 0)
+			Trace::record(name, begin, Trace::now());
+	}
+
+private:
+
+	const char* name;
+	long long begin;	// -1 = not tracing when the span began
+
+};
+
+#ifdef BC_TRACE
+#define BC_TRACE_JOIN2(a, b) a##b
+#define BC_TRACE_JOIN(a, b) BC_TRACE_JOIN2(a, b)
+#define BC_TRACE_SPAN(name) TraceSpan BC_TRACE_JOIN(traceSpan, __LINE__)(name)
+#else
+#define BC_TRACE_SPAN(name)
+#endif
+
+#endif
@@ -1,5 +1,5 @@
-g++ BCPlayer.cpp BCPlayerApp.cpp -I./include lib/libsndfile-1.lib lib/portaudio_x86.lib -o BCPlayerApp
+g++ -std=c++11 BCPlayer.cpp BCPlayerApp.cpp -I./include lib/libsndfile-1.lib lib/portaudio_x86.lib -o BCPlayerApp
 
-g++ BCPlayer.cpp stringPlayer.cpp -I./include lib/libsndfile-1.lib lib/portaudio_x86.lib -o stringPlayer
+g++ -std=c++11 BCPlayer.cpp stringPlayer.cpp -I./include lib/libsndfile-1.lib lib/portaudio_x86.lib -o stringPlayer
 
-g++ BCPlayer.cpp SFXTest.cpp -I./include lib/libsndfile-1.lib lib/portaudio_x86.lib -o SFXTest
\ No newline at end of file
+g++ -std=c++11 BCPlayer.cpp SFXTest.cpp -I./include lib/libsndfile-1.lib lib/portaudio_x86.lib -o SFXTest
\ No newline at end of file
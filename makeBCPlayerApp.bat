@@ -1 +1 @@
-g++ BCPlayer.cpp BCPlayerApp.cpp -I./include lib/libsndfile-1.lib lib/portaudio_x86.lib -o BCPlayerApp
\ No newline at end of file
+g++ -std=c++11 BCPlayer.cpp BCPlayerApp.cpp -I./include lib/libsndfile-1.lib lib/portaudio_x86.lib -o BCPlayerApp
\ No newline at end of file
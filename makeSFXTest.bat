@@ -1 +1 @@
-g++ BCPlayer.cpp SFXTest.cpp -I./include lib/libsndfile-1.lib lib/portaudio_x86.lib -o SFXTest
\ No newline at end of file
+g++ -std=c++11 BCPlayer.cpp SFXTest.cpp -I./include lib/libsndfile-1.lib lib/portaudio_x86.lib -o SFXTest
\ No newline at end of file
@@ -1 +1 @@
-g++ BCPlayer.cpp stringPlayer.cpp -I./include lib/libsndfile-1.lib lib/portaudio_x86.lib -o stringPlayer
\ No newline at end of file
+g++ -std=c++11 BCPlayer.cpp stringPlayer.cpp -I./include lib/libsndfile-1.lib lib/portaudio_x86.lib -o stringPlayer
\ No newline at end of file
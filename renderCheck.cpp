@@ -0,0 +1,435 @@
+// renderCheck.cpp ///////////////////////////////////////
+// golden render check - regressions and speed ///////////
+//
+// renders each song headless (a fresh player and parser per song - no audio device) and
+// compares it with the reference kept in golden/ :
+//   same  - bit for bit (hash of the float output)
+//   close - not bit for bit, but every 100 msec block's RMS within the tolerance
+//           (a different compiler / flags moves the floats a little)
+//   DIFF  - length differs, or a block is off by more than the tolerance
+//   SLOW  - sounds right, but renders slower than the reference by more than the slack
+//           (only with -slack - the speeds in golden/ are from whichever machine wrote them)
+// then renders the first song again through a game's BCPlayer (renderToBuffer) while an SFX
+// plays and the music is transposed - it must come out the same as the headless render
+// times the parse and the render of each song (fastest of -runs) and writes all of it to a
+// JSON report - exits with 1 if any song fails, so it can run after every change
+// -update writes new references instead (to check speed, update them on your machine first)
+//
+// usage: renderCheck [-update] [-runs n] [-tol rms] [-slack fraction] [-report file.json] [song.txt ...]
+//        (songs default to bcsource/*.txt, songs/*.txt and golden/*.txt - the songs kept in golden/
+//        cover what the others don't use: LOOPSTART, REPEAT, MARKER and drum tuning)
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstdio>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <dirent.h>
+#endif
+#include "BC/BCPlayer.h"
+
+using namespace std;
+
+static const int BLOCK = 4410;			// fingerprint block - 100 msec
+static const int CHUNK = 4096;			// frames rendered per call
+static const char* SFX_FILE = "audio/sound1.wav";	// played during the in-game render
+
+// one song's render - what gets compared and kept as the reference
+struct Render
+{
+	long frames;
+	string hash;
+	double realtime;		// x realtime - song length / render time
+	vector<double> blockRMS;
+};
+
+// one song's result, for the report
+struct Result
+{
+	string song;
+	string status;
+	long frames;
+	double parseMs;
+	double renderMs;
+	double realtime;
+	double refRealtime;
+	double maxBlockDiff;
+	RenderStats stats;
+};
+
+// every *.txt in a folder, sorted
+static void listSongs(const string &folder, vector<string> &songs)
+{
+	vector<string> names;
+#ifdef _WIN32
+	_finddata_t data;
+	intptr_t handle = _findfirst((folder + "/*.txt").c_str(), &data);
+	if(handle != -1)
+	{
+		do
+			names.push_back(data.name);
+		while(_findnext(handle, &data) == 0);
+		_findclose(handle);
+	}
+#else
+	DIR* dir = opendir(folder.c_str());
+	if(dir)
+	{
+		dirent* entry;
+		while((entry = readdir(dir)) != NULL)
+		{
+			string name = entry->d_name;
+			if(name.size() > 4 && name.substr(name.size() - 4) == ".txt")
+				names.push_back(name);
+		}
+		closedir(dir);
+	}
+#endif
+	sort(names.begin(), names.end());
+	for(size_t i=0; i<names.size(); i++)
+		songs.push_back(folder + "/" + names[i]);
+}
+
+// bcsource/song1.txt -> golden/bcsource_song1.ref
+static string refName(const string &song)
+{
+	string name = song;
+	size_t dot = name.find_last_of('.');
+	size_t slash = name.find_last_of("/\\");
+	if(dot != string::npos && (slash == string::npos || dot > slash))
+		name = name.substr(0, dot);
+	while(name.size() > 2 && name[0] == '.' && (name[1] == '/' || name[1] == '\\'))
+		name = name.substr(2);
+	for(size_t i=0; i<name.size(); i++)
+		if(name[i] == '/' || name[i] == '\\' || name[i] == ':')
+			name[i] = '_';
+	return "golden/" + name + ".ref";
+}
+
+// FNV-1a over the raw float bytes - 64 bit, as hex
+static string hashOf(const vector<float> &pcm)
+{
+	unsigned long long h = 14695981039346656037ULL;
+	const unsigned char* p = reinterpret_cast<const unsigned char*>(pcm.empty() ? NULL : &pcm[0]);
+	size_t n = pcm.size() * sizeof(float);
+	for(size_t i=0; i<n; i++)
+	{
+		h ^= p[i];
+		h *= 1099511628211ULL;
+	}
+	ostringstream out;
+	out.width(16);
+	out.fill('0');
+	out << hex << h;
+	return out.str();
+}
+
+// RMS of each 100 msec block, both sides together
+static void fingerprint(const vector<float> &pcm, long frames, vector<double> &blocks)
+{
+	blocks.clear();
+	for(long start=0; start<frames; start+=BLOCK)
+	{
+		long end = min(start + BLOCK, frames);
+		double sum = 0.0;
+		for(long i=start*2; i<end*2; i++)
+			sum += static_cast<double>(pcm[i]) * pcm[i];
+		blocks.push_back(sqrt(sum / ((end - start) * 2)));
+	}
+}
+
+// parse and render one song with an engine of its own
+static bool renderSong(const string &song, vector<float> &pcm, long &frames,
+	double &parseMs, double &renderMs, RenderStats &stats)
+{
+	MML mml;
+	mml.initialize(44100, 120.0);
+	MPlayer* player = new MPlayer();
+
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	bool loaded = mml.loadSong(song, player);
+	chrono::steady_clock::time_point parsed = chrono::steady_clock::now();
+	parseMs = chrono::duration_cast<chrono::duration<double, milli> >(parsed - start).count();
+	if(!loaded)
+	{
+		delete player;
+		return false;
+	}
+
+	long endFrame = player->getSongLastFrame();
+	pcm.assign(endFrame * 2, 0.0f);
+
+	start = chrono::steady_clock::now();
+	player->startRender(0, endFrame);
+	long pos = 0;
+	while(pos < endFrame)
+		pos += player->fillExportBuffer(&pcm[pos * 2], min(endFrame - pos, static_cast<long>(CHUNK)), pos, endFrame);
+	chrono::steady_clock::time_point rendered = chrono::steady_clock::now();
+	renderMs = chrono::duration_cast<chrono::duration<double, milli> >(rendered - start).count();
+	frames = pos;
+
+	LoudnessMeter meter;
+	meter.process(&pcm[0], frames);
+	stats = meter.getStats();
+	delete player;
+	return true;
+}
+
+// render the song with BCPlayer::renderToBuffer the way a game would - music and an SFX playing,
+// transposed - the SFX and the transpose must stay out of it, so the hash matches the headless render
+static string gameRenderStatus(const string &song, const string &headlessHash)
+{
+	BCPlayer bcplayer;
+	string status;
+	if(!bcplayer.loadMusic(song) || bcplayer.loadSFX(0, SFX_FILE) != "OK")
+		status = "ERROR";
+	else
+	{
+		bcplayer.startMusic();
+		bcplayer.setTranspose(2, 0);
+		bcplayer.startSFX(0);
+		
+		vector<float> pcm;
+		bcplayer.renderToBuffer(pcm);
+		status = hashOf(pcm) == headlessHash ? "same" : "DIFF";
+	}
+	bcplayer.terminate();
+	return status;
+}
+
+static bool readRef(const string &filename, Render &ref)
+{
+	ifstream in(filename.c_str());
+	if(!in)
+		return false;
+
+	string key;
+	long nBlocks = 0;
+	in >> key >> ref.frames >> key >> ref.hash >> key >> ref.realtime >> key >> nBlocks;
+	if(!in || nBlocks < 0)
+		return false;
+	ref.blockRMS.resize(nBlocks);
+	for(long i=0; i<nBlocks; i++)
+		in >> ref.blockRMS[i];
+	return !in.fail();
+}
+
+static bool writeRef(const string &filename, const Render &ref)
+{
+	FILE* out = fopen(filename.c_str(), "w");
+	if(!out)
+		return false;
+	fprintf(out, "frames %ld\nhash %s\nrealtime %.2f\nblocks %d\n", ref.frames, ref.hash.c_str(),
+		ref.realtime, static_cast<int>(ref.blockRMS.size()));
+	for(size_t i=0; i<ref.blockRMS.size(); i++)
+		fprintf(out, "%.9g\n", ref.blockRMS[i]);
+	return fclose(out) == 0;
+}
+
+// song paths in the report - backslashes (windows) escaped
+static string jsonString(const string &text)
+{
+	string escaped;
+	for(size_t i=0; i<text.size(); i++)
+	{
+		if(text[i] == '\\' || text[i] == '"')
+			escaped += '\\';
+		escaped += text[i];
+	}
+	return escaped;
+}
+
+// non-finite numbers (silence in dB) as null - JSON has no infinity
+static void jsonNumber(FILE* out, double value)
+{
+	if(value == value && value != HUGE_VAL && value != -HUGE_VAL)
+		fprintf(out, "%.3f", value);
+	else
+		fprintf(out, "null");
+}
+
+static bool writeReport(const string &filename, const vector<Result> &results, bool passed)
+{
+	FILE* out = fopen(filename.c_str(), "w");
+	if(!out)
+		return false;
+	fprintf(out, "{\n\t\"passed\": %s,\n\t\"songs\": [\n", passed ? "true" : "false");
+	for(size_t i=0; i<results.size(); i++)
+	{
+		const Result &r = results[i];
+		fprintf(out, "\t\t{\"song\": \"%s\", \"status\": \"%s\", \"frames\": %ld, \"parseMs\": ",
+			jsonString(r.song).c_str(), r.status.c_str(), r.frames);
+		jsonNumber(out, r.parseMs);
+		fprintf(out, ", \"renderMs\": ");
+		jsonNumber(out, r.renderMs);
+		fprintf(out, ", \"realtime\": ");
+		jsonNumber(out, r.realtime);
+		fprintf(out, ", \"refRealtime\": ");
+		jsonNumber(out, r.refRealtime);
+		fprintf(out, ", \"maxBlockDiff\": %.9g, \"loudness\": ", r.maxBlockDiff);
+		jsonNumber(out, r.stats.integratedLoudness);
+		fprintf(out, ", \"truePeak\": ");
+		jsonNumber(out, r.stats.truePeak);
+		fprintf(out, "}%s\n", i + 1 < results.size() ? "," : "");
+	}
+	fprintf(out, "\t]\n}\n");
+	return fclose(out) == 0;
+}
+
+int main(int argc, char* argv[])
+{
+	bool update = false;
+	int runs = 3;
+	double tolerance = 0.0001;	// block RMS, full scale = 1.0 (-80 dB)
+	double slack = 0.0;			// e.g. 0.25 - 25% slower than the reference = SLOW (0 = don't check speed)
+	string reportFile = "renderCheck.json";
+	vector<string> songs;
+
+	for(int a=1; a<argc; a++)
+	{
+		string arg = argv[a];
+		if(arg == "-update")
+			update = true;
+		else if(arg == "-runs" && a + 1 < argc)
+			runs = atoi(argv[++a]);
+		else if(arg == "-tol" && a + 1 < argc)
+			tolerance = atof(argv[++a]);
+		else if(arg == "-slack" && a + 1 < argc)
+			slack = atof(argv[++a]);
+		else if(arg == "-report" && a + 1 < argc)
+			reportFile = argv[++a];
+		else if(!arg.empty() && arg[0] == '-')
+		{
+			cout << "usage: renderCheck [-update] [-runs n] [-tol rms] [-slack fraction] [-report file.json] [song.txt ...]\n";
+			return 1;
+		}
+		else
+			songs.push_back(arg);
+	}
+	if(runs < 1)
+		runs = 1;
+	if(songs.empty())
+	{
+		listSongs("bcsource", songs);
+		listSongs("songs", songs);
+		listSongs("golden", songs);
+	}
+	if(songs.empty())
+	{
+		cout << "no songs found (bcsource/*.txt, songs/*.txt, golden/*.txt)\n";
+		return 1;
+	}
+
+	vector<Result> results;
+	bool passed = true;
+	vector<float> pcm;
+	string firstHash;	// headless render of the first song - for the in-game render
+
+	for(size_t s=0; s<songs.size(); s++)
+	{
+		Result r;
+		r.song = songs[s];
+		r.frames = 0;
+		r.parseMs = r.renderMs = HUGE_VAL;
+		r.realtime = r.refRealtime = 0.0;
+		r.maxBlockDiff = 0.0;
+		r.stats = RenderStats();
+
+		// fastest of the runs - and each run must come out the same
+		Render render;
+		bool ok = true;
+		bool stable = true;
+		for(int n=0; n<runs && ok; n++)
+		{
+			long frames = 0;
+			double parseMs, renderMs;
+			ok = renderSong(songs[s], pcm, frames, parseMs, renderMs, r.stats);
+			if(!ok)
+				break;
+			string hash = hashOf(pcm);
+			if(n == 0)
+			{
+				render.frames = frames;
+				render.hash = hash;
+				fingerprint(pcm, frames, render.blockRMS);
+				if(s == 0)
+					firstHash = hash;
+			}
+			else if(hash != render.hash)
+				stable = false;
+			r.parseMs = min(r.parseMs, parseMs);
+			r.renderMs = min(r.renderMs, renderMs);
+		}
+
+		string refFile = refName(songs[s]);
+		Render ref;
+		if(!ok)
+			r.status = "ERROR";
+		else
+		{
+			r.frames = render.frames;
+			r.realtime = r.renderMs > 0.0 ? render.frames / 44.1 / r.renderMs : 0.0;
+			render.realtime = r.realtime;
+
+			if(update)
+				r.status = writeRef(refFile, render) ? "updated" : "ERROR";
+			else if(!readRef(refFile, ref))
+				r.status = "NO REF";
+			else
+			{
+				r.refRealtime = ref.realtime;
+				if(ref.frames != render.frames || ref.blockRMS.size() != render.blockRMS.size())
+					r.status = "DIFF";
+				else
+				{
+					for(size_t b=0; b<ref.blockRMS.size(); b++)
+						r.maxBlockDiff = max(r.maxBlockDiff, fabs(ref.blockRMS[b] - render.blockRMS[b]));
+					if(ref.hash == render.hash)
+						r.status = "same";
+					else if(r.maxBlockDiff <= tolerance)
+						r.status = "close";
+					else
+						r.status = "DIFF";
+				}
+				if((r.status == "same" || r.status == "close") && slack > 0.0
+					&& r.realtime < ref.realtime * (1.0 - slack))
+					r.status = "SLOW";
+			}
+			if(!stable)
+				r.status = "UNSTABLE";	// renders differ from run to run - state left over somewhere
+		}
+		if(r.status != "same" && r.status != "close" && r.status != "updated")
+			passed = false;
+
+		printf("%-24s %-8s %9ld frames  parse %7.2f ms  render %8.2f ms  (%6.1fx realtime, ref %6.1fx)\n",
+			r.song.c_str(), r.status.c_str(), r.frames, ok ? r.parseMs : 0.0, ok ? r.renderMs : 0.0,
+			r.realtime, r.refRealtime);
+		if(r.status == "DIFF" || r.status == "close")
+			printf("%-24s          max block RMS difference %.3g (tolerance %.3g)\n", "",
+				r.maxBlockDiff, tolerance);
+		results.push_back(r);
+	}
+	
+	if(!firstHash.empty())
+	{
+		string status = gameRenderStatus(songs[0], firstHash);
+		if(status != "same")
+			passed = false;
+		printf("%-24s %-8s in-game render (SFX playing, transposed) against the headless one\n",
+			songs[0].c_str(), status.c_str());
+	}
+
+	if(!writeReport(reportFile, results, passed))
+		cout << "could not write " << reportFile << "\n";
+	cout << (passed ? "passed" : "FAILED") << " - report: " << reportFile << "\n";
+
+	return passed ? 0 : 1;
+}
@@ -0,0 +1,66 @@
+// streamExport.cpp //////////////////////////////////////
+// renders a song straight to stdout /////////////////////
+//
+// 16 bit stereo 44100hz PCM - as a wav (default) or raw - written out as it renders,
+// so it can go into an encoder without a file in between
+// messages go to stderr
+//
+// usage: streamExport [-raw] song.txt > out
+//        (e.g. streamExport song.txt | flac -o song.flac -
+//              streamExport -raw song.txt | opusenc --raw - song.opus)
+
+#include <iostream>
+#include <string>
+#include <cstdio>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+#include "BC/BCPlayer.h"
+
+using namespace std;
+
+int main(int argc, char* argv[])
+{
+	bool wavHeader = true;
+	string source = "";
+
+	for(int a=1; a<argc; a++)
+	{
+		string arg = argv[a];
+		if(arg == "-raw")
+			wavHeader = false;
+		else
+			source = arg;
+	}
+
+	if(source.empty())
+	{
+		cerr << "usage: streamExport [-raw] song.txt > out\n";
+		return 1;
+	}
+
+#ifdef _WIN32
+	_setmode(_fileno(stdout), _O_BINARY); // no newline translation in the samples
+#endif
+
+	// stdout carries the samples - anything the library prints goes to stderr instead
+	cout.rdbuf(cerr.rdbuf());
+
+	// a player of its own - no audio device
+	MML mml;
+	mml.initialize(44100, 120.0);
+	MPlayer* player = new MPlayer();
+	if(!mml.loadSong(source, player))
+	{
+		cerr << "Error loading file: " << source << "\n";
+		delete player;
+		return 1;
+	}
+
+	string result = player->exportToStream(stdout, wavHeader);
+	cerr << result << "\n";
+	delete player;
+
+	return result == "Finished writing stream" ? 0 : 1;
+}
@@ -0,0 +1,519 @@
+// synthBench.cpp ////////////////////////////////////////
+// microbenchmarks for the synthesis kernels /////////////
+//
+// runs each hot primitive on its own, the way MPlayer drives it, and prints
+// nanoseconds per sample (one frame of that kernel's output) - so kernels can be
+// compared with each other, and with an earlier build to catch regressions:
+//   osc/wave/...   - OSC advance + getOutput (both sides) for each waveform
+//   osc/mod/...    - the same for each modulation combo (flip, beef-up, pop guard, Astro / LFO / Fall / Rise)
+//   osc/block/...  - the same combos a block at a time, as exports render them (OSC::renderBlock - each
+//                    run of frames goes through a kernel specialized on the combo, picked once for the run)
+//   nosc/...       - NOSC advance + getOutput for each drum, hit again every 200 msec
+//   delay, compress, lfo, fall, rise - DelayLine::update, MPlayer::compress,
+//                    LFO / Fall / Rise every frame, and every MOD_BLOCK frames as OSC runs them
+//   sfx/n          - SFX::getOutput (both sides) with n of the 16 sounds playing
+//   events/...     - MPlayer::runEvent / runDrumEvent over the events of a made up event heavy song
+//                    (ns per event - a dozen envelope / LFO / waveform / drum tone changes per 3 notes)
+//   parse/size     - MML::setSource + parse on a made up song of that size (ns per source char)
+// prints name <tab> ns, one per line
+//
+// usage: synthBench [samples per benchmark] [only names containing this]
+//        (e.g. synthBench 4000000 nosc)
+
+#include <iostream>
+#include <cstdlib>
+#include <chrono>
+#include <string>
+#include <sstream>
+#include "BC/BCPlayer.h"
+
+using namespace std;
+
+static float sink = 0.0f;	// everything's output ends up here - so none of it is thrown away
+static string filter = "";
+
+static const int MOD_BLOCK = 32;	// frames between OSC's pitch modulation updates
+static const int N_WAVES = 9;
+
+static const char* waveName[N_WAVES] =
+{
+	"sine", "square", "saw", "triangle", "harm3-6-9-12",
+	"harm2-3-4-5", "pulse12", "pulse25", "pulse33"
+};
+
+static const int N_CONFIGS = 10;
+
+static const char* configName[N_CONFIGS] =
+{
+	"plain", "waveflip", "beefup", "popguard", "lfo",
+	"astro", "fall", "rise", "lfo+fall", "all"
+};
+
+static const int N_DRUMS = 6;
+
+static const char* drumName[N_DRUMS] =
+{
+	"kick", "snare", "hihat", "kick-quiet", "snare-quiet", "hihat-quiet"
+};
+
+// time nSamples calls of a kernel - prints and returns ns per sample
+template<class Kernel>
+static double bench(const string &name, Kernel &kernel, long nSamples)
+{
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	for(long f=0; f<nSamples; f++)
+		sink += kernel(f);
+	chrono::steady_clock::time_point end = chrono::steady_clock::now();
+
+	double ns = chrono::duration_cast<chrono::nanoseconds>(end - start).count() / static_cast<double>(nSamples);
+	cout << name << "\t" << ns << endl;
+	return ns;
+}
+
+static bool selected(const string &name)
+	{ return filter.empty() || name.find(filter) != string::npos; }
+
+static string numbered(const string &prefix, int n, const string &suffix)
+{
+	stringstream ss;
+	ss << prefix << n << suffix;
+	return ss.str();
+}
+
+// set the oscillator up for one modulation configuration
+static void setUp(OSC &osc, int config)
+{
+	osc.setNewNote(440.0);
+
+	if(config == 1 || config == 9)
+		osc.flipYAxis();
+	if(config == 2 || config == 9)
+	{
+		osc.enableBeefUp();
+		osc.setBeefUpFactor(1.6f);
+	}
+	if(config == 4 || config == 8 || config == 9)
+	{
+		osc.setLFOwaitTime(0);
+		osc.enableLFO();
+	}
+	if(config == 5 || config == 9)
+	{
+		osc.enableAstro();
+		osc.setAstroSpeed(12);
+	}
+	if(config == 6 || config == 8 || config == 9)
+	{
+		osc.setFallSpeed(20.0);
+		osc.startFall();
+	}
+	if(config == 7 || config == 9)
+	{
+		osc.setRiseSpeed(20.0);
+		osc.setRiseRange(1200.0);
+		osc.startRise();
+	}
+}
+
+// OSC - two outputs and an advance per frame, like MPlayer
+struct OSCKernel
+{
+	OSC &osc;
+	bool newNotes;	// pop guard only runs for a note's first frames - keep starting notes
+
+	OSCKernel(OSC &o, bool n) : osc(o), newNotes(n) {}
+
+	float operator()(long f)
+	{
+		if(newNotes && (f & 63) == 0)
+			osc.setNewNote(440.0);
+		float out = osc.getOutput();
+		out += osc.getOutput();
+		osc.advance();
+		return out;
+	}
+};
+
+// OSC - the same, a block of 64 frames at a time (a note per block, for the pop guard)
+struct OSCBlockKernel
+{
+	static const int BLOCK = 64;
+	OSC &osc;
+	bool newNotes;
+	float out[BLOCK * 2];
+
+	OSCBlockKernel(OSC &o, bool n) : osc(o), newNotes(n) {}
+
+	float operator()(long f)
+	{
+		int i = static_cast<int>(f & (BLOCK - 1));
+		if(i == 0)
+		{
+			if(f > 0) // renderBlock() leaves the last frame's advance to the caller
+				osc.advance();
+			if(newNotes)
+				osc.setNewNote(440.0);
+			osc.renderBlock(out, BLOCK);
+		}
+		return out[i * 2] + out[i * 2 + 1];
+	}
+};
+
+// NOSC - one drum, hit again every 200 msec
+struct NOSCKernel
+{
+	NOSC &nosc;
+	int drum;
+
+	NOSCKernel(NOSC &n, int d) : nosc(n), drum(d) {}
+
+	float operator()(long f)
+	{
+		if(f % 8820 == 0)
+			nosc.setNewDrum(drum);
+		float out = nosc.getOutput();
+		nosc.advance();
+		return out;
+	}
+};
+
+struct DelayKernel
+{
+	DelayLine &delay;
+
+	DelayKernel(DelayLine &d) : delay(d) {}
+
+	float operator()(long f)
+		{ return delay.update(static_cast<float>(f & 255) * (1.0f / 256.0f) - 0.5f); }
+};
+
+// input swept over -1.5 to 1.5 - both sides, below and above the threshold
+struct CompressKernel
+{
+	MPlayer &player;
+
+	CompressKernel(MPlayer &p) : player(p) {}
+
+	float operator()(long f)
+		{ return player.compress(static_cast<float>((f & 1023) - 512) * (1.5f / 512.0f)); }
+};
+
+// LFO / Fall / Rise - every frame (step = 1), or once per block of step frames as OSC runs them
+template<class Mod>
+struct ModKernel
+{
+	Mod &mod;
+	int step;
+
+	ModKernel(Mod &m, int s) : mod(m), step(s) {}
+
+	float operator()(long f)
+	{
+		if(f % step != 0)
+			return 0.0f;
+		float out = static_cast<float>(mod.getOctaves());
+		mod.skip(step);
+		if(f % 88200 == 0) // start over every 2 seconds - Fall / Rise settle after a while
+			mod.refresh();
+		return out;
+	}
+};
+
+// SFX - both sides per frame, the sounds started again as they run out
+struct SFXKernel
+{
+	SFX &sfx;
+	int nSounds;
+
+	SFXKernel(SFX &s, int n) : sfx(s), nSounds(n) {}
+
+	float operator()(long)
+	{
+		float out = sfx.getOutput(0);
+		out += sfx.getOutput(1);
+		if(!sfx.sound[0].playing)
+			for(int i=0; i<nSounds; i++)
+				sfx.sound[i].start();
+		return out;
+	}
+};
+
+// events, one after another, as the sequencer finds them in the streams - round and round
+struct EventKernel
+{
+	MPlayer &player;
+	vector<int> channel;	// 9 = drums
+	vector<SeqRecord> record;
+	size_t pos;
+
+	EventKernel(MPlayer &p) : player(p), pos(0) {}
+
+	// take the events out of the parsed channels (channels 0 - 8, and / or the drums)
+	void collect(bool music, bool drums)
+	{
+		for(int ch=0; ch<10; ch++)
+		{
+			if((ch < 9 && !music) || (ch == 9 && !drums))
+				continue;
+			const vector<SeqRecord> &stream = ch < 9 ? player.data[ch].stream : player.ddata.stream;
+			for(size_t i=0; i<stream.size(); i++)
+			{
+				if(stream[i].op == SeqRecord::EVENT)
+				{
+					channel.push_back(ch);
+					record.push_back(stream[i]);
+				}
+			}
+		}
+	}
+
+	float operator()(long)
+	{
+		if(channel[pos] < 9)
+			player.runEvent(channel[pos], record[pos]);
+		else
+			player.runDrumEvent(record[pos]);
+		if(++pos == record.size())
+			pos = 0;
+		return 0.0f;
+	}
+};
+
+// a made up song of about this many chars - every channel and the drums, notes, rests, ties and loops
+static string makeSource(int size)
+{
+	string source = "@G\nTEMPO=140\nMASTERVOLUME=70\nDELAY=ON\nLOOP=OFF\n\n";
+	int perChannel = size / 10;
+	for(int ch=0; ch<10; ch++)
+	{
+		string part;
+		if(ch < 9)
+		{
+			part = string("@") + static_cast<char>('1' + ch) + "\nLFO=ON\nL8 O4\n";
+			while(static_cast<int>(part.size()) < perChannel)
+				part += "CDEF GAB>C <[3C#D#E] F~~G :A:B {G16F16E16D16} ~~C~\n";
+		}
+		else
+		{
+			part = "@D\nL16\n";
+			while(static_cast<int>(part.size()) < perChannel)
+				part += "K::k ::HH S~~~ hssh K::K ::KK S~~s [KK]SKS\n";
+		}
+		source += part + "\n";
+	}
+	return source;
+}
+
+// a made up song that's mostly events - every line changes a dozen settings, then plays 3 notes
+static string makeEventSource(int nLines)
+{
+	stringstream ss;
+	ss << "@G\nTEMPO=150\n\n";
+	for(int ch=1; ch<=9; ch++)
+	{
+		ss << "@" << ch << "\nL32 O4\n";
+		for(int i=0; i<nLines; i++)
+			ss << "LFOSPEED=" << 4 + i % 3 << " LFORANGE=" << 20 + i % 5 << " PEAKLEVEL=90 SUSTAINLEVEL=" << 30 + i % 7
+				<< " DECAYTIME=" << 30 + i % 4 << " ATTACKTIME=2 RELEASETIME=" << 40 + i % 6 << " WAVEFORM=" << i % 9
+				<< " BEEFUP=" << 20 + i % 50 << " FALLSPEED=" << 10 + i % 8 << " ASTRO=" << 8 + i % 5
+				<< " ASTRO=OFF LFO=ON C E G\n";
+		ss << "\n";
+	}
+	ss << "@D\nL32\n";
+	for(int i=0; i<nLines; i++)
+		ss << "KICKPITCH=" << 30 + i % 20 << " SNAREPITCH=" << 40 + i % 20 << " HIHATPITCH=" << 50 + i % 20
+			<< " BEEFUP=" << 20 + i % 50 << " SQUARELEVEL=" << 70 + i % 30 << " NOISELEVEL=" << 60 + i % 40
+			<< " KICKLENGTH=" << 80 + i % 20 << " SNARELENGTH=" << 100 + i % 20 << " K s h\n";
+	return ss.str();
+}
+
+int main(int argc, char* argv[])
+{
+	long nSamples = 4000000;
+	if(argc > 1)
+		nSamples = atol(argv[1]);
+	if(argc > 2)
+		filter = argv[2];
+	if(nSamples < 1)
+		nSamples = 1;
+
+	// OSC - each waveform, plain
+	for(int w=0; w<N_WAVES; w++)
+	{
+		string name = string("osc/wave/") + waveName[w];
+		if(!selected(name))
+			continue;
+		OSC osc;
+		osc.setTable(w);
+		osc.setNewNote(440.0);
+		OSCKernel kernel(osc, false);
+		bench(name, kernel, nSamples);
+	}
+
+	// OSC - each modulation combo, default table
+	for(int c=0; c<N_CONFIGS; c++)
+	{
+		string name = string("osc/mod/") + configName[c];
+		if(!selected(name))
+			continue;
+		OSC osc;
+		setUp(osc, c);
+		OSCKernel kernel(osc, c == 3);
+		bench(name, kernel, nSamples);
+	}
+
+	// OSC - each modulation combo, rendered a block at a time
+	for(int c=0; c<N_CONFIGS; c++)
+	{
+		string name = string("osc/block/") + configName[c];
+		if(!selected(name))
+			continue;
+		OSC osc;
+		setUp(osc, c);
+		OSCBlockKernel kernel(osc, c == 3);
+		bench(name, kernel, nSamples);
+	}
+
+	// NOSC - each drum
+	for(int d=0; d<N_DRUMS; d++)
+	{
+		string name = string("nosc/") + drumName[d];
+		if(!selected(name))
+			continue;
+		NOSC nosc;
+		nosc.resetDrumTones();
+		NOSC::HitBank hits;
+		nosc.fillHitBank(hits); // as a loaded song plays them
+		NOSCKernel kernel(nosc, d);
+		bench(name, kernel, nSamples);
+	}
+
+	if(selected("delay/update"))
+	{
+		DelayLine delay;
+		delay.setParameters(250, 250, 0.3f);
+		DelayKernel kernel(delay);
+		bench("delay/update", kernel, nSamples);
+	}
+
+	if(selected("mplayer/compress"))
+	{
+		MPlayer* player = new MPlayer();
+		CompressKernel kernel(*player);
+		bench("mplayer/compress", kernel, nSamples);
+		delete player;
+	}
+
+	// LFO / Fall / Rise - per frame, and per MOD_BLOCK
+	for(int s=0; s<2; s++)
+	{
+		int step = s == 0 ? 1 : MOD_BLOCK;
+		string per = s == 0 ? "/frame" : "/block";
+
+		if(selected("lfo" + per))
+		{
+			LFO lfo;
+			lfo.setWaitTime(0);
+			lfo.setRange(40);
+			ModKernel<LFO> kernel(lfo, step);
+			bench("lfo" + per, kernel, nSamples);
+		}
+		if(selected("fall" + per))
+		{
+			Fall fall;
+			fall.setSpeed(20.0);
+			fall.start();
+			ModKernel<Fall> kernel(fall, step);
+			bench("fall" + per, kernel, nSamples);
+		}
+		if(selected("rise" + per))
+		{
+			Rise rise;
+			rise.setSpeed(20.0);
+			rise.setRange(1200.0);
+			rise.start();
+			ModKernel<Rise> kernel(rise, step);
+			bench("rise" + per, kernel, nSamples);
+		}
+	}
+
+	// SFX - 1 to 16 sounds playing at once (one second each, stereo and mono in turn)
+	for(int n=1; n<=SFX::N_SLOTS; n*=2)
+	{
+		string name = numbered("sfx/", n, "");
+		if(!selected(name))
+			continue;
+		SFX* sfx = new SFX();
+		for(int i=0; i<SFX::N_SLOTS; i++)
+		{
+			Sound &sound = sfx->sound[i];
+			sound.stereo = (i & 1) == 0;
+			sound.leftData.assign(44100, 0.25f);
+			sound.rightData.assign(sound.stereo ? 44100 : 0, -0.25f);
+			sound.dataSize = 44100;
+			sound.setGain(0.5f);
+			sound.setPanning(0.3f);
+			if(i < n)
+				sound.start();
+		}
+		SFXKernel kernel(*sfx, n);
+		bench(name, kernel, nSamples);
+		delete sfx;
+	}
+
+	// event dispatch - music channels, then drums
+	for(int d=0; d<2; d++)
+	{
+		string name = d == 0 ? "events/dispatch" : "events/dispatch/drums";
+		if(!selected(name))
+			continue;
+
+		MML mml;
+		mml.initialize(44100, 120.0);
+		MPlayer* player = new MPlayer();
+		player->resetForNewSong();
+		mml.setSource(makeEventSource(200));
+		mml.parse(player);
+
+		EventKernel kernel(*player);
+		kernel.collect(d == 0, d == 1);
+		if(!kernel.record.empty())
+			bench(name, kernel, nSamples);
+		delete player;
+	}
+
+	// MML - parse time per source char, for growing songs
+	for(int size=1024; size<=262144; size*=4)
+	{
+		string name = numbered("parse/", size / 1024, "k");
+		if(!selected(name))
+			continue;
+
+		string source = makeSource(size);
+		MML mml;
+		mml.initialize(44100, 120.0);
+		MPlayer* player = new MPlayer();
+		long reps = max(1L, nSamples / 16 / static_cast<long>(source.size()));
+
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		for(long r=0; r<reps; r++)
+		{
+			player->resetForNewSong();
+			mml.setSource(source);
+			mml.parse(player);
+		}
+		chrono::steady_clock::time_point end = chrono::steady_clock::now();
+		sink += player->getSongLastFrame();
+
+		double ns = chrono::duration_cast<chrono::nanoseconds>(end - start).count()
+			/ (static_cast<double>(reps) * source.size());
+		cout << name << "\t" << ns << endl;
+		delete player;
+	}
+
+	// keep the compiler from throwing the work away
+	if(sink == 12345.0f)
+		cout << sink << endl;
+
+	return 0;
+}